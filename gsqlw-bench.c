@@ -0,0 +1,919 @@
+/*
+ * Glib sql wrapper.
+ *
+ * Copyright (C) 2008-2010 Zonio s.r.o <developers@zonio.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Microbenchmarks of the wrapper overhead.
+ *
+ * Every benchmark runs through gsqlw and through equivalent calls of the
+ * client library on a separate connection to the same database, so the cost
+ * of the wrapper itself is visible. Results are printed as tab separated
+ * values with a header line, latencies are in microseconds.
+ *
+ * Usage: gsqlw-bench [-n ITERATIONS] [-r ROWS] [DSN...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <config.h>
+#include "gsqlw.h"
+
+#ifdef HAVE_SQLITE
+#include <sqlite3.h>
+#endif
+#ifdef HAVE_POSTGRES
+#include <libpq-fe.h>
+#endif
+#ifdef HAVE_MYSQL
+#include <mysql.h>
+#endif
+
+#ifdef HAVE_MYSQL
+# define DEFAULT_DSN "mysql:dbname=test host=localhost user=user password=heslo"
+#elif HAVE_POSTGRES
+# define DEFAULT_DSN "pgsql:dbname=test host=localhost user=postgres password=heslo"
+#elif HAVE_SQLITE
+# define DEFAULT_DSN "sqlite:.bench.db"
+#endif
+
+static int iterations = 2000;
+static int rows = 100;
+
+/* state of one benchmark run */
+struct bench
+{
+  gs_conn* conn;
+  gs_query* query;
+  const char* sql;
+  int fail;                 // number of failed operations
+
+  /* client library */
+  gpointer handle;
+  gpointer stmt;
+};
+
+typedef void (*bench_func)(struct bench* b, int i);
+
+enum
+{
+  BENCH_EXEC,
+  BENCH_PUT,
+  BENCH_GET_I,
+  BENCH_GET_S,
+  BENCH_GET_SDUP,
+  BENCH_GET_ROWS,
+  BENCH_COUNT
+};
+
+/* raw client library implementation of benchmarks */
+struct raw_backend
+{
+  const char* name;         // as returned by gs_get_backend()
+  gboolean (*connect)(struct bench* b, const char* dsn);
+  void (*disconnect)(struct bench* b);
+  gboolean (*prepare)(struct bench* b);
+  void (*finalize)(struct bench* b);
+  void (*exec)(struct bench* b, const char* sql);
+  bench_func funcs[BENCH_COUNT];
+};
+
+#define BENCH_FAIL(b) \
+  G_STMT_START { \
+    (b)->fail++; \
+    if ((b)->conn) \
+      gs_clear_error((b)->conn); \
+  } G_STMT_END
+
+/* gsqlw */
+
+static void gsqlw_exec(struct bench* b, int i)
+{
+  if (gs_exec(b->conn, b->sql, "is", i, "exec") < 0)
+    BENCH_FAIL(b);
+}
+
+static void gsqlw_put(struct bench* b, int i)
+{
+  if (gs_query_put(b->query, "is", i, "put") < 0)
+    BENCH_FAIL(b);
+}
+
+static void gsqlw_get_i(struct bench* b, int i G_GNUC_UNUSED)
+{
+  int id;
+
+  if (gs_query_put(b->query, "i", rows) < 0)
+  {
+    BENCH_FAIL(b);
+    return;
+  }
+  while (gs_query_get(b->query, "i", &id) == 0)
+    ;
+}
+
+static void gsqlw_get_s(struct bench* b, int i G_GNUC_UNUSED)
+{
+  const char* name;
+
+  if (gs_query_put(b->query, "i", rows) < 0)
+  {
+    BENCH_FAIL(b);
+    return;
+  }
+  while (gs_query_get(b->query, "s", &name) == 0)
+    ;
+}
+
+static void gsqlw_get_sdup(struct bench* b, int i G_GNUC_UNUSED)
+{
+  char* name;
+
+  if (gs_query_put(b->query, "i", rows) < 0)
+  {
+    BENCH_FAIL(b);
+    return;
+  }
+  while (gs_query_get(b->query, "S", &name) == 0)
+    g_free(name);
+}
+
+static void gsqlw_get_rows(struct bench* b, int i G_GNUC_UNUSED)
+{
+  if (gs_query_put(b->query, "i", rows) < 0 || gs_query_get_rows(b->query) != rows)
+    BENCH_FAIL(b);
+}
+
+static const struct
+{
+  const char* name;
+  const char* sql;
+  gboolean write;           // run inside transaction
+  bench_func func;
+} benchmarks[BENCH_COUNT] = {
+  { "exec", "INSERT INTO bench_w (id, name) VALUES ($1, $2)", TRUE, gsqlw_exec },
+  { "put", "INSERT INTO bench_w (id, name) VALUES ($1, $2)", TRUE, gsqlw_put },
+  { "get_i", "SELECT id FROM bench WHERE id < $1", FALSE, gsqlw_get_i },
+  { "get_s", "SELECT name FROM bench WHERE id < $1", FALSE, gsqlw_get_s },
+  { "get_S", "SELECT name FROM bench WHERE id < $1", FALSE, gsqlw_get_sdup },
+  { "get_rows", "SELECT id, name FROM bench WHERE id < $1", FALSE, gsqlw_get_rows },
+};
+
+/* sqlite */
+
+#ifdef HAVE_SQLITE
+
+static gboolean sqlite_raw_connect(struct bench* b, const char* dsn)
+{
+  sqlite3* db;
+  char* path;
+  int rs;
+
+  // sqlite ignores driver options of "file:" URI, plain path has them after
+  // '?'
+  if (g_str_has_prefix(dsn, "file:"))
+    path = g_strdup(dsn);
+  else
+    path = g_strndup(dsn, strcspn(dsn, "?"));
+  rs = sqlite3_open_v2(path, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, NULL);
+  g_free(path);
+  if (rs != SQLITE_OK)
+  {
+    fprintf(stderr, "sqlite: %s\n", sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return FALSE;
+  }
+  sqlite3_busy_timeout(db, 5000);
+  b->handle = db;
+  return TRUE;
+}
+
+static void sqlite_raw_disconnect(struct bench* b)
+{
+  sqlite3_close(b->handle);
+}
+
+static gboolean sqlite_raw_prepare(struct bench* b)
+{
+  sqlite3_stmt* stmt;
+
+  if (sqlite3_prepare_v2(b->handle, b->sql, -1, &stmt, NULL) != SQLITE_OK)
+    return FALSE;
+  b->stmt = stmt;
+  return TRUE;
+}
+
+static void sqlite_raw_finalize(struct bench* b)
+{
+  sqlite3_finalize(b->stmt);
+  b->stmt = NULL;
+}
+
+static void sqlite_raw_exec_sql(struct bench* b, const char* sql)
+{
+  sqlite3_exec(b->handle, sql, NULL, NULL, NULL);
+}
+
+static void sqlite_raw_exec(struct bench* b, int i)
+{
+  sqlite3_stmt* stmt;
+
+  if (sqlite3_prepare_v2(b->handle, b->sql, -1, &stmt, NULL) != SQLITE_OK)
+  {
+    BENCH_FAIL(b);
+    return;
+  }
+  sqlite3_bind_int(stmt, 1, i);
+  sqlite3_bind_text(stmt, 2, "exec", -1, SQLITE_STATIC);
+  if (sqlite3_step(stmt) != SQLITE_DONE)
+    BENCH_FAIL(b);
+  sqlite3_finalize(stmt);
+}
+
+static void sqlite_raw_put(struct bench* b, int i)
+{
+  sqlite3_reset(b->stmt);
+  sqlite3_bind_int(b->stmt, 1, i);
+  sqlite3_bind_text(b->stmt, 2, "put", -1, SQLITE_STATIC);
+  if (sqlite3_step(b->stmt) != SQLITE_DONE)
+    BENCH_FAIL(b);
+}
+
+static void sqlite_raw_get_i(struct bench* b, int i G_GNUC_UNUSED)
+{
+  int id;
+
+  sqlite3_reset(b->stmt);
+  sqlite3_bind_int(b->stmt, 1, rows);
+  while (sqlite3_step(b->stmt) == SQLITE_ROW)
+    id = sqlite3_column_int(b->stmt, 0);
+  (void)id;
+}
+
+static void sqlite_raw_get_s(struct bench* b, int i G_GNUC_UNUSED)
+{
+  const unsigned char* name;
+
+  sqlite3_reset(b->stmt);
+  sqlite3_bind_int(b->stmt, 1, rows);
+  while (sqlite3_step(b->stmt) == SQLITE_ROW)
+    name = sqlite3_column_text(b->stmt, 0);
+  (void)name;
+}
+
+static void sqlite_raw_get_sdup(struct bench* b, int i G_GNUC_UNUSED)
+{
+  sqlite3_reset(b->stmt);
+  sqlite3_bind_int(b->stmt, 1, rows);
+  while (sqlite3_step(b->stmt) == SQLITE_ROW)
+    g_free(g_strdup((const char*)sqlite3_column_text(b->stmt, 0)));
+}
+
+static void sqlite_raw_get_rows(struct bench* b, int i G_GNUC_UNUSED)
+{
+  int count = 0;
+
+  sqlite3_reset(b->stmt);
+  sqlite3_bind_int(b->stmt, 1, rows);
+  while (sqlite3_step(b->stmt) == SQLITE_ROW)
+    count++;
+  if (count != rows)
+    BENCH_FAIL(b);
+}
+
+static const struct raw_backend sqlite_raw =
+{
+  "sqlite",
+  sqlite_raw_connect,
+  sqlite_raw_disconnect,
+  sqlite_raw_prepare,
+  sqlite_raw_finalize,
+  sqlite_raw_exec_sql,
+  { sqlite_raw_exec, sqlite_raw_put, sqlite_raw_get_i, sqlite_raw_get_s, sqlite_raw_get_sdup, sqlite_raw_get_rows },
+};
+
+#endif
+
+/* pgsql */
+
+#ifdef HAVE_POSTGRES
+
+static gboolean pgsql_raw_connect(struct bench* b, const char* dsn)
+{
+  PGconn* pg = PQconnectdb(dsn);
+
+  if (PQstatus(pg) != CONNECTION_OK)
+  {
+    fprintf(stderr, "pgsql: %s\n", PQerrorMessage(pg));
+    PQfinish(pg);
+    return FALSE;
+  }
+  b->handle = pg;
+  return TRUE;
+}
+
+static void pgsql_raw_disconnect(struct bench* b)
+{
+  PQfinish(b->handle);
+}
+
+static gboolean pgsql_raw_prepare(struct bench* b)
+{
+  static guint counter;
+  char* name = g_strdup_printf("bench_%u", ++counter);
+  PGresult* res = PQprepare(b->handle, name, b->sql, 0, NULL);
+  gboolean ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+
+  PQclear(res);
+  if (!ok)
+  {
+    g_free(name);
+    return FALSE;
+  }
+  b->stmt = name;
+  return TRUE;
+}
+
+static void pgsql_raw_finalize(struct bench* b)
+{
+  char* sql = g_strdup_printf("DEALLOCATE %s", (char*)b->stmt);
+
+  PQclear(PQexec(b->handle, sql));
+  g_free(sql);
+  g_free(b->stmt);
+  b->stmt = NULL;
+}
+
+static void pgsql_raw_exec_sql(struct bench* b, const char* sql)
+{
+  PQclear(PQexec(b->handle, sql));
+}
+
+static void pgsql_raw_exec(struct bench* b, int i)
+{
+  char id[16];
+  const char* values[2] = { id, "exec" };
+  PGresult* res;
+
+  g_snprintf(id, sizeof(id), "%d", i);
+  res = PQexecParams(b->handle, b->sql, 2, NULL, values, NULL, NULL, 0);
+  if (PQresultStatus(res) != PGRES_COMMAND_OK)
+    BENCH_FAIL(b);
+  PQclear(res);
+}
+
+static void pgsql_raw_put(struct bench* b, int i)
+{
+  char id[16];
+  const char* values[2] = { id, "put" };
+  PGresult* res;
+
+  g_snprintf(id, sizeof(id), "%d", i);
+  res = PQexecPrepared(b->handle, b->stmt, 2, values, NULL, NULL, 0);
+  if (PQresultStatus(res) != PGRES_COMMAND_OK)
+    BENCH_FAIL(b);
+  PQclear(res);
+}
+
+/* Execute prepared select, NULL on error. */
+static PGresult* pgsql_raw_select(struct bench* b)
+{
+  char limit[16];
+  const char* values[1] = { limit };
+  PGresult* res;
+
+  g_snprintf(limit, sizeof(limit), "%d", rows);
+  res = PQexecPrepared(b->handle, b->stmt, 1, values, NULL, NULL, 0);
+  if (PQresultStatus(res) != PGRES_TUPLES_OK)
+  {
+    BENCH_FAIL(b);
+    PQclear(res);
+    return NULL;
+  }
+  return res;
+}
+
+static void pgsql_raw_get_i(struct bench* b, int i G_GNUC_UNUSED)
+{
+  PGresult* res = pgsql_raw_select(b);
+  int row, id;
+
+  if (res == NULL)
+    return;
+  for (row = 0; row < PQntuples(res); row++)
+    id = atoi(PQgetvalue(res, row, 0));
+  (void)id;
+  PQclear(res);
+}
+
+static void pgsql_raw_get_s(struct bench* b, int i G_GNUC_UNUSED)
+{
+  PGresult* res = pgsql_raw_select(b);
+  const char* name;
+  int row;
+
+  if (res == NULL)
+    return;
+  for (row = 0; row < PQntuples(res); row++)
+    name = PQgetvalue(res, row, 0);
+  (void)name;
+  PQclear(res);
+}
+
+static void pgsql_raw_get_sdup(struct bench* b, int i G_GNUC_UNUSED)
+{
+  PGresult* res = pgsql_raw_select(b);
+  int row;
+
+  if (res == NULL)
+    return;
+  for (row = 0; row < PQntuples(res); row++)
+    g_free(g_strdup(PQgetvalue(res, row, 0)));
+  PQclear(res);
+}
+
+static void pgsql_raw_get_rows(struct bench* b, int i G_GNUC_UNUSED)
+{
+  PGresult* res = pgsql_raw_select(b);
+
+  if (res == NULL)
+    return;
+  if (PQntuples(res) != rows)
+    BENCH_FAIL(b);
+  PQclear(res);
+}
+
+static const struct raw_backend pgsql_raw =
+{
+  "pgsql",
+  pgsql_raw_connect,
+  pgsql_raw_disconnect,
+  pgsql_raw_prepare,
+  pgsql_raw_finalize,
+  pgsql_raw_exec_sql,
+  { pgsql_raw_exec, pgsql_raw_put, pgsql_raw_get_i, pgsql_raw_get_s, pgsql_raw_get_sdup, pgsql_raw_get_rows },
+};
+
+#endif
+
+/* mysql */
+
+#ifdef HAVE_MYSQL
+
+/* "$1" placeholders to "?" */
+static char* mysql_raw_sql(const char* sql)
+{
+  GString* str = g_string_new(NULL);
+
+  for (; *sql; sql++)
+  {
+    if (*sql == '$' && g_ascii_isdigit(sql[1]))
+    {
+      g_string_append_c(str, '?');
+      while (g_ascii_isdigit(sql[1]))
+        sql++;
+    }
+    else
+      g_string_append_c(str, *sql);
+  }
+
+  return g_string_free(str, FALSE);
+}
+
+static gboolean mysql_raw_connect(struct bench* b, const char* dsn)
+{
+  char** keyvals = g_strsplit(dsn, " ", -1);
+  const char* host = "localhost";
+  const char* dbname = "mysql";
+  const char* user = "mysql";
+  const char* password = "mysql";
+  unsigned int port = 0;
+  MYSQL* my;
+  int i;
+
+  for (i = 0; keyvals[i]; i++)
+  {
+    char* value = strchr(keyvals[i], '=');
+
+    if (value == NULL)
+      continue;
+    *value++ = '\0';
+    if (!strcmp(keyvals[i], "host"))
+      host = value;
+    else if (!strcmp(keyvals[i], "port"))
+      port = atoi(value);
+    else if (!strcmp(keyvals[i], "dbname"))
+      dbname = value;
+    else if (!strcmp(keyvals[i], "user"))
+      user = value;
+    else if (!strcmp(keyvals[i], "password"))
+      password = value;
+  }
+
+  my = mysql_init(NULL);
+  if (mysql_real_connect(my, host, user, password, dbname, port, NULL, 0) == NULL)
+  {
+    fprintf(stderr, "mysql: %s\n", mysql_error(my));
+    mysql_close(my);
+    g_strfreev(keyvals);
+    return FALSE;
+  }
+  g_strfreev(keyvals);
+  b->handle = my;
+  return TRUE;
+}
+
+static void mysql_raw_disconnect(struct bench* b)
+{
+  mysql_close(b->handle);
+}
+
+static MYSQL_STMT* mysql_raw_stmt_new(struct bench* b)
+{
+  MYSQL_STMT* stmt = mysql_stmt_init(b->handle);
+  char* sql = mysql_raw_sql(b->sql);
+
+  if (mysql_stmt_prepare(stmt, sql, strlen(sql)) != 0)
+  {
+    mysql_stmt_close(stmt);
+    stmt = NULL;
+  }
+  g_free(sql);
+  return stmt;
+}
+
+static gboolean mysql_raw_prepare(struct bench* b)
+{
+  b->stmt = mysql_raw_stmt_new(b);
+  return b->stmt != NULL;
+}
+
+static void mysql_raw_finalize(struct bench* b)
+{
+  mysql_stmt_close(b->stmt);
+  b->stmt = NULL;
+}
+
+static void mysql_raw_exec_sql(struct bench* b, const char* sql)
+{
+  mysql_query(b->handle, sql);
+}
+
+static int mysql_raw_insert(MYSQL_STMT* stmt, int id, const char* name)
+{
+  MYSQL_BIND bind[2];
+  unsigned long name_len = strlen(name);
+
+  memset(bind, 0, sizeof(bind));
+  bind[0].buffer_type = MYSQL_TYPE_LONG;
+  bind[0].buffer = &id;
+  bind[1].buffer_type = MYSQL_TYPE_STRING;
+  bind[1].buffer = (char*)name;
+  bind[1].buffer_length = name_len;
+  bind[1].length = &name_len;
+  if (mysql_stmt_bind_param(stmt, bind) != 0)
+    return -1;
+  return mysql_stmt_execute(stmt) != 0 ? -1 : 0;
+}
+
+static void mysql_raw_exec(struct bench* b, int i)
+{
+  MYSQL_STMT* stmt = mysql_raw_stmt_new(b);
+
+  if (stmt == NULL || mysql_raw_insert(stmt, i, "exec") < 0)
+    BENCH_FAIL(b);
+  if (stmt)
+    mysql_stmt_close(stmt);
+}
+
+static void mysql_raw_put(struct bench* b, int i)
+{
+  if (mysql_raw_insert(b->stmt, i, "put") < 0)
+    BENCH_FAIL(b);
+}
+
+/* Execute prepared select and store its result, result is bound to given
+ * buffer unless it is NULL.
+ */
+static int mysql_raw_select(struct bench* b, MYSQL_BIND* result)
+{
+  MYSQL_BIND param;
+  int limit = rows;
+
+  memset(&param, 0, sizeof(param));
+  param.buffer_type = MYSQL_TYPE_LONG;
+  param.buffer = &limit;
+  if (mysql_stmt_bind_param(b->stmt, &param) != 0 ||
+      mysql_stmt_execute(b->stmt) != 0 ||
+      (result && mysql_stmt_bind_result(b->stmt, result) != 0) ||
+      mysql_stmt_store_result(b->stmt) != 0)
+  {
+    BENCH_FAIL(b);
+    return -1;
+  }
+  return 0;
+}
+
+static void mysql_raw_get_i(struct bench* b, int i G_GNUC_UNUSED)
+{
+  MYSQL_BIND result;
+  int id;
+
+  memset(&result, 0, sizeof(result));
+  result.buffer_type = MYSQL_TYPE_LONG;
+  result.buffer = &id;
+  if (mysql_raw_select(b, &result) < 0)
+    return;
+  while (mysql_stmt_fetch(b->stmt) == 0)
+    ;
+  mysql_stmt_free_result(b->stmt);
+}
+
+static void mysql_raw_get_s(struct bench* b, int i G_GNUC_UNUSED)
+{
+  MYSQL_BIND result;
+  char name[256];
+  unsigned long length;
+
+  memset(&result, 0, sizeof(result));
+  result.buffer_type = MYSQL_TYPE_STRING;
+  result.buffer = name;
+  result.buffer_length = sizeof(name);
+  result.length = &length;
+  if (mysql_raw_select(b, &result) < 0)
+    return;
+  while (mysql_stmt_fetch(b->stmt) == 0)
+    ;
+  mysql_stmt_free_result(b->stmt);
+}
+
+static void mysql_raw_get_sdup(struct bench* b, int i G_GNUC_UNUSED)
+{
+  MYSQL_BIND result;
+  char name[256];
+  unsigned long length;
+
+  memset(&result, 0, sizeof(result));
+  result.buffer_type = MYSQL_TYPE_STRING;
+  result.buffer = name;
+  result.buffer_length = sizeof(name);
+  result.length = &length;
+  if (mysql_raw_select(b, &result) < 0)
+    return;
+  while (mysql_stmt_fetch(b->stmt) == 0)
+    g_free(g_strndup(name, MIN(length, sizeof(name))));
+  mysql_stmt_free_result(b->stmt);
+}
+
+static void mysql_raw_get_rows(struct bench* b, int i G_GNUC_UNUSED)
+{
+  if (mysql_raw_select(b, NULL) < 0)
+    return;
+  if (mysql_stmt_num_rows(b->stmt) != (my_ulonglong)rows)
+    BENCH_FAIL(b);
+  mysql_stmt_free_result(b->stmt);
+}
+
+static const struct raw_backend mysql_raw =
+{
+  "mysql",
+  mysql_raw_connect,
+  mysql_raw_disconnect,
+  mysql_raw_prepare,
+  mysql_raw_finalize,
+  mysql_raw_exec_sql,
+  { mysql_raw_exec, mysql_raw_put, mysql_raw_get_i, mysql_raw_get_s, mysql_raw_get_sdup, mysql_raw_get_rows },
+};
+
+#endif
+
+static const struct raw_backend* raw_backends[] = {
+#ifdef HAVE_SQLITE
+  &sqlite_raw,
+#endif
+#ifdef HAVE_POSTGRES
+  &pgsql_raw,
+#endif
+#ifdef HAVE_MYSQL
+  &mysql_raw,
+#endif
+};
+
+/* measurement */
+
+static gint64 now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (gint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_samples(const void* a, const void* b)
+{
+  gint64 x = *(const gint64*)a;
+  gint64 y = *(const gint64*)b;
+
+  return x < y ? -1 : x > y;
+}
+
+#define PERCENTILE_US(samples, n, p) \
+  ((samples)[MIN((n) - 1, (n) * (p) / 100)] / 1000.0)
+
+/* Run func, print result line and return operations per second. raw_ops is
+ * the result of the same benchmark through client library, 0 if not known.
+ */
+static double bench_run(const char* backend, const char* impl, const char* name,
+                        bench_func func, struct bench* b, double raw_ops)
+{
+  gint64* samples = g_new(gint64, iterations);
+  gint64 total = 0;
+  double ops;
+  int i;
+
+  // warm up statement caches and buffers
+  for (i = 0; i < MIN(iterations / 10, 100); i++)
+    func(b, -1 - i);
+
+  b->fail = 0;
+  for (i = 0; i < iterations; i++)
+  {
+    gint64 start = now_ns();
+    func(b, i);
+    samples[i] = now_ns() - start;
+    total += samples[i];
+  }
+
+  qsort(samples, iterations, sizeof(gint64), compare_samples);
+  ops = total > 0 ? iterations * 1e9 / total : 0;
+
+  printf("%s\t%s\t%s\t%d\t%d\t%.0f\t%.2f\t%.2f\t%.2f\t%.2f\t",
+         backend, impl, name, iterations, rows, ops,
+         PERCENTILE_US(samples, iterations, 50), PERCENTILE_US(samples, iterations, 90),
+         PERCENTILE_US(samples, iterations, 99), samples[iterations - 1] / 1000.0);
+  if (raw_ops > 0 && ops > 0)
+    printf("%.1f", (raw_ops / ops - 1) * 100);
+  else
+    printf("-");
+  printf("\t%d\n", b->fail);
+  fflush(stdout);
+
+  g_free(samples);
+  return ops;
+}
+
+static int bench_setup(gs_conn* conn)
+{
+  int i;
+
+  gs_exec(conn, "DROP TABLE IF EXISTS bench", NULL);
+  gs_exec(conn, "DROP TABLE IF EXISTS bench_w", NULL);
+  gs_clear_error(conn);
+
+  gs_exec(conn, "CREATE TABLE bench (id INT, name VARCHAR(64))", NULL);
+  gs_exec(conn, "CREATE TABLE bench_w (id INT, name VARCHAR(64))", NULL);
+  gs_begin(conn);
+  for (i = 0; i < rows; i++)
+    gs_exec(conn, "INSERT INTO bench (id, name) VALUES ($1, $2)", "is", i, "benchmark row name");
+  gs_finish(conn);
+
+  if (gs_get_errcode(conn) != GS_ERR_NONE)
+  {
+    fprintf(stderr, "%s: %s\n", gs_get_backend(conn), gs_get_errmsg(conn));
+    return -1;
+  }
+  return 0;
+}
+
+static int bench_dsn(const char* dsn)
+{
+  const struct raw_backend* raw = NULL;
+  struct bench raw_bench = { 0 };
+  struct bench b = { 0 };
+  const char* backend;
+  gboolean raw_ok;
+  gs_conn* conn;
+  guint i;
+
+  conn = gs_connect(dsn);
+  if (conn == NULL || gs_get_errcode(conn) != GS_ERR_NONE)
+  {
+    fprintf(stderr, "%s: %s\n", dsn, conn ? gs_get_errmsg(conn) : "unknown backend");
+    gs_disconnect(conn);
+    return -1;
+  }
+
+  backend = gs_get_backend(conn);
+  if (bench_setup(conn) < 0)
+  {
+    gs_disconnect(conn);
+    return -1;
+  }
+
+  for (i = 0; i < G_N_ELEMENTS(raw_backends); i++)
+    if (!strcmp(raw_backends[i]->name, backend))
+      raw = raw_backends[i];
+  raw_ok = raw && raw->connect(&raw_bench, strchr(dsn, ':') + 1);
+
+  b.conn = conn;
+  for (i = 0; i < BENCH_COUNT; i++)
+  {
+    double raw_ops = 0;
+
+    if (raw_ok)
+    {
+      raw_bench.sql = benchmarks[i].sql;
+      if (i == BENCH_EXEC || raw->prepare(&raw_bench))
+      {
+        if (benchmarks[i].write)
+          raw->exec(&raw_bench, "BEGIN");
+        raw_ops = bench_run(backend, "raw", benchmarks[i].name, raw->funcs[i], &raw_bench, 0);
+        if (benchmarks[i].write)
+          raw->exec(&raw_bench, "COMMIT");
+        if (i != BENCH_EXEC)
+          raw->finalize(&raw_bench);
+      }
+      else
+        fprintf(stderr, "%s: can't prepare %s\n", backend, benchmarks[i].sql);
+    }
+
+    b.sql = benchmarks[i].sql;
+    b.query = i != BENCH_EXEC ? gs_query_new(conn, b.sql) : NULL;
+    if (i != BENCH_EXEC && b.query == NULL)
+    {
+      fprintf(stderr, "%s: %s\n", backend, gs_get_errmsg(conn));
+      gs_clear_error(conn);
+      continue;
+    }
+    if (benchmarks[i].write)
+      gs_begin(conn);
+    bench_run(backend, "gsqlw", benchmarks[i].name, benchmarks[i].func, &b, raw_ops);
+    if (benchmarks[i].write)
+      gs_finish(conn);
+    gs_query_free(b.query);
+  }
+
+  if (raw_ok)
+    raw->disconnect(&raw_bench);
+
+  gs_exec(conn, "DROP TABLE bench", NULL);
+  gs_exec(conn, "DROP TABLE bench_w", NULL);
+  gs_disconnect(conn);
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  GOptionEntry entries[] = {
+    { "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations, "Operations per benchmark", "N" },
+    { "rows", 'r', 0, G_OPTION_ARG_INT, &rows, "Rows read by select benchmarks", "N" },
+    { NULL }
+  };
+  GOptionContext* context;
+  GError* error = NULL;
+  int i, retval = 0;
+
+  context = g_option_context_new("[DSN...] - measure gsqlw overhead");
+  g_option_context_add_main_entries(context, entries, NULL);
+  if (!g_option_context_parse(context, &argc, &argv, &error))
+  {
+    fprintf(stderr, "%s\n", error->message);
+    g_error_free(error);
+    g_option_context_free(context);
+    return 1;
+  }
+  g_option_context_free(context);
+
+  if (iterations < 1 || rows < 1)
+  {
+    fprintf(stderr, "iterations and rows must be positive\n");
+    return 1;
+  }
+
+  printf("backend\timpl\tbenchmark\titerations\trows\tops_per_sec\tp50_us\tp90_us\tp99_us\tmax_us\toverhead_pct\tfailures\n");
+
+  if (argc < 2)
+    retval = bench_dsn(DEFAULT_DSN) < 0;
+  for (i = 1; i < argc; i++)
+    if (bench_dsn(argv[i]) < 0)
+      retval = 1;
+
+  return retval;
+}
@@ -0,0 +1,451 @@
+/*
+ * Glib sql wrapper.
+ *
+ * Copyright (C) 2008-2010 Zonio s.r.o <developers@zonio.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <config.h>
+
+#include "gsqlw-priv.h"
+
+struct _gs_result_cache
+{
+  GMutex lock;
+  gsize max_bytes;
+  gsize size;               // sum of sizes of cached entries
+  GHashTable* entries;      // GBytes key -> gs_cache_entry
+  GQueue lru;               // most recently used entry at the head
+  GHashTable* tables;       // table name -> set of entries reading it
+  guint64 generation;       // incremented by each invalidation
+  guint64 cleared;          // generation of the last gs_result_cache_clear()
+  GHashTable* invalidated;  // table name -> generation of its last invalidation
+  guint64 hits;
+  guint64 misses;
+};
+
+/* entries */
+
+gs_cache_entry* gs_cache_entry_new(int n_cols, int n_rows, const gs_cache_cell* cells, const char* data, gsize data_len)
+{
+  gsize n_values = (gsize)n_cols * n_rows;
+  gsize size = sizeof(gs_cache_entry) + n_values * sizeof(gs_cache_cell) + data_len;
+  gs_cache_entry* entry = g_malloc0(size);
+  char* entry_data = (char*)(entry->cells + n_values);
+
+  entry->refs = 1;
+  entry->n_cols = n_cols;
+  entry->n_rows = n_rows;
+  entry->size = size;
+  memcpy(entry->cells, cells, n_values * sizeof(gs_cache_cell));
+  memcpy(entry_data, data, data_len);
+  entry->data = entry_data;
+
+  return entry;
+}
+
+void gs_cache_entry_unref(gs_cache_entry* entry)
+{
+  if (entry == NULL || !g_atomic_int_dec_and_test(&entry->refs))
+    return;
+  if (entry->key)
+    g_bytes_unref(entry->key);
+  g_strfreev(entry->tables);
+  g_free(entry);
+}
+
+/* Must be called with cache->lock held. */
+static void _cache_remove(gs_result_cache* cache, gs_cache_entry* entry)
+{
+  int i;
+
+  for (i = 0; entry->tables && entry->tables[i]; i++)
+  {
+    GHashTable* readers = g_hash_table_lookup(cache->tables, entry->tables[i]);
+
+    if (readers == NULL)
+      continue;
+    g_hash_table_remove(readers, entry);
+    if (g_hash_table_size(readers) == 0)
+      g_hash_table_remove(cache->tables, entry->tables[i]);
+  }
+
+  g_queue_delete_link(&cache->lru, entry->link);
+  entry->link = NULL;
+  g_hash_table_remove(cache->entries, entry->key);
+  cache->size -= entry->size;
+  gs_cache_entry_unref(entry);
+}
+
+/* cache */
+
+gs_result_cache* gs_result_cache_new(gsize max_bytes)
+{
+  gs_result_cache* cache = g_new0(gs_result_cache, 1);
+
+  g_mutex_init(&cache->lock);
+  cache->max_bytes = max_bytes;
+  cache->entries = g_hash_table_new(g_bytes_hash, g_bytes_equal);
+  cache->tables = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_hash_table_destroy);
+  cache->invalidated = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  g_queue_init(&cache->lru);
+
+  return cache;
+}
+
+void gs_result_cache_clear(gs_result_cache* cache)
+{
+  if (cache == NULL)
+    return;
+
+  g_mutex_lock(&cache->lock);
+  while (!g_queue_is_empty(&cache->lru))
+    _cache_remove(cache, g_queue_peek_head(&cache->lru));
+  // results being read now must not be inserted either
+  cache->cleared = ++cache->generation;
+  g_mutex_unlock(&cache->lock);
+}
+
+void gs_result_cache_free(gs_result_cache* cache)
+{
+  if (cache == NULL)
+    return;
+
+  gs_result_cache_clear(cache);
+  g_hash_table_destroy(cache->entries);
+  g_hash_table_destroy(cache->tables);
+  g_hash_table_destroy(cache->invalidated);
+  g_mutex_clear(&cache->lock);
+  g_free(cache);
+}
+
+void gs_result_cache_get_stats(gs_result_cache* cache, guint64* hits, guint64* misses, gsize* size)
+{
+  if (cache)
+    g_mutex_lock(&cache->lock);
+  if (hits)
+    *hits = cache ? cache->hits : 0;
+  if (misses)
+    *misses = cache ? cache->misses : 0;
+  if (size)
+    *size = cache ? cache->size : 0;
+  if (cache)
+    g_mutex_unlock(&cache->lock);
+}
+
+/* Return referenced entry of the key, NULL if it is not cached or expired. */
+gs_cache_entry* gs_result_cache_lookup(gs_result_cache* cache, GBytes* key)
+{
+  gs_cache_entry* entry;
+
+  g_mutex_lock(&cache->lock);
+  entry = g_hash_table_lookup(cache->entries, key);
+  if (entry && entry->expires <= g_get_monotonic_time())
+  {
+    _cache_remove(cache, entry);
+    entry = NULL;
+  }
+
+  if (entry)
+  {
+    g_queue_unlink(&cache->lru, entry->link);
+    g_queue_push_head_link(&cache->lru, entry->link);
+    g_atomic_int_inc(&entry->refs);
+    cache->hits++;
+  }
+  else
+    cache->misses++;
+  g_mutex_unlock(&cache->lock);
+
+  return entry;
+}
+
+/* Generation to take before the query is executed, see
+ * gs_result_cache_insert().
+ */
+guint64 gs_result_cache_generation(gs_result_cache* cache)
+{
+  guint64 generation;
+
+  g_mutex_lock(&cache->lock);
+  generation = cache->generation;
+  g_mutex_unlock(&cache->lock);
+
+  return generation;
+}
+
+/* Must be called with cache->lock held. */
+static gboolean _cache_invalidated_since(gs_result_cache* cache, char** tables, guint64 generation)
+{
+  int i;
+
+  if (cache->cleared > generation)
+    return TRUE;
+  for (i = 0; tables && tables[i]; i++)
+  {
+    guint64* invalidated = g_hash_table_lookup(cache->invalidated, tables[i]);
+
+    if (invalidated && *invalidated > generation)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/* Cache entry under the key, tables is NULL terminated list of tables the
+ * entry was read from. Entry is not cached if any of the tables was
+ * invalidated after generation was taken, the result may be older than the
+ * write. Entries larger than the whole budget are not cached either.
+ */
+void gs_result_cache_insert(gs_result_cache* cache, GBytes* key, gs_cache_entry* entry, int ttl_ms, char** tables, guint64 generation)
+{
+  gs_cache_entry* old;
+  int i;
+
+  if (entry->size + g_bytes_get_size(key) > cache->max_bytes || entry->key != NULL)
+    return;
+
+  g_mutex_lock(&cache->lock);
+  if (_cache_invalidated_since(cache, tables, generation))
+  {
+    g_mutex_unlock(&cache->lock);
+    return;
+  }
+
+  entry->key = g_bytes_ref(key);
+  entry->size += g_bytes_get_size(key);
+  entry->expires = g_get_monotonic_time() + (gint64)ttl_ms * 1000;
+  entry->tables = g_strdupv(tables);
+  g_atomic_int_inc(&entry->refs);
+
+  old = g_hash_table_lookup(cache->entries, key);
+  if (old)
+    _cache_remove(cache, old);
+
+  while (cache->size + entry->size > cache->max_bytes && !g_queue_is_empty(&cache->lru))
+    _cache_remove(cache, g_queue_peek_tail(&cache->lru));
+
+  g_queue_push_head(&cache->lru, entry);
+  entry->link = cache->lru.head;
+  g_hash_table_insert(cache->entries, entry->key, entry);
+  cache->size += entry->size;
+
+  for (i = 0; tables && tables[i]; i++)
+  {
+    GHashTable* readers = g_hash_table_lookup(cache->tables, tables[i]);
+
+    if (readers == NULL)
+    {
+      readers = g_hash_table_new(g_direct_hash, g_direct_equal);
+      g_hash_table_insert(cache->tables, g_strdup(tables[i]), readers);
+    }
+    g_hash_table_add(readers, entry);
+  }
+  g_mutex_unlock(&cache->lock);
+}
+
+/* Drop entries that read any of the NULL terminated list of tables. Tables
+ * are marked with new generation, so that results being read now are not
+ * inserted later.
+ */
+void gs_result_cache_invalidate(gs_result_cache* cache, char** tables)
+{
+  int i;
+
+  g_mutex_lock(&cache->lock);
+  cache->generation++;
+  for (i = 0; tables && tables[i]; i++)
+  {
+    GHashTable* readers = g_hash_table_lookup(cache->tables, tables[i]);
+    guint64* invalidated = g_hash_table_lookup(cache->invalidated, tables[i]);
+    GList* entries, *l;
+
+    if (invalidated == NULL)
+    {
+      invalidated = g_new(guint64, 1);
+      g_hash_table_insert(cache->invalidated, g_strdup(tables[i]), invalidated);
+    }
+    *invalidated = cache->generation;
+
+    if (readers == NULL)
+      continue;
+    // removal of the last entry destroys the set
+    entries = g_hash_table_get_keys(readers);
+    for (l = entries; l; l = l->next)
+      _cache_remove(cache, l->data);
+    g_list_free(entries);
+  }
+  g_mutex_unlock(&cache->lock);
+}
+
+/* SQL scanning */
+
+/* Split SQL text to lowercase words and punctuation, string literals and
+ * comments are skipped and quoted identifiers unquoted.
+ */
+static GPtrArray* _sql_tokens(const char* sql)
+{
+  GPtrArray* tokens = g_ptr_array_new_with_free_func(g_free);
+  const char* p = sql;
+
+  while (p && *p)
+  {
+    if (g_ascii_isspace(*p))
+      p++;
+    else if (p[0] == '-' && p[1] == '-')
+      p += strcspn(p, "\n");
+    else if (p[0] == '/' && p[1] == '*')
+    {
+      const char* end = strstr(p + 2, "*/");
+      p = end ? end + 2 : p + strlen(p);
+    }
+    else if (*p == '\'')
+    {
+      while (*p == '\'')
+      {
+        const char* end = strchr(p + 1, '\'');
+        p = end ? end + 1 : p + strlen(p);
+      }
+    }
+    else if (g_ascii_isalnum(*p) || *p == '_' || *p == '"' || *p == '`' || *p == '[')
+    {
+      GString* word = g_string_new(NULL);
+
+      // schema.table and quoted parts form one word
+      while (g_ascii_isalnum(*p) || *p == '_' || *p == '$' || *p == '.' || *p == '"' || *p == '`' || *p == '[')
+      {
+        if (*p == '"' || *p == '`' || *p == '[')
+        {
+          char quote = *p == '[' ? ']' : *p;
+          const char* end = strchr(p + 1, quote);
+
+          if (end == NULL)
+            end = p + strlen(p);
+          g_string_append_len(word, p + 1, end - p - 1);
+          p = *end ? end + 1 : end;
+        }
+        else
+          g_string_append_c(word, g_ascii_tolower(*p++));
+      }
+      g_ptr_array_add(tokens, g_string_free(word, FALSE));
+    }
+    else
+      g_ptr_array_add(tokens, g_strndup(p++, 1));
+  }
+
+  return tokens;
+}
+
+#define TOKEN(i) \
+  ((i) >= 0 && (guint)(i) < tokens->len ? (const char*)g_ptr_array_index(tokens, i) : "")
+
+#define TOKEN_IS(i, word) \
+  (!strcmp(TOKEN(i), word))
+
+static gboolean _token_in(const char* token, const char* const* words)
+{
+  for (; *words; words++)
+    if (!strcmp(token, *words))
+      return TRUE;
+  return FALSE;
+}
+
+/* words that may follow table name in FROM list instead of alias */
+static const char* const clause_words[] = {
+  "where", "join", "inner", "left", "right", "full", "cross", "natural", "outer",
+  "on", "using", "group", "order", "limit", "offset", "fetch", "having", "window",
+  "union", "intersect", "except", "for", "returning", "set", "values", NULL
+};
+
+/* modifiers between statement keyword and table name */
+static const char* const table_modifiers[] = {
+  "low_priority", "ignore", "only", "or", "rollback", "abort", "replace", "fail",
+  "if", "exists", "table", NULL
+};
+
+/* Add table name of the token, without schema. */
+static void _sql_add_table(GPtrArray* tables, const char* token)
+{
+  const char* name = strrchr(token, '.');
+  guint i;
+
+  name = name ? name + 1 : token;
+  if (*name == '\0' || !(g_ascii_isalpha(*name) || *name == '_'))
+    return;
+  for (i = 0; i < tables->len; i++)
+    if (!strcmp(g_ptr_array_index(tables, i), name))
+      return;
+  g_ptr_array_add(tables, g_strdup(name));
+}
+
+/* Index of the table name following keyword at i, skipping modifiers. */
+static int _sql_table_index(GPtrArray* tokens, int i)
+{
+  for (i++; _token_in(TOKEN(i), table_modifiers); i++)
+    ;
+  return i;
+}
+
+/* Find tables that SQL statement reads (FROM and JOIN) and modifies (INSERT,
+ * UPDATE, DELETE, REPLACE, TRUNCATE, ALTER and DROP). Lists are NULL
+ * terminated.
+ */
+void gs_sql_tables(const char* sql, char*** reads, char*** writes)
+{
+  GPtrArray* tokens = _sql_tokens(sql);
+  GPtrArray* read_tables = g_ptr_array_new();
+  GPtrArray* write_tables = g_ptr_array_new();
+  int i, j;
+
+  for (i = 0; (guint)i < tokens->len; i++)
+  {
+    if (TOKEN_IS(i, "from") && TOKEN_IS(i - 1, "delete"))
+      _sql_add_table(write_tables, TOKEN(i + 1));
+    else if (TOKEN_IS(i, "from"))
+    {
+      // comma separated list with optional aliases
+      for (j = i + 1; j < (int)tokens->len; j++)
+      {
+        _sql_add_table(read_tables, TOKEN(j));
+        if (TOKEN_IS(j + 1, "as"))
+          j += 2;
+        else if (!_token_in(TOKEN(j + 1), clause_words) && g_ascii_isalpha(*TOKEN(j + 1)))
+          j++;
+        if (!TOKEN_IS(j + 1, ","))
+          break;
+        j++;
+      }
+    }
+    else if (TOKEN_IS(i, "join"))
+      _sql_add_table(read_tables, TOKEN(i + 1));
+    else if (TOKEN_IS(i, "into") && (TOKEN_IS(i - 1, "insert") || TOKEN_IS(i - 1, "replace") || TOKEN_IS(i - 1, "ignore")))
+      _sql_add_table(write_tables, TOKEN(i + 1));
+    else if (TOKEN_IS(i, "update") && !TOKEN_IS(i - 1, "for") && !TOKEN_IS(i - 1, "key") && !TOKEN_IS(i - 1, "do"))
+      _sql_add_table(write_tables, TOKEN(_sql_table_index(tokens, i)));
+    else if (TOKEN_IS(i, "truncate") ||
+             (TOKEN_IS(i, "table") && (TOKEN_IS(i - 1, "alter") || TOKEN_IS(i - 1, "drop"))))
+      _sql_add_table(write_tables, TOKEN(_sql_table_index(tokens, i)));
+  }
+
+  g_ptr_array_add(read_tables, NULL);
+  g_ptr_array_add(write_tables, NULL);
+  *reads = (char**)g_ptr_array_free(read_tables, FALSE);
+  *writes = (char**)g_ptr_array_free(write_tables, FALSE);
+  g_ptr_array_free(tokens, TRUE);
+}
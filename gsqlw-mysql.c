@@ -28,7 +28,6 @@ struct _gs_conn_mysql
 {
     gs_conn base;
     MYSQL* handle;
-    int max_col_len; /* Max length of column text value */
 };
 
 enum _sqlite_query_state
@@ -39,6 +38,16 @@ enum _sqlite_query_state
     QUERY_STATE_COMPLETED,  /* all received rows proccesed */
 };
 
+/* storage of non-string input parameter */
+union _mysql_param_value
+{
+    int i;
+    long long l;
+    double d;
+    signed char b;
+    MYSQL_TIME t;
+};
+
 struct _gs_query_mysql
 {
     gs_query base;
@@ -53,17 +62,34 @@ struct _gs_query_mysql
     int **val_is_null; /* which columns contain NULL values */
     char ***str;       /* memory pointers to string values */
     /* we need to store array of addresses of strings (char*) that's why three * */
+    char *col_type;    /* format character of each binded column */
+    char **col_buf;    /* buffers holding 's' values, grown as needed */
+    unsigned long *col_buf_size;
+    MYSQL_TIME *col_time; /* 't' values, converted to time_target after fetch */
+    gint64 **time_target;
+    char *bound_fmt;   /* format and targets of the current result binding */
+    void **bound_targets;
     int* idx;          /* indices of parameteters in sql string */
-    int params_cnt;    /* count of utouput paramters */
+
+    /* input parameters, kept across executions */
+    MYSQL_BIND *param_bind;
+    unsigned long *param_length;
+    my_bool *param_null;
+    union _mysql_param_value *param_value;
+    char *param_types; /* types binded by last execution */
 };
 
 #define CONN(c) ((struct _gs_conn_mysql*)(c))
 #define QUERY(c) ((struct _gs_query_mysql*)(c))
 
-static int _mysql_prepare_stmt_vars(gs_query* query, const char* fmt, va_list ap);
+static int _mysql_prepare_stmt_vars(gs_query* query, const gs_plan* plan, void** targets);
+static int _mysql_bind_targets(gs_query* query, const gs_plan* plan, void** targets);
 static void _mysql_free_stmt_vars(gs_query *query);
 static void mysql_gs_query_free(gs_query* query);
 static int _mysql_stmt_fetch_prepare(gs_query *query, int col_count);
+static int _mysql_fetch_columns(gs_query *query, int col_count);
+static gint64 _mysql_time_to_usec(const MYSQL_TIME* time);
+static void _mysql_usec_to_time(gint64 usec, MYSQL_TIME* time);
 
 /*
  * Parse DSN from key-value format to array of values
@@ -117,6 +143,7 @@ static char** _mysql_parse_dsn(const char *dsn)
             password = g_strdup((keyvals[i])+keylen+1);
             continue;
         }
+        /* ignored, strings are fetched with their real length */
         if (strncmp(keyvals[i], "textlen", keylen) ==  0)
         {
             g_free(textlen);
@@ -172,7 +199,6 @@ static gs_conn* mysql_gs_connect(const char *dsn)
                                       dsn_chunks[1], dsn_chunks[2],
                                       dsn_chunks[3], atoi(dsn_chunks[4]),
                                       NULL, 0);
-    conn->max_col_len = atoi(dsn_chunks[5]);
     g_strfreev(dsn_chunks);
     if (conn->handle == NULL)
     {
@@ -193,6 +219,11 @@ static void mysql_gs_disconnect(gs_conn *conn)
     }
 }
 
+static int mysql_gs_is_alive(gs_conn* conn)
+{
+    return CONN(conn)->handle != NULL;
+}
+
 static int mysql_gs_begin(gs_conn* conn)
 {
     /* 
@@ -324,19 +355,64 @@ static void mysql_gs_query_free(gs_query* query)
         _mysql_free_stmt_vars(query);
         QUERY(query)->bind = NULL;
     }
+    g_free(QUERY(query)->param_bind);
+    g_free(QUERY(query)->param_length);
+    g_free(QUERY(query)->param_null);
+    g_free(QUERY(query)->param_value);
+    g_free(QUERY(query)->param_types);
     g_free(QUERY(query)->idx);
     g_free(query->sql);
     g_free(query);
     query = NULL;
 }
 
+static int mysql_gs_query_reset(gs_query* query)
+{
+    if (QUERY(query)->bind != NULL)
+        _mysql_free_stmt_vars(query);
+    if (mysql_stmt_free_result(QUERY(query)->stmt) != 0 ||
+        mysql_stmt_reset(QUERY(query)->stmt) != 0)
+        return -1;
+    QUERY(query)->row_no = 0;
+    QUERY(query)->state = QUERY_STATE_INIT;
+    return 0;
+}
+
+#define MYSQL_DEFAULT_FETCH_SIZE 128
+
+static int mysql_gs_query_set_result_mode(gs_query* query, int mode)
+{
+    /*
+     * Streamed rows are read through read-only server side cursor,
+     * otherwise result is stored on the client.
+     */
+    unsigned long cursor_type = CURSOR_TYPE_NO_CURSOR;
+
+    if (mode == GS_RESULT_STREAMING)
+        cursor_type = CURSOR_TYPE_READ_ONLY;
+    else if (mode != GS_RESULT_DEFAULT && mode != GS_RESULT_BUFFERED)
+        return -1;
+
+    if (mysql_stmt_attr_set(QUERY(query)->stmt, STMT_ATTR_CURSOR_TYPE, &cursor_type) != 0)
+        return -1;
+    return 0;
+}
+
 static int mysql_gs_query_get_rows(gs_query* query)
 {
+    if (query->result_mode == GS_RESULT_STREAMING)
+        return GS_ROWS_UNKNOWN;
+
     /* casting from my_ulonglong to int, problem with greater values */
     return (int)QUERY(query)->row_no;
 }
 
-static int mysql_gs_query_getv(gs_query* query, const char* fmt, va_list ap)
+static int mysql_gs_query_get_columns(gs_query* query)
+{
+    return (int)mysql_stmt_field_count(QUERY(query)->stmt);
+}
+
+static int mysql_gs_query_get_plan(gs_query* query, const gs_plan* plan, void** targets)
 {
     if (QUERY(query)->state == QUERY_STATE_INIT)
     {
@@ -353,7 +429,15 @@ static int mysql_gs_query_getv(gs_query* query, const char* fmt, va_list ap)
     if (QUERY(query)->state == QUERY_STATE_ROW_PENDING)
     {
         /* Bind variables with collumns. */
-        ret = _mysql_prepare_stmt_vars(query, fmt, ap);
+        ret = _mysql_prepare_stmt_vars(query, plan, targets);
+        if (ret != 0)
+            return ret;
+    }
+    else if (strcmp(QUERY(query)->bound_fmt, plan->fmt) != 0 ||
+             (plan->n_slots > 0 && memcmp(QUERY(query)->bound_targets, targets, plan->n_slots * sizeof(void*)) != 0))
+    {
+        /* Caller passed other variables than for previous row. */
+        ret = _mysql_bind_targets(query, plan, targets);
         if (ret != 0)
             return ret;
     }
@@ -367,6 +451,7 @@ static int mysql_gs_query_getv(gs_query* query, const char* fmt, va_list ap)
     switch (ret)
     {
         case 0: /* success */
+        case MYSQL_DATA_TRUNCATED: /* string columns are binded without buffer */
         {
             int i;
             for (i = 0; i < col_count; i++)
@@ -374,6 +459,8 @@ static int mysql_gs_query_getv(gs_query* query, const char* fmt, va_list ap)
                 if (QUERY(query)->my_null[i] && (QUERY(query)->val_is_null[i] != NULL))
                     *(QUERY(query)->val_is_null[i]) = 1;
             }
+            if (_mysql_fetch_columns(query, col_count) != 0)
+                return -1;
             break;
         }
         case MYSQL_NO_DATA: /* No more rows/data exists */
@@ -382,12 +469,6 @@ static int mysql_gs_query_getv(gs_query* query, const char* fmt, va_list ap)
             _mysql_free_stmt_vars(query);
             return 1;
         }
-        case MYSQL_DATA_TRUNCATED:
-        {
-            gs_set_error(query->conn, GS_ERR_OTHER, "mysql error: buffer size is small. You probably want to increase buffer size (DSN parameter textlen).");
-            _mysql_free_stmt_vars(query);
-            return -1;
-        }
         default: /* error */
         {
             gs_set_error(query->conn, GS_ERR_OTHER, mysql_stmt_error(stmt));
@@ -399,83 +480,78 @@ static int mysql_gs_query_getv(gs_query* query, const char* fmt, va_list ap)
     return 0;
 }
 
-/*
- * Returns real count of parameter in fmt string.
- * Doesn't count question marks.
- */
-static int _params_cnt(const char* fmt)
-{
-    int cnt = 0;
-    size_t i;
-    for (i = 0; i < strlen(fmt); i++)
-        if (fmt[i] != '?') cnt++;
-    return cnt;
-}
-
 /*
  * Binds collumns with variables user wants store values into.
  */
-static int _mysql_prepare_stmt_vars(gs_query* query, const char* fmt, va_list ap)
+static int _mysql_bind_targets(gs_query* query, const gs_plan* plan, void** targets)
 {
     MYSQL_STMT* stmt = QUERY(query)->stmt;
     int col_count = mysql_stmt_field_count(stmt);
-    int fmt_len = (fmt != NULL) ? strlen(fmt) : 0;
-    
-    QUERY(query)->bind = g_new0(MYSQL_BIND, col_count);
-    QUERY(query)->my_null = g_new0(my_bool, col_count);
-    QUERY(query)->error = g_new0(my_bool, col_count);
-    QUERY(query)->length = g_new0(unsigned long, col_count);
-    QUERY(query)->val_is_null = g_new0(int *, col_count);
-    QUERY(query)->str = g_new0(char**, col_count);
     MYSQL_BIND *bind = QUERY(query)->bind;
-    int col = 0;
     
+    if (plan->n_cols > col_count)
+    {
+        gs_set_error(query->conn, GS_ERR_OTHER, "Invalid format string.");
+        _mysql_free_stmt_vars(query);
+        return -1;
+    }
+
+    memset(bind, 0, col_count * sizeof(MYSQL_BIND));
+    memset(QUERY(query)->val_is_null, 0, col_count * sizeof(int*));
+    memset(QUERY(query)->str, 0, col_count * sizeof(char**));
+    memset(QUERY(query)->col_type, 0, col_count);
+    memset(QUERY(query)->time_target, 0, col_count * sizeof(gint64*));
+
     int i;
-    for (i = 0; i < fmt_len; i++)
+    for (i = 0; i < plan->n_slots; i++)
     {
-        if (fmt[i] == 's')
+        char type = plan->slots[i].type;
+        int col = plan->slots[i].col;
+
+        /* Strings are binded without buffer, mysql_stmt_fetch() only stores
+         * their length and _mysql_fetch_columns() reads them. */
+        if (type == 's' || type == 'S')
         {
-            char** str_ptr = (char**)va_arg(ap, char**);
-            *str_ptr = g_new0(char, CONN(query->conn)->max_col_len);
+            QUERY(query)->str[col] = (char**)targets[i];
+            QUERY(query)->col_type[col] = type;
             bind[col].buffer_type = MYSQL_TYPE_STRING;
-            bind[col].buffer = (char *)*str_ptr;
-            bind[col].buffer_length = CONN(query->conn)->max_col_len;
-            bind[col].is_null = &QUERY(query)->my_null[col];
-            bind[col].length = &QUERY(query)->length[col];
-            bind[col].error = &QUERY(query)->error[col];
-            col++;
+            bind[col].buffer = NULL;
+            bind[col].buffer_length = 0;
         }
-        else if (fmt[i] == 'S')
+        else if (type == 'i' || type == 'b')
         {
-            QUERY(query)->str[col] = (char**)va_arg(ap, char**);
-            bind[col].buffer_type = MYSQL_TYPE_STRING;
-            bind[col].buffer_length = CONN(query->conn)->max_col_len;
-            bind[col].is_null = &QUERY(query)->my_null[col];
-            bind[col].length = &QUERY(query)->length[col];
-            bind[col].error = &QUERY(query)->error[col];
-            col++;
+            /* gboolean is int, value is normalized after fetch */
+            QUERY(query)->col_type[col] = type;
+            bind[col].buffer_type = MYSQL_TYPE_LONG;
+            bind[col].buffer = (int*)targets[i];
         }
-        else if ((fmt[i] == '?') && (i < fmt_len-1) && (fmt[i+1] == 'i'))
+        else if (type == 'l')
         {
-            QUERY(query)->val_is_null[col] = (int*)va_arg(ap, int*);
+            QUERY(query)->col_type[col] = type;
+            bind[col].buffer_type = MYSQL_TYPE_LONGLONG;
+            bind[col].buffer = (gint64*)targets[i];
         }
-        else if (fmt[i] == 'i')
+        else if (type == 'd')
         {
-            int* int_ptr = (int*)va_arg(ap, int*);
-            bind[col].buffer_type = MYSQL_TYPE_LONG;
-            bind[col].buffer = (int *)int_ptr;
-            bind[col].is_null = &QUERY(query)->my_null[col];
-            bind[col].length = &QUERY(query)->length[col];
-            bind[col].error = &QUERY(query)->error[col];
-            col++;
+            QUERY(query)->col_type[col] = type;
+            bind[col].buffer_type = MYSQL_TYPE_DOUBLE;
+            bind[col].buffer = (double*)targets[i];
         }
-        else
+        else if (type == 't')
         {
-            gs_set_error(query->conn, GS_ERR_OTHER, "Invalid format string.");
-            va_end(ap);
-            _mysql_free_stmt_vars(query);
-            return -1;
+            QUERY(query)->col_type[col] = type;
+            QUERY(query)->time_target[col] = (gint64*)targets[i];
+            bind[col].buffer_type = MYSQL_TYPE_DATETIME;
+            bind[col].buffer = &QUERY(query)->col_time[col];
         }
+        else if (type == '?')
+        {
+            QUERY(query)->val_is_null[col] = (int*)targets[i];
+            continue;
+        }
+        bind[col].is_null = &QUERY(query)->my_null[col];
+        bind[col].length = &QUERY(query)->length[col];
+        bind[col].error = &QUERY(query)->error[col];
     }
     if (mysql_stmt_bind_result(stmt, bind) != 0)
     {
@@ -483,14 +559,35 @@ static int _mysql_prepare_stmt_vars(gs_query* query, const char* fmt, va_list ap
         _mysql_free_stmt_vars(query);
         return -1;
     }
-    if (mysql_stmt_store_result(stmt) != 0)
-    {
-        gs_set_error(query->conn, GS_ERR_OTHER, mysql_stmt_error(stmt));
-        _mysql_free_stmt_vars(query);
+
+    g_free(QUERY(query)->bound_fmt);
+    g_free(QUERY(query)->bound_targets);
+    QUERY(query)->bound_fmt = g_strdup(plan->fmt);
+    QUERY(query)->bound_targets = g_memdup(targets, plan->n_slots * sizeof(void*));
+    
+    return 0;
+}
+
+static int _mysql_prepare_stmt_vars(gs_query* query, const gs_plan* plan, void** targets)
+{
+    MYSQL_STMT* stmt = QUERY(query)->stmt;
+    int col_count = mysql_stmt_field_count(stmt);
+    
+    QUERY(query)->bind = g_new0(MYSQL_BIND, col_count);
+    QUERY(query)->my_null = g_new0(my_bool, col_count);
+    QUERY(query)->error = g_new0(my_bool, col_count);
+    QUERY(query)->length = g_new0(unsigned long, col_count);
+    QUERY(query)->val_is_null = g_new0(int *, col_count);
+    QUERY(query)->str = g_new0(char**, col_count);
+    QUERY(query)->col_type = g_new0(char, col_count);
+    QUERY(query)->col_buf = g_new0(char*, col_count);
+    QUERY(query)->col_buf_size = g_new0(unsigned long, col_count);
+    QUERY(query)->col_time = g_new0(MYSQL_TIME, col_count);
+    QUERY(query)->time_target = g_new0(gint64*, col_count);
+
+    if (_mysql_bind_targets(query, plan, targets) != 0)
         return -1;
-    }
-    QUERY(query)->row_no = mysql_stmt_num_rows(QUERY(query)->stmt);
-    QUERY(query)->params_cnt = _params_cnt(fmt);
+
     QUERY(query)->state = QUERY_STATE_ROW_READ;
     /* Now we can call mysql_stmt_fetch(..) and read collumns values. */
     
@@ -498,8 +595,7 @@ static int _mysql_prepare_stmt_vars(gs_query* query, const char* fmt, va_list ap
 }
 
 /*
- * Cleans information about which columns were NULL and allocates
- * new memory for string columns. Must be called before
+ * Cleans information about which columns were NULL. Must be called before
  * each call of mysql_stmt_fetch().
  */
 static int _mysql_stmt_fetch_prepare(gs_query *query, int col_count)
@@ -511,168 +607,291 @@ static int _mysql_stmt_fetch_prepare(gs_query *query, int col_count)
         {
             *QUERY(query)->val_is_null[i]= 0;
         }
-        if (QUERY(query)->str[i])
-        {
-            /* We don't want to free this memory, it's freed by user. */
-            *(QUERY(query)->str[i]) = g_new0(char, CONN(query->conn)->max_col_len);
-            QUERY(query)->bind[i].buffer = *(QUERY(query)->str[i]);
-        }
-    }
-    /* We must rebind because we may have changed some addresses. */
-    if (mysql_stmt_bind_result(QUERY(query)->stmt, QUERY(query)->bind) != 0)
-    {
-        gs_set_error(query->conn, GS_ERR_OTHER, mysql_stmt_error(QUERY(query)->stmt));
-        _mysql_free_stmt_vars(query);
-        return -1;
     }
     
     return 0;
 }
 
-static void _mysql_free_stmt_vars(gs_query *query)
+/*
+ * Finishes columns of fetched row. String columns are read using their real
+ * length, 's' values are stored in per-column buffers that are reused for
+ * next rows, 'S' values are allocated exactly and owned by the user. 'b' and
+ * 't' values are converted in place.
+ */
+static int _mysql_fetch_columns(gs_query *query, int col_count)
 {
+    MYSQL_STMT* stmt = QUERY(query)->stmt;
     int i;
-    /* free memory allocated for string values */
-    if (QUERY(query)->bind != NULL)
+    for (i = 0; i < col_count; i++)
     {
-        for (i = 0; i < QUERY(query)->params_cnt; i++)
+        char type = QUERY(query)->col_type[i];
+        unsigned long len = QUERY(query)->length[i];
+        char* value;
+
+        if (type == 'i' || type == 'l')
         {
-            if (QUERY(query)->bind[i].buffer_type == MYSQL_TYPE_STRING)
+            if (QUERY(query)->error[i])
             {
-                if (QUERY(query)->state == QUERY_STATE_COMPLETED)
-                {
-                    g_free(QUERY(query)->bind[i].buffer);
-                    if (QUERY(query)->str[i])
-                        *(QUERY(query)->str[i]) = NULL;
-                }
-                else
-                {
-                    if (QUERY(query)->str[i] == NULL)
-                        g_free(QUERY(query)->bind[i].buffer);
-                }
+                gs_set_error(query->conn, GS_ERR_OTHER, "Integer value out of range.");
+                _mysql_free_stmt_vars(query);
+                return -1;
             }
+            continue;
         }
-        g_free(QUERY(query)->bind);
-        QUERY(query)->bind = NULL;
+        if (type == 'b')
+        {
+            gboolean* value_ptr = QUERY(query)->bind[i].buffer;
+            if (!QUERY(query)->my_null[i])
+                *value_ptr = *value_ptr != 0;
+            continue;
+        }
+        if (type == 't')
+        {
+            if (!QUERY(query)->my_null[i])
+                *QUERY(query)->time_target[i] = _mysql_time_to_usec(&QUERY(query)->col_time[i]);
+            continue;
+        }
+        if (type != 's' && type != 'S')
+            continue;
+
+        if (QUERY(query)->my_null[i])
+        {
+            *(QUERY(query)->str[i]) = NULL;
+            continue;
+        }
+
+        if (type == 'S')
+            value = g_malloc(len + 1);
+        else
+        {
+            if (QUERY(query)->col_buf_size[i] < len + 1)
+            {
+                QUERY(query)->col_buf_size[i] = len + 1;
+                QUERY(query)->col_buf[i] = g_realloc(QUERY(query)->col_buf[i], len + 1);
+            }
+            value = QUERY(query)->col_buf[i];
+        }
+
+        if (len > 0)
+        {
+            MYSQL_BIND bind;
+            memset(&bind, 0, sizeof(bind));
+            bind.buffer_type = MYSQL_TYPE_STRING;
+            bind.buffer = value;
+            bind.buffer_length = len;
+            bind.length = &len;
+            if (mysql_stmt_fetch_column(stmt, &bind, i, 0) != 0)
+            {
+                gs_set_error(query->conn, GS_ERR_OTHER, mysql_stmt_error(stmt));
+                if (type == 'S')
+                    g_free(value);
+                _mysql_free_stmt_vars(query);
+                return -1;
+            }
+        }
+        value[len] = '\0';
+        *(QUERY(query)->str[i]) = value;
+    }
+    
+    return 0;
+}
+
+static void _mysql_free_stmt_vars(gs_query *query)
+{
+    int i;
+    /* free memory allocated for 's' values */
+    if (QUERY(query)->col_buf != NULL)
+    {
+        int col_count = mysql_stmt_field_count(QUERY(query)->stmt);
+        for (i = 0; i < col_count; i++)
+            g_free(QUERY(query)->col_buf[i]);
     }
+    g_free(QUERY(query)->bind);
     g_free(QUERY(query)->my_null);
     g_free(QUERY(query)->error);
     g_free(QUERY(query)->length);
     g_free(QUERY(query)->val_is_null);
     g_free(QUERY(query)->str);
+    g_free(QUERY(query)->col_type);
+    g_free(QUERY(query)->col_buf);
+    g_free(QUERY(query)->col_buf_size);
+    g_free(QUERY(query)->col_time);
+    g_free(QUERY(query)->time_target);
+    g_free(QUERY(query)->bound_fmt);
+    g_free(QUERY(query)->bound_targets);
+    QUERY(query)->bind = NULL;
     QUERY(query)->my_null = NULL;
     QUERY(query)->error = NULL;
     QUERY(query)->length = NULL;
     QUERY(query)->val_is_null = NULL;
     QUERY(query)->str = NULL;
+    QUERY(query)->col_type = NULL;
+    QUERY(query)->col_buf = NULL;
+    QUERY(query)->col_buf_size = NULL;
+    QUERY(query)->col_time = NULL;
+    QUERY(query)->time_target = NULL;
+    QUERY(query)->bound_fmt = NULL;
+    QUERY(query)->bound_targets = NULL;
 }
 
-static void _mysql_bind_free(MYSQL_BIND *bind, int length)
+/*
+ * Fills input parameter binds in order of placeholders. Arrays are allocated
+ * on first execution and mysql_stmt_bind_param() is called only when types
+ * or string addresses differ from the previous execution.
+ */
+static int _mysql_bind_params(gs_query* query, const gs_param* params, int count)
 {
+    MYSQL_STMT* stmt = QUERY(query)->stmt;
+    int col_count = mysql_stmt_param_count(stmt);
+    int rebind = FALSE;
     int i;
-    for (i = 0; i < length; i++)
-    {
-        if (bind[i].buffer_type != MYSQL_TYPE_NULL)
-        {
-            g_free(bind[i].buffer);
-        }
-    }
-    g_free(bind);
-    bind = NULL;
-}
 
-static int mysql_gs_query_putv(gs_query* query, const char* fmt, va_list ap)
-{
-    if (QUERY(query)->state == QUERY_STATE_ROW_READ)
+    if (col_count == 0)
+        return 0;
+
+    if (QUERY(query)->param_bind == NULL)
     {
-        /* Not all rows from previous query were proccesed
-         * so memory wasn't freed. */
-        _mysql_free_stmt_vars(query);
+        QUERY(query)->param_bind = g_new0(MYSQL_BIND, col_count);
+        QUERY(query)->param_length = g_new0(unsigned long, col_count);
+        QUERY(query)->param_null = g_new0(my_bool, col_count);
+        QUERY(query)->param_value = g_new0(union _mysql_param_value, col_count);
+        QUERY(query)->param_types = g_new0(char, col_count);
+        rebind = TRUE;
     }
 
-    MYSQL_STMT* stmt = QUERY(query)->stmt;
-    int param_count = (fmt != NULL) ? strlen(fmt) : 0;
-    int col_count = mysql_stmt_param_count(stmt);
-    MYSQL_BIND *bind_prep = g_new0(MYSQL_BIND, param_count);
-    long unsigned *lengths = g_new0(long unsigned, col_count);
-    
-    /* Firstly prepare structures with input variables */
-    int i, j; /* i indexes ptr in fmt string, j indexes array of MYSQL_BINDs */
-    for (i = 0, j = 0; i < param_count; i++, j++)
+    for (i = 0; i < col_count; i++)
     {
-        int is_null = 0;
-        if (fmt[i] == '?')
+        MYSQL_BIND* bind = QUERY(query)->param_bind + i;
+        int idx = QUERY(query)->idx[i] - 1;  /* parameter index (number after $) */
+
+        if (idx < 0 || idx >= count)
         {
-            is_null = (int)va_arg(ap, int);
-            if (is_null)
-                bind_prep[j].buffer_type = MYSQL_TYPE_NULL;
-            i++;
+            gs_set_error(query->conn, GS_ERR_OTHER, "Missing query parameter.");
+            return -1;
         }
-        
-        if (fmt[i] == 's')
+
+        if (QUERY(query)->param_types[i] != params[idx].type)
         {
-            char* value = g_strdup((char*)va_arg(ap, char*));
-            if (value != NULL)
+            QUERY(query)->param_types[i] = params[idx].type;
+            memset(bind, 0, sizeof(MYSQL_BIND));
+            bind->is_null = &QUERY(query)->param_null[i];
+            switch (params[idx].type)
             {
-                bind_prep[j].buffer_type = MYSQL_TYPE_STRING;
-                bind_prep[j].buffer = (char *)value;
-                bind_prep[j].buffer_length = value ? strlen(value) : 0;
-                lengths[j] = value ? strlen(value) : 0;
-                bind_prep[j].length = &lengths[j];
-                bind_prep[j].is_null = (my_bool *) 0;
-            }
-            else
-            {
-                bind_prep[j].buffer_type = MYSQL_TYPE_NULL;
+                case 's':
+                    bind->buffer_type = MYSQL_TYPE_STRING;
+                    bind->length = &QUERY(query)->param_length[i];
+                    break;
+                case 'l':
+                    bind->buffer_type = MYSQL_TYPE_LONGLONG;
+                    bind->buffer = &QUERY(query)->param_value[i].l;
+                    break;
+                case 'd':
+                    bind->buffer_type = MYSQL_TYPE_DOUBLE;
+                    bind->buffer = &QUERY(query)->param_value[i].d;
+                    break;
+                case 'b':
+                    bind->buffer_type = MYSQL_TYPE_TINY;
+                    bind->buffer = &QUERY(query)->param_value[i].b;
+                    break;
+                case 't':
+                    bind->buffer_type = MYSQL_TYPE_DATETIME;
+                    bind->buffer = &QUERY(query)->param_value[i].t;
+                    break;
+                default:
+                    bind->buffer_type = MYSQL_TYPE_LONG;
+                    bind->buffer = &QUERY(query)->param_value[i].i;
             }
+            rebind = TRUE;
         }
-        else if (fmt[i] == 'i')
+
+        QUERY(query)->param_null[i] = params[idx].is_null;
+        if (params[idx].is_null)
+            continue;
+
+        if (params[idx].type == 's')
         {
-            int value = (int)va_arg(ap, int);
-            if (! is_null)
+            /* caller's string is used directly, it is not needed after execute */
+            if (bind->buffer != (void*)params[idx].value.s)
             {
-                bind_prep[j].buffer_type = MYSQL_TYPE_LONG;
-                bind_prep[j].buffer = g_new0(int, 1);
-                memcpy(bind_prep[j].buffer, &value, sizeof(int));
-                bind_prep[j].length = 0;
-                bind_prep[j].is_null = (my_bool *) 0;
+                bind->buffer = (void*)params[idx].value.s;
+                rebind = TRUE;
             }
+            QUERY(query)->param_length[i] = strlen(params[idx].value.s);
+            bind->buffer_length = QUERY(query)->param_length[i];
         }
+        else if (params[idx].type == 'l')
+            QUERY(query)->param_value[i].l = params[idx].value.l;
+        else if (params[idx].type == 'd')
+            QUERY(query)->param_value[i].d = params[idx].value.d;
+        else if (params[idx].type == 'b')
+            QUERY(query)->param_value[i].b = params[idx].value.i;
+        else if (params[idx].type == 't')
+            _mysql_usec_to_time(params[idx].value.l, &QUERY(query)->param_value[i].t);
         else
-        {
-            gs_set_error(query->conn, GS_ERR_OTHER, "Invalid format string.");
-            g_free(lengths);
-            _mysql_bind_free(bind_prep, param_count);
-            return -1;
-        }
+            QUERY(query)->param_value[i].i = params[idx].value.i;
     }
-    
-    /* Now copy prepared MYSQL_BIND structures to appropriate places
-     * according to position parameters */
-    MYSQL_BIND *bind = g_new0(MYSQL_BIND, col_count);
-    for (i = 0; i < col_count; i++)
+
+    if (rebind && mysql_stmt_bind_param(stmt, QUERY(query)->param_bind) != 0)
     {
-        int idx = QUERY(query)->idx[i] - 1;  /* parameter index (number after $) */
-        memcpy(bind+i, bind_prep+idx, sizeof(MYSQL_BIND));
-        if (bind[i].buffer_type == MYSQL_TYPE_LONG)
-        {
-            bind[i].buffer = g_new0(int, 1);
-            memcpy(bind[i].buffer, bind_prep[idx].buffer, sizeof(int));
-        }
-        else if (bind[i].buffer_type == MYSQL_TYPE_STRING)
-        {
-            bind[i].buffer = g_strdup(bind_prep[idx].buffer);
-        }
+        gs_set_error(query->conn, GS_ERR_OTHER, mysql_stmt_error(stmt));
+        /* force rebind next time */
+        memset(QUERY(query)->param_types, 0, col_count);
+        return -1;
     }
-    _mysql_bind_free(bind_prep, param_count);
-    
-    if (mysql_stmt_bind_param(stmt, bind) != 0)
+
+    return 0;
+}
+
+/*
+ * DATETIME values are exchanged as wall clock time of the session time zone,
+ * 't' values are taken as UTC.
+ */
+static gint64 _mysql_time_to_usec(const MYSQL_TIME* time)
+{
+    gs_time tm = { time->year, time->month, time->day, time->hour, time->minute,
+                   time->second, time->second_part };
+    return gs_time_join(&tm);
+}
+
+static void _mysql_usec_to_time(gint64 usec, MYSQL_TIME* time)
+{
+    gs_time tm;
+    gs_time_split(usec, &tm);
+    memset(time, 0, sizeof(MYSQL_TIME));
+    time->year = tm.year;
+    time->month = tm.month;
+    time->day = tm.day;
+    time->hour = tm.hour;
+    time->minute = tm.minute;
+    time->second = tm.second;
+    time->second_part = tm.usec;
+    time->time_type = MYSQL_TIMESTAMP_DATETIME;
+}
+
+static int mysql_gs_query_put_params(gs_query* query, const gs_param* params, int count)
+{
+    if (QUERY(query)->state == QUERY_STATE_ROW_READ)
     {
-        gs_set_error(query->conn, GS_ERR_OTHER, mysql_stmt_error(stmt));
-        g_free(lengths);
-        _mysql_bind_free(bind, col_count);
+        /* Not all rows from previous query were proccesed
+         * so memory wasn't freed. */
+        _mysql_free_stmt_vars(query);
+    }
+
+    MYSQL_STMT* stmt = QUERY(query)->stmt;
+
+    if (_mysql_bind_params(query, params, count) != 0)
         return -1;
+
+    if (query->result_mode == GS_RESULT_STREAMING)
+    {
+        unsigned long prefetch = query->fetch_size > 0 ? query->fetch_size : MYSQL_DEFAULT_FETCH_SIZE;
+        if (mysql_stmt_attr_set(stmt, STMT_ATTR_PREFETCH_ROWS, &prefetch) != 0)
+        {
+            gs_set_error(query->conn, GS_ERR_OTHER, mysql_stmt_error(stmt));
+            return -1;
+        }
     }
+
     if (mysql_stmt_execute(stmt) != 0)
     {
         unsigned err_code = mysql_stmt_errno(stmt);
@@ -695,26 +914,37 @@ static int mysql_gs_query_putv(gs_query* query, const char* fmt, va_list ap)
                 gs_set_error(query->conn, GS_ERR_OTHER, mysql_stmt_error(stmt));
             }
         }
-        g_free(lengths);
-        _mysql_bind_free(bind, col_count);
         return -1;
     }
     
+    /*
+     * Result is stored on the client right away, so that the connection is
+     * free for other statements before the rows are read. Streamed rows stay
+     * on the server until mysql_stmt_fetch().
+     */
+    if (query->result_mode != GS_RESULT_STREAMING && mysql_stmt_field_count(stmt) > 0)
+    {
+        if (mysql_stmt_store_result(stmt) != 0)
+        {
+            gs_set_error(query->conn, GS_ERR_OTHER, mysql_stmt_error(stmt));
+            return -1;
+        }
+        QUERY(query)->row_no = mysql_stmt_num_rows(stmt);
+    }
+
     QUERY(query)->state = QUERY_STATE_ROW_PENDING;
     
-    g_free(lengths);
-    _mysql_bind_free(bind, col_count);
     return 0;
 }
 
-static int mysql_gs_query_get_last_id(gs_query* query, const char* seq_name)
+static gint64 mysql_gs_query_get_last_id(gs_query* query, const char* seq_name)
 {
     /*
-     * Can be called after at least one call of mysql_gs_query_getv
+     * Can be called after at least one call of mysql_gs_query_get_plan
      * else returns undefined value.
      */
     my_ulonglong id = mysql_insert_id(CONN(query->conn)->handle);
-    return (int)id;
+    return (gint64)id;
 }
 
 gs_driver mysql_driver =
@@ -722,13 +952,19 @@ gs_driver mysql_driver =
   .name = "mysql",
   .connect = mysql_gs_connect,
   .disconnect = mysql_gs_disconnect,
+  .is_alive = mysql_gs_is_alive,
   .begin = mysql_gs_begin,
   .commit = mysql_gs_commit,
   .rollback = mysql_gs_rollback,
   .query_new = mysql_gs_query_new,
   .query_free = mysql_gs_query_free,
-  .query_getv = mysql_gs_query_getv,
-  .query_putv = mysql_gs_query_putv,
+  .query_reset = mysql_gs_query_reset,
+  .query_get_plan = mysql_gs_query_get_plan,
+  .query_put_params = mysql_gs_query_put_params,
+  .query_set_result_mode = mysql_gs_query_set_result_mode,
   .query_get_rows = mysql_gs_query_get_rows,
+  .query_get_columns = mysql_gs_query_get_columns,
   .query_get_last_id = mysql_gs_query_get_last_id,
+  .explain_prefix = "EXPLAIN FORMAT=JSON ",
+  .explain_fmt = "s",
 };
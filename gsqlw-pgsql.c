@@ -19,7 +19,9 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <libpq-fe.h>
+#include <glib-unix.h>
 
 #include "gsqlw-priv.h"
 
@@ -27,6 +29,12 @@ struct _gs_conn_pgsql
 {
   gs_conn base;
   PGconn* pg;
+  guint stmt_counter;     // used to generate unique prepared statement names
+  GSList* stmt_garbage;   // statements that could not be deallocated yet
+  gs_query* stream;       // query whose result is being streamed
+  int batch_sent;         // statements sent in pipeline mode
+  int batch_read;         // sent statements whose results were read
+  gs_array_error batch_error; // first failed statement of the batch
 };
 
 struct _gs_query_pgsql
@@ -34,10 +42,71 @@ struct _gs_query_pgsql
   gs_query base;
   PGresult* pg_res;
   int row_no;
+  char* stmt_name;        // server side prepared statement, NULL until reused
+  int executions;         // executions through the unnamed statement
+
+  /* statement description */
+  int n_param_types;
+  Oid* param_types;       // parameter types inferred by the server
+  int result_format;      // 1 if result columns are transferred in binary
+
+  /* parameter buffers reused by all executions */
+  int params_alloc;
+  char** param_values;
+  int* param_lengths;
+  int* param_formats;
+  char* param_buf;        // PGSQL_VALUE_BUF bytes for each parameter
+
+  /* text representation of binary result values */
+  int res_buf_alloc;
+  char* res_buf;          // PGSQL_VALUE_BUF bytes for each result column
+};
+
+struct _gs_copy_pgsql
+{
+  gs_copy base;
+  GString* buf;           // rows not yet passed to PQputCopyData()
+
+  /* COPY TO */
+  int out;
+  int done;               // all rows were received
+  char* row;              // current row from PQgetCopyData()
+  char** fields;          // unescaped fields of the current row, NULL for NULL
+  int n_fields;
+  int fields_alloc;
 };
 
 #define CONN(c) ((struct _gs_conn_pgsql*)(c))
 #define QUERY(c) ((struct _gs_query_pgsql*)(c))
+#define COPY(c) ((struct _gs_copy_pgsql*)(c))
+
+/* from catalog/pg_type.h which is not part of the client API */
+#define PGSQL_BOOLOID 16
+#define PGSQL_INT8OID 20
+#define PGSQL_INT2OID 21
+#define PGSQL_INT4OID 23
+#define PGSQL_TEXTOID 25
+#define PGSQL_NAMEOID 19
+#define PGSQL_BPCHAROID 1042
+#define PGSQL_VARCHAROID 1043
+#define PGSQL_FLOAT4OID 700
+#define PGSQL_FLOAT8OID 701
+#define PGSQL_TIMESTAMPOID 1114
+#define PGSQL_TIMESTAMPTZOID 1184
+
+/* enough for any number or timestamp in text form */
+#define PGSQL_VALUE_BUF GS_TIME_BUF
+
+/* binary timestamps count microseconds from 2000-01-01 */
+#define PGSQL_EPOCH_USEC G_GINT64_CONSTANT(946684800000000)
+
+/* COPY data are sent in chunks of this size */
+#define PGSQL_COPY_BUF 65536
+
+/* cast of other callback types for g_source_set_callback(), since 2.58 */
+#ifndef G_SOURCE_FUNC
+#define G_SOURCE_FUNC(f) ((GSourceFunc)(void (*)(void))(f))
+#endif
 
 static void notices_black_hole(void* arg, const char* message)
 {
@@ -57,16 +126,72 @@ static gs_conn* pgsql_gs_connect(const char* dsn)
   return (gs_conn*)conn;
 }
 
+/* Discard rest of the streamed result, so that connection can be used for
+ * other commands.
+ */
+static void _pgsql_end_stream(gs_conn* conn)
+{
+  PGresult* res;
+
+  if (CONN(conn)->stream == NULL)
+    return;
+
+  while ((res = PQgetResult(CONN(conn)->pg)) != NULL)
+    PQclear(res);
+  CONN(conn)->stream = NULL;
+}
+
 static void pgsql_gs_disconnect(gs_conn* conn)
 {
   if (CONN(conn)->pg)
     PQfinish(CONN(conn)->pg);
+  g_slist_free_full(CONN(conn)->stmt_garbage, g_free);
+  g_free(CONN(conn)->batch_error.msg);
+}
+
+/* Deallocate prepared statement, name is freed. Statements can't be
+ * deallocated while transaction is aborted, these are postponed until
+ * transaction is finished.
+ */
+static void _pgsql_deallocate(gs_conn* conn, char* stmt_name)
+{
+  PGconn* pg = CONN(conn)->pg;
+  char* sql;
+
+  _pgsql_end_stream(conn);
+  if (PQtransactionStatus(pg) != PQTRANS_IDLE && PQtransactionStatus(pg) != PQTRANS_INTRANS)
+  {
+    CONN(conn)->stmt_garbage = g_slist_prepend(CONN(conn)->stmt_garbage, stmt_name);
+    return;
+  }
+
+  sql = g_strconcat("DEALLOCATE ", stmt_name, NULL);
+  PQclear(PQexec(pg, sql));
+  g_free(sql);
+  g_free(stmt_name);
+}
+
+static void _pgsql_collect_garbage(gs_conn* conn)
+{
+  GSList* garbage = CONN(conn)->stmt_garbage;
+  GSList* iter;
+
+  CONN(conn)->stmt_garbage = NULL;
+  for (iter = garbage; iter; iter = iter->next)
+    _pgsql_deallocate(conn, iter->data);
+  g_slist_free(garbage);
+}
+
+static int pgsql_gs_is_alive(gs_conn* conn)
+{
+  return CONN(conn)->pg != NULL && PQstatus(CONN(conn)->pg) == CONNECTION_OK;
 }
 
 static int pgsql_gs_begin(gs_conn* conn)
 {
   PGresult* res;
   
+  _pgsql_end_stream(conn);
   res = PQexec(CONN(conn)->pg, "BEGIN");
   if (PQresultStatus(res) != PGRES_COMMAND_OK)
   {
@@ -83,6 +208,7 @@ static int pgsql_gs_commit(gs_conn* conn)
 {
   PGresult* res;
   
+  _pgsql_end_stream(conn);
   res = PQexec(CONN(conn)->pg, "COMMIT");
   if (PQresultStatus(res) != PGRES_COMMAND_OK)
   {
@@ -92,6 +218,7 @@ static int pgsql_gs_commit(gs_conn* conn)
   }
 
   PQclear(res);
+  _pgsql_collect_garbage(conn);
   return 0;
 }
 
@@ -99,6 +226,7 @@ static int pgsql_gs_rollback(gs_conn* conn)
 {
   PGresult* res;
   
+  _pgsql_end_stream(conn);
   res = PQexec(CONN(conn)->pg, "ROLLBACK");
   if (PQresultStatus(res) != PGRES_COMMAND_OK)
   {
@@ -108,6 +236,7 @@ static int pgsql_gs_rollback(gs_conn* conn)
   }
 
   PQclear(res);
+  _pgsql_collect_garbage(conn);
   return 0;
 }
 
@@ -124,63 +253,351 @@ static gs_query* pgsql_gs_query_new(gs_conn* conn, const char* sql_string)
 
 static void pgsql_gs_query_free(gs_query* query)
 {
+  if (CONN(query->conn)->stream == query)
+    _pgsql_end_stream(query->conn);
   if (QUERY(query)->pg_res != NULL)
     PQclear(QUERY(query)->pg_res);
+  if (QUERY(query)->stmt_name != NULL && CONN(query->conn)->pg != NULL)
+    _pgsql_deallocate(query->conn, QUERY(query)->stmt_name);
+  g_free(QUERY(query)->param_types);
+  g_free(QUERY(query)->param_values);
+  g_free(QUERY(query)->param_lengths);
+  g_free(QUERY(query)->param_formats);
+  g_free(QUERY(query)->param_buf);
+  g_free(QUERY(query)->res_buf);
   g_free(query->sql);
   g_free(query);
 }
 
-static int pgsql_gs_query_getv(gs_query* query, const char* fmt, va_list ap)
+static int pgsql_gs_query_reset(gs_query* query)
 {
-  PGresult* res = QUERY(query)->pg_res;
-  int row_no = QUERY(query)->row_no;
+  if (CONN(query->conn)->stream == query)
+    _pgsql_end_stream(query->conn);
+  if (QUERY(query)->pg_res != NULL)
+    PQclear(QUERY(query)->pg_res);
+  QUERY(query)->pg_res = NULL;
+  QUERY(query)->row_no = 0;
+  return 0;
+}
 
-  if (res == NULL)
-    return -1;
+/* Text form of double that reads back as the same value, special values are
+ * spelled the way server does. buf must have room for PGSQL_VALUE_BUF bytes.
+ */
+static void _pgsql_format_double(double value, char* buf)
+{
+  static const char* formats[] = { "%.15g", "%.16g", "%.17g" };
+  guint i;
 
-  if (row_no >= gs_query_get_rows(query))
-    return 1;
+  if (isnan(value))
+    strcpy(buf, "NaN");
+  else if (isinf(value))
+    strcpy(buf, value > 0 ? "Infinity" : "-Infinity");
+  else
+  {
+    for (i = 0; i < G_N_ELEMENTS(formats); i++)
+    {
+      g_ascii_formatd(buf, PGSQL_VALUE_BUF, formats[i], value);
+      if (g_ascii_strtod(buf, NULL) == value)
+        break;
+    }
+  }
+}
+
+static gboolean _pgsql_text_to_bool(const char* value)
+{
+  return *value == 't' || *value == 'T' || *value == 'y' || *value == 'Y' ||
+         *value == '1' || !g_ascii_strcasecmp(value, "on");
+}
+
+static double _pgsql_get_double(PGresult* res, int row_no, int col);
 
-  int param_count = fmt != NULL ? strlen(fmt) : 0;
-  int i, col = 0;
+/* Integer value of the result field, binary numbers are decoded directly. */
+static int _pgsql_get_int(PGresult* res, int row_no, int col)
+{
+  const char* value = PQgetvalue(res, row_no, col);
 
-  for (i = 0; i < param_count; i++)
+  if (PQfformat(res, col) == 1)
   {
-    if (fmt[i] == 's')
+    switch (PQftype(res, col))
     {
-      char** str_ptr = (char**)va_arg(ap, char**);
-      if (PQgetisnull(res, row_no, col))
-        *str_ptr = NULL;
-      else
-        *str_ptr = PQgetvalue(res, row_no, col);
-      col++;
+      case PGSQL_BOOLOID:
+        return value[0] != 0;
+      case PGSQL_FLOAT8OID:
+        return (int)_pgsql_get_double(res, row_no, col);
+      case PGSQL_INT2OID:
+      {
+        guint16 v;
+        memcpy(&v, value, sizeof(v));
+        return (gint16)GUINT16_FROM_BE(v);
+      }
+      case PGSQL_INT4OID:
+      {
+        guint32 v;
+        memcpy(&v, value, sizeof(v));
+        return (gint32)GUINT32_FROM_BE(v);
+      }
+      case PGSQL_INT8OID:
+      {
+        guint64 v;
+        memcpy(&v, value, sizeof(v));
+        return (int)(gint64)GUINT64_FROM_BE(v);
+      }
     }
-    else if (fmt[i] == 'S')
+  }
+
+  return atoi(value);
+}
+
+static gint64 _pgsql_get_int64(PGresult* res, int row_no, int col)
+{
+  const char* value = PQgetvalue(res, row_no, col);
+
+  if (PQfformat(res, col) == 1)
+  {
+    switch (PQftype(res, col))
     {
-      char** str_ptr = (char**)va_arg(ap, char**);
-      if (PQgetisnull(res, row_no, col))
-        *str_ptr = NULL;
-      else
-        *str_ptr = g_strdup(PQgetvalue(res, row_no, col));
-      col++;
+      case PGSQL_INT8OID:
+      {
+        guint64 v;
+        memcpy(&v, value, sizeof(v));
+        return (gint64)GUINT64_FROM_BE(v);
+      }
+      case PGSQL_FLOAT8OID:
+        return (gint64)_pgsql_get_double(res, row_no, col);
+      case PGSQL_BOOLOID:
+      case PGSQL_INT2OID:
+      case PGSQL_INT4OID:
+        return _pgsql_get_int(res, row_no, col);
     }
-    else if (fmt[i] == 'i')
+  }
+
+  return g_ascii_strtoll(value, NULL, 10);
+}
+
+static double _pgsql_get_double(PGresult* res, int row_no, int col)
+{
+  const char* value = PQgetvalue(res, row_no, col);
+
+  if (PQfformat(res, col) == 1)
+  {
+    switch (PQftype(res, col))
     {
-      int* int_ptr = (int*)va_arg(ap, int*);
-      if (!PQgetisnull(res, row_no, col))
-        *int_ptr = atoi(PQgetvalue(res, row_no, col));
-      col++;
+      case PGSQL_FLOAT8OID:
+      {
+        union { guint64 i; double d; } v;
+        memcpy(&v.i, value, sizeof(v.i));
+        v.i = GUINT64_FROM_BE(v.i);
+        return v.d;
+      }
+      case PGSQL_BOOLOID:
+      case PGSQL_INT2OID:
+      case PGSQL_INT4OID:
+      case PGSQL_INT8OID:
+        return (double)_pgsql_get_int64(res, row_no, col);
     }
-    else if (fmt[i] == '?') // null flag
+  }
+
+  return g_ascii_strtod(value, NULL);
+}
+
+static gboolean _pgsql_get_bool(PGresult* res, int row_no, int col)
+{
+  if (PQfformat(res, col) == 1)
+  {
+    switch (PQftype(res, col))
     {
-      int* int_ptr = (int*)va_arg(ap, int*);
-      *int_ptr = PQgetisnull(res, row_no, col);
+      case PGSQL_BOOLOID:
+      case PGSQL_INT2OID:
+      case PGSQL_INT4OID:
+      case PGSQL_INT8OID:
+        return _pgsql_get_int64(res, row_no, col) != 0;
+      case PGSQL_FLOAT8OID:
+        return _pgsql_get_double(res, row_no, col) != 0;
     }
-    else
+  }
+
+  return _pgsql_text_to_bool(PQgetvalue(res, row_no, col));
+}
+
+/* Text value of the result field. Binary numbers are formatted into per-query
+ * buffer, which is valid until next gs_query_get() call.
+ */
+static char* _pgsql_get_text(gs_query* query, PGresult* res, int row_no, int col)
+{
+  char* buf;
+
+  if (PQfformat(res, col) == 0)
+    return PQgetvalue(res, row_no, col);
+
+  switch (PQftype(res, col))
+  {
+    case PGSQL_INT2OID:
+    case PGSQL_INT4OID:
+      break;
+    case PGSQL_BOOLOID:
+      return PQgetvalue(res, row_no, col)[0] ? "t" : "f";
+    case PGSQL_FLOAT8OID:
+      buf = QUERY(query)->res_buf + col * PGSQL_VALUE_BUF;
+      _pgsql_format_double(_pgsql_get_double(res, row_no, col), buf);
+      return buf;
+    case PGSQL_INT8OID:
     {
-      gs_set_error(query->conn, GS_ERR_OTHER, "Invalid format string.");
-      va_end(ap);
+      guint64 v;
+      memcpy(&v, PQgetvalue(res, row_no, col), sizeof(v));
+      buf = QUERY(query)->res_buf + col * PGSQL_VALUE_BUF;
+      g_snprintf(buf, PGSQL_VALUE_BUF, "%" G_GINT64_FORMAT, (gint64)GUINT64_FROM_BE(v));
+      return buf;
+    }
+    default:
+      // binary representation of text types is the text itself
+      return PQgetvalue(res, row_no, col);
+  }
+
+  buf = QUERY(query)->res_buf + col * PGSQL_VALUE_BUF;
+  g_snprintf(buf, PGSQL_VALUE_BUF, "%d", _pgsql_get_int(res, row_no, col));
+  return buf;
+}
+
+static int pgsql_convert_error(const char *sqlstate);
+
+/* Replace current result with the next row of the streamed result.
+ *
+ * Returns 0 if row is available, 1 if there are no more rows, -1 on error.
+ */
+static int _pgsql_stream_next(gs_query* query)
+{
+  PGconn* pg = CONN(query->conn)->pg;
+  PGresult* res;
+
+  if (QUERY(query)->pg_res != NULL)
+    PQclear(QUERY(query)->pg_res);
+  QUERY(query)->pg_res = NULL;
+  QUERY(query)->row_no = 0;
+
+  if (CONN(query->conn)->stream != query)
+    return 1;
+
+  res = PQgetResult(pg);
+  switch (PQresultStatus(res))
+  {
+    case PGRES_SINGLE_TUPLE:
+      QUERY(query)->pg_res = res;
+      return 0;
+    case PGRES_TUPLES_OK:
+    case PGRES_COMMAND_OK:
+      QUERY(query)->pg_res = res;
+      _pgsql_end_stream(query->conn);
+      return 1;
+    default:
+      if (res == NULL)
+        gs_set_error(query->conn, GS_ERR_OTHER, PQerrorMessage(pg));
+      else
+        gs_set_error(query->conn, pgsql_convert_error(PQresultErrorField(res, PG_DIAG_SQLSTATE)), PQresultErrorMessage(res));
+      PQclear(res);
+      _pgsql_end_stream(query->conn);
       return -1;
+  }
+}
+
+static int pgsql_gs_query_get_plan(gs_query* query, const gs_plan* plan, void** targets)
+{
+  PGresult* res = QUERY(query)->pg_res;
+  int row_no = QUERY(query)->row_no;
+  int i;
+
+  if (res == NULL)
+    return -1;
+
+  if (row_no >= PQntuples(res))
+  {
+    int rs;
+
+    if (CONN(query->conn)->stream != query)
+      return 1;
+
+    rs = _pgsql_stream_next(query);
+    if (rs != 0)
+      return rs;
+    res = QUERY(query)->pg_res;
+    row_no = 0;
+  }
+
+  if (PQbinaryTuples(res) && QUERY(query)->res_buf_alloc < PQnfields(res))
+  {
+    QUERY(query)->res_buf_alloc = PQnfields(res);
+    QUERY(query)->res_buf = g_renew(char, QUERY(query)->res_buf, PQnfields(res) * PGSQL_VALUE_BUF);
+  }
+
+  for (i = 0; i < plan->n_slots; i++)
+  {
+    int col = plan->slots[i].col;
+
+    switch (plan->slots[i].type)
+    {
+      case 's':
+      {
+        char** str_ptr = (char**)targets[i];
+        if (PQgetisnull(res, row_no, col))
+          *str_ptr = NULL;
+        else
+          *str_ptr = _pgsql_get_text(query, res, row_no, col);
+        break;
+      }
+      case 'S':
+      {
+        char** str_ptr = (char**)targets[i];
+        if (PQgetisnull(res, row_no, col))
+          *str_ptr = NULL;
+        else
+          *str_ptr = g_strdup(_pgsql_get_text(query, res, row_no, col));
+        break;
+      }
+      case 'i':
+      {
+        int* int_ptr = (int*)targets[i];
+        if (!PQgetisnull(res, row_no, col))
+          *int_ptr = _pgsql_get_int(res, row_no, col);
+        break;
+      }
+      case 'l':
+      {
+        gint64* int_ptr = (gint64*)targets[i];
+        if (!PQgetisnull(res, row_no, col))
+          *int_ptr = _pgsql_get_int64(res, row_no, col);
+        break;
+      }
+      case 'd':
+      {
+        double* double_ptr = (double*)targets[i];
+        if (!PQgetisnull(res, row_no, col))
+          *double_ptr = _pgsql_get_double(res, row_no, col);
+        break;
+      }
+      case 'b':
+      {
+        gboolean* bool_ptr = (gboolean*)targets[i];
+        if (!PQgetisnull(res, row_no, col))
+          *bool_ptr = _pgsql_get_bool(res, row_no, col);
+        break;
+      }
+      case 't':
+      {
+        // timestamp results are transferred as text
+        gint64* time_ptr = (gint64*)targets[i];
+        if (!PQgetisnull(res, row_no, col) &&
+            gs_time_parse(PQgetvalue(res, row_no, col), time_ptr) < 0)
+        {
+          gs_set_error(query->conn, GS_ERR_OTHER, "Invalid timestamp value.");
+          return -1;
+        }
+        break;
+      }
+      case '?': // null flag
+      {
+        int* int_ptr = (int*)targets[i];
+        *int_ptr = PQgetisnull(res, row_no, col);
+        break;
+      }
     }
   }
 
@@ -205,81 +622,1406 @@ static int pgsql_convert_error(const char *sqlstate)
   }
 }
 
-static int pgsql_gs_query_putv(gs_query* query, const char* fmt, va_list ap)
+/* Whether binary transfer of the result column of this type can be decoded. */
+static gboolean _pgsql_is_binary_type(Oid type)
+{
+  switch (type)
+  {
+    case PGSQL_BOOLOID:
+    case PGSQL_INT2OID:
+    case PGSQL_INT4OID:
+    case PGSQL_INT8OID:
+    case PGSQL_FLOAT8OID:
+    case PGSQL_TEXTOID:
+    case PGSQL_NAMEOID:
+    case PGSQL_BPCHAROID:
+    case PGSQL_VARCHAROID:
+      return TRUE;
+    default:
+      return FALSE;
+  }
+}
+
+/* Prepare named statement on the server when the query is executed again,
+ * so that repeated executions skip parsing and planning. First execution
+ * goes through the unnamed statement, one-shot queries cost a single round
+ * trip. With force the statement is prepared right away. Statement
+ * description is used to choose binary transfer of numeric parameters and
+ * results.
+ */
+static int _pgsql_prepare(gs_query* query, gboolean force)
 {
-  int param_count = (fmt != NULL) ? strlen(fmt) : 0;
-  char** param_values = g_new0(char*, param_count);
-  int* free_list = g_new0(int, param_count);
-  int i, col = 0, retval = 0;
+  char* stmt_name;
   PGresult* res;
+  int i;
+
+  if (QUERY(query)->stmt_name != NULL)
+    return 0;
+  if (!force && QUERY(query)->executions++ == 0)
+    return 0;
 
-  for (i = 0; i < param_count; i++)
+  stmt_name = g_strdup_printf("gs_stmt_%u", ++CONN(query->conn)->stmt_counter);
+  res = PQprepare(CONN(query->conn)->pg, stmt_name, query->sql, 0, NULL);
+  if (PQresultStatus(res) != PGRES_COMMAND_OK)
   {
-    int is_null = 0;
+    int code = pgsql_convert_error(PQresultErrorField(res, PG_DIAG_SQLSTATE));
+    gs_set_error(query->conn, code, PQresultErrorMessage(res));
+    PQclear(res);
+    g_free(stmt_name);
+    return -1;
+  }
+  PQclear(res);
+  QUERY(query)->stmt_name = stmt_name;
 
-    if (fmt[i] == '?')
-    {
-      is_null = (int)va_arg(ap, int);
-      i++;
-    }
+  res = PQdescribePrepared(CONN(query->conn)->pg, stmt_name);
+  if (PQresultStatus(res) != PGRES_COMMAND_OK)
+  {
+    gs_set_error(query->conn, GS_ERR_OTHER, PQresultErrorMessage(res));
+    PQclear(res);
+    return -1;
+  }
 
-    if (fmt[i] == 's')
-    {
-      char* value = (char*)va_arg(ap, char*);
-      if (!is_null)
-        param_values[col] = value;
-      col++;
-    }
-    else if (fmt[i] == 'i')
-    {
-      int value = (int)va_arg(ap, int);
-      if (!is_null)
-      {
-        param_values[col] = g_strdup_printf("%d", value);
-        free_list[col] = 1;
-      }
-      col++;
-    }
-    else
-    {
-      gs_set_error(query->conn, GS_ERR_OTHER, "Invalid format string.");
-      retval = -1;
-      goto err;
-    }
+  QUERY(query)->n_param_types = PQnparams(res);
+  QUERY(query)->param_types = g_new0(Oid, PQnparams(res));
+  for (i = 0; i < PQnparams(res); i++)
+    QUERY(query)->param_types[i] = PQparamtype(res, i);
+
+  QUERY(query)->result_format = PQnfields(res) > 0;
+  for (i = 0; i < PQnfields(res); i++)
+    if (!_pgsql_is_binary_type(PQftype(res, i)))
+      QUERY(query)->result_format = 0;
+
+  PQclear(res);
+  return 0;
+}
+
+static void _pgsql_alloc_params(gs_query* query, int count)
+{
+  if (QUERY(query)->params_alloc >= count)
+    return;
+
+  QUERY(query)->params_alloc = count;
+  QUERY(query)->param_values = g_renew(char*, QUERY(query)->param_values, count);
+  QUERY(query)->param_lengths = g_renew(int, QUERY(query)->param_lengths, count);
+  QUERY(query)->param_formats = g_renew(int, QUERY(query)->param_formats, count);
+  QUERY(query)->param_buf = g_renew(char, QUERY(query)->param_buf, count * PGSQL_VALUE_BUF);
+}
+
+static Oid _pgsql_param_type(gs_query* query, int col)
+{
+  return col < QUERY(query)->n_param_types ? QUERY(query)->param_types[col] : 0;
+}
+
+/* Store binary parameter of given length. */
+static void _pgsql_put_binary(gs_query* query, int col, const void* value, int length)
+{
+  char* buf = QUERY(query)->param_buf + col * PGSQL_VALUE_BUF;
+
+  memcpy(buf, value, length);
+  QUERY(query)->param_values[col] = buf;
+  QUERY(query)->param_lengths[col] = length;
+  QUERY(query)->param_formats[col] = 1;
+}
+
+/* Store integer parameter in the form server expects for its type. */
+static void _pgsql_put_int(gs_query* query, int col, gint64 value)
+{
+  Oid type = _pgsql_param_type(query, col);
+
+  if (type == PGSQL_INT4OID && value >= G_MININT32 && value <= G_MAXINT32)
+  {
+    guint32 v = GUINT32_TO_BE((guint32)value);
+    _pgsql_put_binary(query, col, &v, sizeof(v));
+  }
+  else if (type == PGSQL_INT8OID)
+  {
+    guint64 v = GUINT64_TO_BE((guint64)value);
+    _pgsql_put_binary(query, col, &v, sizeof(v));
+  }
+  else
+  {
+    QUERY(query)->param_values[col] = QUERY(query)->param_buf + col * PGSQL_VALUE_BUF;
+    g_snprintf(QUERY(query)->param_values[col], PGSQL_VALUE_BUF, "%" G_GINT64_FORMAT, value);
   }
-  param_count = col;
+}
 
-  res = PQexecParams(CONN(query->conn)->pg, query->sql, param_count, NULL, (const char* const*)param_values, NULL, NULL, 0);
-  if (PQresultStatus(res) != PGRES_COMMAND_OK && PQresultStatus(res) != PGRES_TUPLES_OK)
+static void _pgsql_put_double(gs_query* query, int col, double value)
+{
+  Oid type = _pgsql_param_type(query, col);
+
+  if (type == PGSQL_FLOAT8OID)
   {
-    int code = pgsql_convert_error(PQresultErrorField(res, PG_DIAG_SQLSTATE));
-    gs_set_error(query->conn, code, PQresultErrorMessage(res));
-    retval = -1;
+    union { guint64 i; double d; } v;
+    v.d = value;
+    v.i = GUINT64_TO_BE(v.i);
+    _pgsql_put_binary(query, col, &v.i, sizeof(v.i));
+  }
+  else if (type == PGSQL_FLOAT4OID)
+  {
+    union { guint32 i; float f; } v;
+    v.f = (float)value;
+    v.i = GUINT32_TO_BE(v.i);
+    _pgsql_put_binary(query, col, &v.i, sizeof(v.i));
+  }
+  else
+  {
+    QUERY(query)->param_values[col] = QUERY(query)->param_buf + col * PGSQL_VALUE_BUF;
+    _pgsql_format_double(value, QUERY(query)->param_values[col]);
   }
+}
 
-  if (QUERY(query)->pg_res != NULL)
-    PQclear(QUERY(query)->pg_res);
-  QUERY(query)->pg_res = res;
-  
- err:
-  for (i = 0; i < param_count; i++)
-    if (free_list[i])
-      g_free(param_values[i]);
-  g_free(param_values);
-  g_free(free_list);
+static void _pgsql_put_bool(gs_query* query, int col, int value)
+{
+  Oid type = _pgsql_param_type(query, col);
 
-  return retval;
+  if (type == PGSQL_BOOLOID)
+  {
+    char v = value != 0;
+    _pgsql_put_binary(query, col, &v, 1);
+  }
+  else if (type == PGSQL_INT2OID || type == PGSQL_INT4OID || type == PGSQL_INT8OID)
+    _pgsql_put_int(query, col, value != 0);
+  else
+    QUERY(query)->param_values[col] = value ? "t" : "f";
 }
 
-static int pgsql_gs_query_get_rows(gs_query* query)
+static void _pgsql_put_time(gs_query* query, int col, gint64 usec)
 {
-  PGresult* res = QUERY(query)->pg_res;
-  if (res)
-    return PQntuples(res);
-  return -1;
+  Oid type = _pgsql_param_type(query, col);
+  const char* integer_datetimes = PQparameterStatus(CONN(query->conn)->pg, "integer_datetimes");
+
+  if ((type == PGSQL_TIMESTAMPTZOID || type == PGSQL_TIMESTAMPOID) &&
+      integer_datetimes != NULL && !strcmp(integer_datetimes, "on"))
+  {
+    guint64 v = GUINT64_TO_BE((guint64)(usec - PGSQL_EPOCH_USEC));
+    _pgsql_put_binary(query, col, &v, sizeof(v));
+  }
+  else
+  {
+    // offset is ignored by timestamp without time zone, so it is UTC too
+    QUERY(query)->param_values[col] = QUERY(query)->param_buf + col * PGSQL_VALUE_BUF;
+    gs_time_format(usec, QUERY(query)->param_values[col]);
+  }
+}
+
+/* Execute bound parameters by the prepared statement, or by the unnamed one
+ * if query was not prepared yet. Parameters of such query are all in text
+ * form, because their types are not known.
+ */
+static PGresult* _pgsql_exec(gs_query* query, int param_count)
+{
+  PGconn* pg = CONN(query->conn)->pg;
+
+  if (QUERY(query)->stmt_name == NULL)
+    return PQexecParams(pg, query->sql, param_count, NULL,
+                        (const char* const*)QUERY(query)->param_values,
+                        QUERY(query)->param_lengths, QUERY(query)->param_formats, 0);
+
+  return PQexecPrepared(pg, QUERY(query)->stmt_name, param_count,
+                        (const char* const*)QUERY(query)->param_values,
+                        QUERY(query)->param_lengths, QUERY(query)->param_formats,
+                        QUERY(query)->result_format);
+}
+
+/* The same as _pgsql_exec() without waiting for the result. */
+static int _pgsql_send(gs_query* query, int param_count)
+{
+  PGconn* pg = CONN(query->conn)->pg;
+
+  if (QUERY(query)->stmt_name == NULL)
+    return PQsendQueryParams(pg, query->sql, param_count, NULL,
+                             (const char* const*)QUERY(query)->param_values,
+                             QUERY(query)->param_lengths, QUERY(query)->param_formats, 0);
+
+  return PQsendQueryPrepared(pg, QUERY(query)->stmt_name, param_count,
+                             (const char* const*)QUERY(query)->param_values,
+                             QUERY(query)->param_lengths, QUERY(query)->param_formats,
+                             QUERY(query)->result_format);
+}
+
+/* Send query and switch connection to single row mode, first row (or
+ * error) is retrieved immediately.
+ */
+static int _pgsql_stream_start(gs_query* query, int param_count)
+{
+  PGconn* pg = CONN(query->conn)->pg;
+
+  if (QUERY(query)->pg_res != NULL)
+    PQclear(QUERY(query)->pg_res);
+  QUERY(query)->pg_res = NULL;
+  QUERY(query)->row_no = 0;
+
+  if (!_pgsql_send(query, param_count))
+  {
+    gs_set_error(query->conn, GS_ERR_OTHER, PQerrorMessage(pg));
+    return -1;
+  }
+  PQsetSingleRowMode(pg);
+  CONN(query->conn)->stream = query;
+
+  return _pgsql_stream_next(query) < 0 ? -1 : 0;
+}
+
+static void _pgsql_bind_params(gs_query* query, const gs_param* params, int count)
+{
+  int i;
+
+  for (i = 0; i < count; i++)
+  {
+    QUERY(query)->param_values[i] = NULL;
+    QUERY(query)->param_lengths[i] = 0;
+    QUERY(query)->param_formats[i] = 0;
+
+    if (params[i].is_null)
+      continue;
+    switch (params[i].type)
+    {
+      case 's':
+        QUERY(query)->param_values[i] = (char*)params[i].value.s;
+        break;
+      case 'i':
+        _pgsql_put_int(query, i, params[i].value.i);
+        break;
+      case 'l':
+        _pgsql_put_int(query, i, params[i].value.l);
+        break;
+      case 'd':
+        _pgsql_put_double(query, i, params[i].value.d);
+        break;
+      case 'b':
+        _pgsql_put_bool(query, i, params[i].value.i);
+        break;
+      case 't':
+        _pgsql_put_time(query, i, params[i].value.l);
+        break;
+    }
+  }
+}
+
+static int pgsql_gs_query_put_params(gs_query* query, const gs_param* params, int count)
+{
+  PGresult* res;
+
+  if (CONN(query->conn)->stream != NULL)
+    _pgsql_end_stream(query->conn);
+
+  if (_pgsql_prepare(query, FALSE) < 0)
+    return -1;
+
+  _pgsql_alloc_params(query, count);
+  _pgsql_bind_params(query, params, count);
+
+  if (query->result_mode == GS_RESULT_STREAMING)
+    return _pgsql_stream_start(query, count);
+
+  res = _pgsql_exec(query, count);
+
+  if (QUERY(query)->pg_res != NULL)
+    PQclear(QUERY(query)->pg_res);
+  QUERY(query)->pg_res = res;
+  QUERY(query)->row_no = 0;
+
+  if (PQresultStatus(res) != PGRES_COMMAND_OK && PQresultStatus(res) != PGRES_TUPLES_OK)
+  {
+    int code = pgsql_convert_error(PQresultErrorField(res, PG_DIAG_SQLSTATE));
+    gs_set_error(query->conn, code, PQresultErrorMessage(res));
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Text form of non-NULL parameter, buf must have room for PGSQL_VALUE_BUF
+ * bytes.
+ */
+static const char* _pgsql_param_text(const gs_param* param, char* buf)
+{
+  switch (param->type)
+  {
+    case 's':
+      return param->value.s;
+    case 'i':
+      g_snprintf(buf, PGSQL_VALUE_BUF, "%d", param->value.i);
+      return buf;
+    case 'l':
+      g_snprintf(buf, PGSQL_VALUE_BUF, "%" G_GINT64_FORMAT, param->value.l);
+      return buf;
+    case 'd':
+      _pgsql_format_double(param->value.d, buf);
+      return buf;
+    case 'b':
+      return param->value.i ? "t" : "f";
+    case 't':
+      gs_time_format(param->value.l, buf);
+      return buf;
+  }
+  return NULL;
+}
+
+/* Text form of parameters for statements that are not prepared. buf must
+ * have room for PGSQL_VALUE_BUF bytes for each parameter.
+ */
+static void _pgsql_params_to_text(const gs_param* params, int count, const char** values, char* buf)
+{
+  int i;
+
+  for (i = 0; i < count; i++)
+    values[i] = params[i].is_null ? NULL : _pgsql_param_text(params + i, buf + i * PGSQL_VALUE_BUF);
+}
+
+/* asynchronous execution */
+
+struct _pgsql_async
+{
+  gs_query* query;
+  GTask* task;
+  PGcancel* cancel;
+  gulong cancel_id;
+};
+
+static void _pgsql_async_watch(struct _pgsql_async* op, GIOCondition condition);
+
+static void _pgsql_async_cancelled(GCancellable* cancellable G_GNUC_UNUSED, gpointer user_data)
+{
+  struct _pgsql_async* op = user_data;
+  char errbuf[256];
+
+  // PQcancel() is safe to call from any thread
+  PQcancel(op->cancel, errbuf, sizeof(errbuf));
+}
+
+static void _pgsql_async_complete(struct _pgsql_async* op, int retval)
+{
+  GCancellable* cancellable = g_task_get_cancellable(op->task);
+
+  if (cancellable != NULL && op->cancel_id != 0)
+    g_cancellable_disconnect(cancellable, op->cancel_id);
+  if (op->cancel != NULL)
+    PQfreeCancel(op->cancel);
+
+  PQsetnonblocking(CONN(op->query->conn)->pg, 0);
+
+  g_task_return_int(op->task, retval);
+  g_object_unref(op->task);
+  g_free(op);
+}
+
+static gboolean _pgsql_async_ready(gint fd G_GNUC_UNUSED, GIOCondition condition, gpointer user_data)
+{
+  struct _pgsql_async* op = user_data;
+  gs_query* query = op->query;
+  PGconn* pg = CONN(query->conn)->pg;
+  PGresult* res;
+  PGresult* last = NULL;
+
+  if (condition & G_IO_OUT)
+  {
+    int rs = PQflush(pg);
+
+    if (rs == 1)
+      return G_SOURCE_CONTINUE;
+    if (rs == 0)
+    {
+      _pgsql_async_watch(op, G_IO_IN);
+      return G_SOURCE_REMOVE;
+    }
+
+    gs_set_error(query->conn, GS_ERR_OTHER, PQerrorMessage(pg));
+    _pgsql_async_complete(op, -1);
+    return G_SOURCE_REMOVE;
+  }
+
+  if (!PQconsumeInput(pg))
+  {
+    gs_set_error(query->conn, GS_ERR_OTHER, PQerrorMessage(pg));
+    _pgsql_async_complete(op, -1);
+    return G_SOURCE_REMOVE;
+  }
+
+  if (PQisBusy(pg))
+    return G_SOURCE_CONTINUE;
+
+  // keep the last result like PQexec() does
+  while ((res = PQgetResult(pg)) != NULL)
+  {
+    if (last != NULL)
+      PQclear(last);
+    last = res;
+  }
+
+  if (QUERY(query)->pg_res != NULL)
+    PQclear(QUERY(query)->pg_res);
+  QUERY(query)->pg_res = last;
+  QUERY(query)->row_no = 0;
+
+  if (PQresultStatus(last) != PGRES_COMMAND_OK && PQresultStatus(last) != PGRES_TUPLES_OK)
+  {
+    int code = pgsql_convert_error(PQresultErrorField(last, PG_DIAG_SQLSTATE));
+    gs_set_error(query->conn, code, PQresultErrorMessage(last));
+    _pgsql_async_complete(op, -1);
+    return G_SOURCE_REMOVE;
+  }
+
+  _pgsql_async_complete(op, 0);
+  return G_SOURCE_REMOVE;
+}
+
+static void _pgsql_async_watch(struct _pgsql_async* op, GIOCondition condition)
+{
+  GSource* source = g_unix_fd_source_new(PQsocket(CONN(op->query->conn)->pg), condition);
+
+  // g_unix_fd_add_full() would attach it to the global default context
+  g_source_set_callback(source, G_SOURCE_FUNC(_pgsql_async_ready), op, NULL);
+  g_source_attach(source, g_task_get_context(op->task));
+  g_source_unref(source);
+}
+
+static void pgsql_gs_query_put_async(gs_query* query, const gs_param* params, int count, GTask* task)
+{
+  PGconn* pg = CONN(query->conn)->pg;
+  GCancellable* cancellable = g_task_get_cancellable(task);
+  struct _pgsql_async* op;
+  int rs;
+
+  if (CONN(query->conn)->stream != NULL)
+    _pgsql_end_stream(query->conn);
+
+  // preparing would block the main context on two round trips, so only
+  // statement already prepared by query_put_params is executed as such,
+  // otherwise the unnamed one is used
+  _pgsql_alloc_params(query, count);
+  _pgsql_bind_params(query, params, count);
+
+  PQsetnonblocking(pg, 1);
+  if (!_pgsql_send(query, count))
+  {
+    gs_set_error(query->conn, GS_ERR_OTHER, PQerrorMessage(pg));
+    PQsetnonblocking(pg, 0);
+    g_task_return_int(task, -1);
+    return;
+  }
+
+  op = g_new0(struct _pgsql_async, 1);
+  op->query = query;
+  op->task = g_object_ref(task);
+  op->cancel = PQgetCancel(pg);
+  if (cancellable != NULL && op->cancel != NULL)
+    op->cancel_id = g_cancellable_connect(cancellable, G_CALLBACK(_pgsql_async_cancelled), op, NULL);
+
+  rs = PQflush(pg);
+  if (rs < 0)
+  {
+    gs_set_error(query->conn, GS_ERR_OTHER, PQerrorMessage(pg));
+    _pgsql_async_complete(op, -1);
+    return;
+  }
+
+  _pgsql_async_watch(op, rs == 1 ? G_IO_OUT : G_IO_IN);
+}
+
+static int pgsql_gs_query_set_result_mode(gs_query* query G_GNUC_UNUSED, int mode)
+{
+  // default result is buffered by libpq
+  if (mode != GS_RESULT_DEFAULT && mode != GS_RESULT_STREAMING && mode != GS_RESULT_BUFFERED)
+    return -1;
+  return 0;
+}
+
+static int pgsql_gs_query_get_rows(gs_query* query)
+{
+  PGresult* res = QUERY(query)->pg_res;
+
+  if (query->result_mode == GS_RESULT_STREAMING)
+    return GS_ROWS_UNKNOWN;
+  if (res)
+    return PQntuples(res);
+  return -1;
+}
+
+static int pgsql_gs_query_get_columns(gs_query* query)
+{
+  PGresult* res = QUERY(query)->pg_res;
+
+  return res ? PQnfields(res) : 0;
+}
+
+/* columnar fetch */
+
+/* TRUE if all 8 bytes are ASCII digits. */
+static inline gboolean _pgsql_swar_digits(guint64 v)
+{
+  return ((v & G_GUINT64_CONSTANT(0xF0F0F0F0F0F0F0F0)) |
+          (((v + G_GUINT64_CONSTANT(0x0606060606060606)) & G_GUINT64_CONSTANT(0xF0F0F0F0F0F0F0F0)) >> 4))
+         == G_GUINT64_CONSTANT(0x3333333333333333);
+}
+
+/* Value of 8 ASCII digits loaded in little endian order. */
+static inline guint32 _pgsql_swar_parse8(guint64 v)
+{
+  v -= G_GUINT64_CONSTANT(0x3030303030303030);
+  v = v * 10 + (v >> 8);
+  v = (((v & G_GUINT64_CONSTANT(0x000000FF000000FF)) * G_GUINT64_CONSTANT(0x000F424000000064)) +
+       (((v >> 16) & G_GUINT64_CONSTANT(0x000000FF000000FF)) * G_GUINT64_CONSTANT(0x0000271000000001))) >> 32;
+  return (guint32)v;
+}
+
+/* Parse text integer of known length 8 digits at a time, anything that is
+ * not a plain decimal number is left to atoi().
+ */
+static int _pgsql_parse_int(const char* value, int len)
+{
+  const char* s = value;
+  gboolean neg = FALSE;
+  guint64 result = 0;
+
+  if (len > 0 && (*s == '-' || *s == '+'))
+  {
+    neg = *s == '-';
+    s++;
+    len--;
+  }
+  if (len == 0 || len > 19)
+    return atoi(value);
+
+  for (; len % 8 != 0; s++, len--)
+  {
+    if (!g_ascii_isdigit(*s))
+      return atoi(value);
+    result = result * 10 + (*s - '0');
+  }
+
+  for (; len > 0; s += 8, len -= 8)
+  {
+    guint64 chunk;
+
+    memcpy(&chunk, s, sizeof(chunk));
+    chunk = GUINT64_FROM_LE(chunk);
+    if (!_pgsql_swar_digits(chunk))
+      return atoi(value);
+    result = result * 100000000 + _pgsql_swar_parse8(chunk);
+  }
+
+  return neg ? (int)-(gint64)result : (int)result;
+}
+
+/* Convert n rows of one result column starting at row_no. */
+static void _pgsql_batch_column(gs_query* query, PGresult* res, int col, int row_no, int n, gs_column_buffer* column, int offset)
+{
+  int binary = PQfformat(res, col) == 1;
+  int i;
+
+  if (column->type == 'i' && binary && PQftype(res, col) == PGSQL_INT4OID)
+  {
+    for (i = 0; i < n; i++)
+    {
+      guint32 v;
+
+      if (PQgetisnull(res, row_no + i, col))
+      {
+        gs_column_set_null(column, offset + i);
+        continue;
+      }
+      memcpy(&v, PQgetvalue(res, row_no + i, col), sizeof(v));
+      column->ints[offset + i] = (gint32)GUINT32_FROM_BE(v);
+    }
+  }
+  else if (column->type == 'i')
+  {
+    for (i = 0; i < n; i++)
+    {
+      if (PQgetisnull(res, row_no + i, col))
+        gs_column_set_null(column, offset + i);
+      else if (binary)
+        column->ints[offset + i] = _pgsql_get_int(res, row_no + i, col);
+      else
+        column->ints[offset + i] = _pgsql_parse_int(PQgetvalue(res, row_no + i, col), PQgetlength(res, row_no + i, col));
+    }
+  }
+  else
+  {
+    for (i = 0; i < n; i++)
+    {
+      char* value;
+
+      if (PQgetisnull(res, row_no + i, col))
+      {
+        gs_column_set_null(column, offset + i);
+        continue;
+      }
+      value = _pgsql_get_text(query, res, row_no + i, col);
+      if (value == PQgetvalue(res, row_no + i, col))
+        gs_column_set_text(query, column, offset + i, value, PQgetlength(res, row_no + i, col));
+      else
+        gs_column_set_text(query, column, offset + i, value, strlen(value));
+    }
+  }
+}
+
+static int pgsql_gs_query_get_batch(gs_query* query, gs_column_buffer* columns, int n_columns, int max_rows)
+{
+  int rows = 0;
+  int col, n;
+
+  while (rows < max_rows)
+  {
+    PGresult* res = QUERY(query)->pg_res;
+    int row_no = QUERY(query)->row_no;
+
+    if (res == NULL)
+    {
+      gs_set_error(query->conn, GS_ERR_OTHER, "Invalid API use, call gs_query_put() before gs_query_get_batch().");
+      return -1;
+    }
+
+    if (row_no >= PQntuples(res))
+    {
+      int rs;
+
+      if (CONN(query->conn)->stream != query)
+        break;
+      rs = _pgsql_stream_next(query);
+      if (rs < 0)
+        return -1;
+      if (rs == 1)
+        break;
+      continue;
+    }
+
+    if (n_columns > PQnfields(res))
+    {
+      gs_set_error(query->conn, GS_ERR_OTHER, "Invalid batch column.");
+      return -1;
+    }
+
+    if (PQbinaryTuples(res) && QUERY(query)->res_buf_alloc < PQnfields(res))
+    {
+      QUERY(query)->res_buf_alloc = PQnfields(res);
+      QUERY(query)->res_buf = g_renew(char, QUERY(query)->res_buf, PQnfields(res) * PGSQL_VALUE_BUF);
+    }
+
+    n = MIN(max_rows - rows, PQntuples(res) - row_no);
+    for (col = 0; col < n_columns; col++)
+      _pgsql_batch_column(query, res, col, row_no, n, columns + col, rows);
+
+    QUERY(query)->row_no += n;
+    rows += n;
+  }
+
+  return rows;
+}
+
+#ifdef HAVE_PQENTERPIPELINEMODE
+
+/* Read results of one pipelined row followed by its sync point. */
+static int _pgsql_array_result(gs_query* query, gs_array_error* err, int* row_status, int row)
+{
+  PGconn* pg = CONN(query->conn)->pg;
+  PGresult* res;
+  int failed = FALSE;
+
+  while ((res = PQgetResult(pg)) != NULL)
+  {
+    ExecStatusType status = PQresultStatus(res);
+    if (status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK && !failed)
+    {
+      gs_array_row_error(err, row_status, row, pgsql_convert_error(PQresultErrorField(res, PG_DIAG_SQLSTATE)),
+                         status == PGRES_FATAL_ERROR ? PQresultErrorMessage(res) : PQerrorMessage(pg));
+      failed = TRUE;
+    }
+    PQclear(res);
+  }
+
+  res = PQgetResult(pg);
+  if (res == NULL || PQresultStatus(res) != PGRES_PIPELINE_SYNC)
+  {
+    if (res)
+      PQclear(res);
+    gs_set_error(query->conn, GS_ERR_OTHER, PQerrorMessage(pg));
+    return -1;
+  }
+  PQclear(res);
+
+  return 0;
+}
+
+/* Leave pipeline mode after failure. Whatever was sent is completed by one
+ * more sync point and its results are discarded, libpq does not leave
+ * pipeline mode with results pending.
+ */
+static void _pgsql_pipeline_abort(gs_conn* conn)
+{
+  PGconn* pg = CONN(conn)->pg;
+  PGresult* res;
+  gboolean idle = FALSE;
+
+  PQpipelineSync(pg);
+  while (PQstatus(pg) == CONNECTION_OK)
+  {
+    res = PQgetResult(pg);
+    if (res == NULL)
+    {
+      // NULL right after end of a statement or sync point means that
+      // nothing is left in the pipeline
+      if (idle)
+        break;
+      idle = TRUE;
+      continue;
+    }
+    idle = PQresultStatus(res) == PGRES_PIPELINE_SYNC;
+    PQclear(res);
+  }
+
+  PQexitPipelineMode(pg);
+}
+
+/* Pipelined statements are sent in chunks of this size and their results are
+ * read before the next chunk, so that neither side blocks on full buffers.
+ */
+#define PGSQL_PIPELINE_CHUNK 256
+
+/* Each row has its own sync point so that a failed row does not abort the
+ * rest.
+ */
+static int pgsql_gs_query_put_array(gs_query* query, const gs_array_column* columns, int n_columns, int n_rows, int* row_status)
+{
+  PGconn* pg = CONN(query->conn)->pg;
+  gs_array_error err = { GS_ERR_NONE, NULL };
+  gs_param* params = g_newa(gs_param, n_columns + 1);
+  int row, sent, i;
+
+  if (CONN(query->conn)->stream != NULL)
+    _pgsql_end_stream(query->conn);
+
+  // every row executes the statement
+  if (_pgsql_prepare(query, TRUE) < 0)
+    return -1;
+
+  _pgsql_alloc_params(query, n_columns);
+
+  if (!PQenterPipelineMode(pg))
+  {
+    gs_set_error(query->conn, GS_ERR_OTHER, PQerrorMessage(pg));
+    return -1;
+  }
+
+  for (row = 0; row < n_rows; row += sent)
+  {
+    int chunk = MIN(PGSQL_PIPELINE_CHUNK, n_rows - row);
+
+    for (sent = 0; sent < chunk; sent++)
+    {
+      gs_array_row_params(columns, n_columns, row + sent, params);
+      _pgsql_bind_params(query, params, n_columns);
+
+      // parameters are copied to the output buffer immediately
+      if (!PQsendQueryPrepared(pg, QUERY(query)->stmt_name, n_columns,
+                               (const char* const*)QUERY(query)->param_values,
+                               QUERY(query)->param_lengths, QUERY(query)->param_formats, 0) ||
+          !PQpipelineSync(pg))
+      {
+        // results of sent rows are not interesting
+        gs_set_error(query->conn, GS_ERR_OTHER, PQerrorMessage(pg));
+        _pgsql_pipeline_abort(query->conn);
+        g_free(err.msg);
+        return -1;
+      }
+    }
+
+    for (i = 0; i < sent; i++)
+    {
+      if (_pgsql_array_result(query, &err, row_status, row + i) < 0)
+      {
+        _pgsql_pipeline_abort(query->conn);
+        g_free(err.msg);
+        return -1;
+      }
+    }
+  }
+
+  if (!PQexitPipelineMode(pg))
+    gs_array_row_error(&err, NULL, 0, GS_ERR_OTHER, PQerrorMessage(pg));
+
+  return gs_array_finish(query->conn, &err);
+}
+
+static int pgsql_gs_batch_begin(gs_conn* conn)
+{
+  _pgsql_end_stream(conn);
+  if (!PQenterPipelineMode(CONN(conn)->pg))
+  {
+    gs_set_error(conn, GS_ERR_OTHER, PQerrorMessage(CONN(conn)->pg));
+    return -1;
+  }
+  CONN(conn)->batch_sent = 0;
+  CONN(conn)->batch_read = 0;
+  CONN(conn)->batch_error.code = GS_ERR_NONE;
+  return 0;
+}
+
+/* Read results of all sent statements, the first error is reported by
+ * batch_flush.
+ */
+static void _pgsql_batch_read(gs_conn* conn)
+{
+  PGconn* pg = CONN(conn)->pg;
+  PGresult* res;
+
+  // results arrive in order of statements, each followed by NULL
+  for (; CONN(conn)->batch_read < CONN(conn)->batch_sent; CONN(conn)->batch_read++)
+  {
+    while ((res = PQgetResult(pg)) != NULL)
+    {
+      if (PQresultStatus(res) == PGRES_FATAL_ERROR)
+      {
+        if (conn->batch_error_index < 0)
+          conn->batch_error_index = CONN(conn)->batch_read;
+        gs_array_row_error(&CONN(conn)->batch_error, NULL, 0,
+                           pgsql_convert_error(PQresultErrorField(res, PG_DIAG_SQLSTATE)), PQresultErrorMessage(res));
+      }
+      PQclear(res);
+    }
+  }
+}
+
+static int pgsql_gs_batch_add_params(gs_conn* conn, const char* sql_string, const gs_param* params, int count)
+{
+  PGconn* pg = CONN(conn)->pg;
+  const char** param_values = g_newa(const char*, count + 1);
+  char* param_buf = g_newa(char, (count + 1) * PGSQL_VALUE_BUF);
+
+  _pgsql_params_to_text(params, count, param_values, param_buf);
+
+  // parameters are copied to the output buffer immediately
+  if (!PQsendQueryParams(pg, sql_string, count, NULL, param_values, NULL, NULL, 0))
+  {
+    gs_set_error(conn, GS_ERR_OTHER, PQerrorMessage(pg));
+    return -1;
+  }
+  CONN(conn)->batch_sent++;
+
+  // server is asked to send results without a sync point, which would end
+  // the implicit transaction of the batch
+  if (CONN(conn)->batch_sent - CONN(conn)->batch_read >= PGSQL_PIPELINE_CHUNK)
+  {
+    if (!PQsendFlushRequest(pg) || PQflush(pg) != 0)
+    {
+      gs_set_error(conn, GS_ERR_OTHER, PQerrorMessage(pg));
+      return -1;
+    }
+    _pgsql_batch_read(conn);
+  }
+
+  return 0;
+}
+
+static int pgsql_gs_batch_flush(gs_conn* conn)
+{
+  PGconn* pg = CONN(conn)->pg;
+  PGresult* res;
+  int retval = 0;
+
+  if (!PQpipelineSync(pg))
+  {
+    gs_set_error(conn, GS_ERR_OTHER, PQerrorMessage(pg));
+    retval = -1;
+  }
+
+  _pgsql_batch_read(conn);
+
+  // consume sync point
+  while ((res = PQgetResult(pg)) != NULL)
+  {
+    ExecStatusType status = PQresultStatus(res);
+    PQclear(res);
+    if (status == PGRES_PIPELINE_SYNC)
+      break;
+  }
+
+  CONN(conn)->batch_sent = 0;
+  CONN(conn)->batch_read = 0;
+  if (gs_array_finish(conn, &CONN(conn)->batch_error) < 0)
+    retval = -1;
+  if (!PQexitPipelineMode(pg))
+  {
+    gs_set_error(conn, GS_ERR_OTHER, PQerrorMessage(pg));
+    retval = -1;
+  }
+
+  return retval;
+}
+
+#endif
+
+static gs_copy* pgsql_gs_copy_in_new(gs_conn* conn, const char* table, const char* columns)
+{
+  struct _gs_copy_pgsql* copy;
+  PGresult* res;
+  char* sql;
+
+  _pgsql_end_stream(conn);
+
+  sql = g_strdup_printf("COPY %s (%s) FROM STDIN", table, columns);
+  res = PQexec(CONN(conn)->pg, sql);
+  g_free(sql);
+  if (PQresultStatus(res) != PGRES_COPY_IN)
+  {
+    gs_set_error(conn, pgsql_convert_error(PQresultErrorField(res, PG_DIAG_SQLSTATE)), PQresultErrorMessage(res));
+    PQclear(res);
+    return NULL;
+  }
+  PQclear(res);
+
+  copy = g_new0(struct _gs_copy_pgsql, 1);
+  copy->base.conn = conn;
+  copy->buf = g_string_sized_new(PGSQL_COPY_BUF + 1024);
+  return (gs_copy*)copy;
+}
+
+/* Append value escaped for COPY text format. */
+static void _pgsql_copy_escape(GString* buf, const char* value)
+{
+  const char* p;
+
+  for (p = value; *p; p++)
+  {
+    switch (*p)
+    {
+      case '\\':
+        g_string_append_len(buf, "\\\\", 2);
+        break;
+      case '\n':
+        g_string_append_len(buf, "\\n", 2);
+        break;
+      case '\r':
+        g_string_append_len(buf, "\\r", 2);
+        break;
+      case '\t':
+        g_string_append_len(buf, "\\t", 2);
+        break;
+      default:
+        g_string_append_c(buf, *p);
+    }
+  }
+}
+
+static int _pgsql_copy_send(gs_copy* copy)
+{
+  GString* buf = COPY(copy)->buf;
+
+  if (buf->len == 0)
+    return 0;
+
+  if (PQputCopyData(CONN(copy->conn)->pg, buf->str, buf->len) != 1)
+  {
+    gs_set_error(copy->conn, GS_ERR_OTHER, PQerrorMessage(CONN(copy->conn)->pg));
+    return -1;
+  }
+
+  g_string_truncate(buf, 0);
+  return 0;
+}
+
+static int pgsql_gs_copy_put_params(gs_copy* copy, const gs_param* params, int count)
+{
+  GString* buf = COPY(copy)->buf;
+  char value_buf[PGSQL_VALUE_BUF];
+  int i;
+
+  for (i = 0; i < count; i++)
+  {
+    if (i > 0)
+      g_string_append_c(buf, '\t');
+
+    if (params[i].is_null)
+      g_string_append_len(buf, "\\N", 2);
+    else if (params[i].type == 's')
+      _pgsql_copy_escape(buf, params[i].value.s);
+    else
+      // other types never need escaping
+      g_string_append(buf, _pgsql_param_text(params + i, value_buf));
+  }
+  g_string_append_c(buf, '\n');
+
+  if (buf->len >= PGSQL_COPY_BUF)
+    return _pgsql_copy_send(copy);
+  return 0;
+}
+
+static void _pgsql_copy_free(gs_copy* copy)
+{
+  PGresult* res;
+
+  while ((res = PQgetResult(CONN(copy->conn)->pg)) != NULL)
+    PQclear(res);
+  if (COPY(copy)->row)
+    PQfreemem(COPY(copy)->row);
+  if (COPY(copy)->buf)
+    g_string_free(COPY(copy)->buf, TRUE);
+  g_free(COPY(copy)->fields);
+  g_free(copy);
+}
+
+/* Read the rest of COPY TO output, returns -1 if COPY failed. */
+static int _pgsql_copy_out_end(gs_copy* copy)
+{
+  PGconn* pg = CONN(copy->conn)->pg;
+  PGresult* res;
+  char* buf;
+  int len;
+  int retval = 0;
+
+  if (COPY(copy)->done)
+    return 0;
+  COPY(copy)->done = TRUE;
+
+  while ((len = PQgetCopyData(pg, &buf, 0)) >= 0)
+    PQfreemem(buf);
+
+  res = PQgetResult(pg);
+  if (PQresultStatus(res) != PGRES_COMMAND_OK)
+  {
+    gs_set_error(copy->conn, pgsql_convert_error(PQresultErrorField(res, PG_DIAG_SQLSTATE)), PQresultErrorMessage(res));
+    retval = -1;
+  }
+  PQclear(res);
+
+  return retval;
+}
+
+static int pgsql_gs_copy_finish(gs_copy* copy)
+{
+  PGconn* pg = CONN(copy->conn)->pg;
+  PGresult* res;
+  int retval = 0;
+
+  if (COPY(copy)->out)
+  {
+    retval = _pgsql_copy_out_end(copy);
+    _pgsql_copy_free(copy);
+    return retval;
+  }
+
+  if (_pgsql_copy_send(copy) < 0)
+  {
+    PQputCopyEnd(pg, "client error");
+    _pgsql_copy_free(copy);
+    return -1;
+  }
+
+  if (PQputCopyEnd(pg, NULL) != 1)
+  {
+    gs_set_error(copy->conn, GS_ERR_OTHER, PQerrorMessage(pg));
+    _pgsql_copy_free(copy);
+    return -1;
+  }
+
+  res = PQgetResult(pg);
+  if (PQresultStatus(res) != PGRES_COMMAND_OK)
+  {
+    gs_set_error(copy->conn, pgsql_convert_error(PQresultErrorField(res, PG_DIAG_SQLSTATE)), PQresultErrorMessage(res));
+    retval = -1;
+  }
+  PQclear(res);
+
+  _pgsql_copy_free(copy);
+  return retval;
+}
+
+static void _pgsql_cancel(gs_conn* conn)
+{
+  PGcancel* cancel = PQgetCancel(CONN(conn)->pg);
+  char errbuf[256];
+
+  if (cancel == NULL)
+    return;
+  PQcancel(cancel, errbuf, sizeof(errbuf));
+  PQfreeCancel(cancel);
+}
+
+static void pgsql_gs_copy_abort(gs_copy* copy)
+{
+  if (COPY(copy)->out)
+  {
+    if (!COPY(copy)->done)
+      _pgsql_cancel(copy->conn);
+    // cancelled COPY fails, but that's what we want
+    if (_pgsql_copy_out_end(copy) < 0)
+      gs_clear_error(copy->conn);
+  }
+  else
+    PQputCopyEnd(CONN(copy->conn)->pg, "aborted by client");
+  _pgsql_copy_free(copy);
+}
+
+static int _pgsql_copy_out_start(gs_conn* conn, const char* sql_string)
+{
+  PGresult* res;
+  char* sql;
+
+  _pgsql_end_stream(conn);
+
+  sql = g_strdup_printf("COPY (%s) TO STDOUT", sql_string);
+  res = PQexec(CONN(conn)->pg, sql);
+  g_free(sql);
+  if (PQresultStatus(res) != PGRES_COPY_OUT)
+  {
+    gs_set_error(conn, pgsql_convert_error(PQresultErrorField(res, PG_DIAG_SQLSTATE)), PQresultErrorMessage(res));
+    PQclear(res);
+    return -1;
+  }
+
+  PQclear(res);
+  return 0;
+}
+
+static gs_copy* pgsql_gs_copy_out_new(gs_conn* conn, const char* sql_string)
+{
+  struct _gs_copy_pgsql* copy;
+
+  if (_pgsql_copy_out_start(conn, sql_string) < 0)
+    return NULL;
+
+  copy = g_new0(struct _gs_copy_pgsql, 1);
+  copy->base.conn = conn;
+  copy->out = TRUE;
+  return (gs_copy*)copy;
+}
+
+static int _pgsql_hex_value(char c)
+{
+  if (g_ascii_isdigit(c))
+    return c - '0';
+  return g_ascii_tolower(c) - 'a' + 10;
+}
+
+/* Split row of COPY text format into fields and unescape them in place. */
+static void _pgsql_copy_split(gs_copy* copy, char* row, int len)
+{
+  char* end = row + len;
+  char* r = row;
+  char* w = row;
+  char* field = row;
+  gboolean is_null = FALSE;
+  int n = 0;
+
+  if (len > 0 && end[-1] == '\n')
+    end--;
+
+  // NULL is unescaped \N forming the whole field
+  if (end - r >= 2 && r[0] == '\\' && r[1] == 'N' && (r + 2 == end || r[2] == '\t'))
+  {
+    is_null = TRUE;
+    r += 2;
+  }
+
+  while (TRUE)
+  {
+    if (r == end || *r == '\t')
+    {
+      if (n == COPY(copy)->fields_alloc)
+      {
+        COPY(copy)->fields_alloc = MAX(16, n * 2);
+        COPY(copy)->fields = g_renew(char*, COPY(copy)->fields, COPY(copy)->fields_alloc);
+      }
+      *w = '\0';
+      COPY(copy)->fields[n++] = is_null ? NULL : field;
+      if (r == end)
+        break;
+      r++;
+      field = ++w;
+      is_null = end - r >= 2 && r[0] == '\\' && r[1] == 'N' && (r + 2 == end || r[2] == '\t');
+      if (is_null)
+        r += 2;
+      continue;
+    }
+
+    if (*r == '\\' && r + 1 < end)
+    {
+      r++;
+      switch (*r)
+      {
+        case 'b': *w++ = '\b'; r++; break;
+        case 'f': *w++ = '\f'; r++; break;
+        case 'n': *w++ = '\n'; r++; break;
+        case 'r': *w++ = '\r'; r++; break;
+        case 't': *w++ = '\t'; r++; break;
+        case 'v': *w++ = '\v'; r++; break;
+        case 'x':
+        {
+          int v = 0, i;
+          r++;
+          for (i = 0; i < 2 && r < end && g_ascii_isxdigit(*r); i++, r++)
+            v = v * 16 + _pgsql_hex_value(*r);
+          *w++ = (char)v;
+          break;
+        }
+        default:
+          if (*r >= '0' && *r <= '7')
+          {
+            int v = 0, i;
+            for (i = 0; i < 3 && r < end && *r >= '0' && *r <= '7'; i++, r++)
+              v = v * 8 + (*r - '0');
+            *w++ = (char)v;
+          }
+          else
+            *w++ = *r++;
+      }
+      continue;
+    }
+
+    *w++ = *r++;
+  }
+
+  COPY(copy)->n_fields = n;
+}
+
+static int pgsql_gs_copy_get_plan(gs_copy* copy, const gs_plan* plan, void** targets)
+{
+  PGconn* pg = CONN(copy->conn)->pg;
+  int i, len;
+  char* value;
+
+  if (COPY(copy)->row)
+    PQfreemem(COPY(copy)->row);
+  COPY(copy)->row = NULL;
+
+  if (COPY(copy)->done)
+    return 1;
+
+  len = PQgetCopyData(pg, &COPY(copy)->row, 0);
+  if (len == -1)
+    return _pgsql_copy_out_end(copy) < 0 ? -1 : 1;
+  else if (len < 0)
+  {
+    gs_set_error(copy->conn, GS_ERR_OTHER, PQerrorMessage(pg));
+    return -1;
+  }
+
+  _pgsql_copy_split(copy, COPY(copy)->row, len);
+
+  for (i = 0; i < plan->n_slots; i++)
+  {
+    int col = plan->slots[i].col;
+
+    value = col < COPY(copy)->n_fields ? COPY(copy)->fields[col] : NULL;
+
+    switch (plan->slots[i].type)
+    {
+      case 's':
+      {
+        char** str_ptr = (char**)targets[i];
+        *str_ptr = value;
+        break;
+      }
+      case 'S':
+      {
+        char** str_ptr = (char**)targets[i];
+        *str_ptr = g_strdup(value);
+        break;
+      }
+      case 'i':
+      {
+        int* int_ptr = (int*)targets[i];
+        if (value != NULL)
+          *int_ptr = atoi(value);
+        break;
+      }
+      case 'l':
+      {
+        gint64* int_ptr = (gint64*)targets[i];
+        if (value != NULL)
+          *int_ptr = g_ascii_strtoll(value, NULL, 10);
+        break;
+      }
+      case 'd':
+      {
+        double* double_ptr = (double*)targets[i];
+        if (value != NULL)
+          *double_ptr = g_ascii_strtod(value, NULL);
+        break;
+      }
+      case 'b':
+      {
+        gboolean* bool_ptr = (gboolean*)targets[i];
+        if (value != NULL)
+          *bool_ptr = _pgsql_text_to_bool(value);
+        break;
+      }
+      case 't':
+      {
+        gint64* time_ptr = (gint64*)targets[i];
+        if (value != NULL && gs_time_parse(value, time_ptr) < 0)
+        {
+          gs_set_error(copy->conn, GS_ERR_OTHER, "Invalid timestamp value.");
+          return -1;
+        }
+        break;
+      }
+      case '?': // null flag
+      {
+        int* int_ptr = (int*)targets[i];
+        *int_ptr = value == NULL;
+        break;
+      }
+    }
+  }
+
+  return 0;
+}
+
+static int pgsql_gs_copy_out(gs_conn* conn, const char* sql_string, gs_copy_out_func func, gpointer user_data)
+{
+  PGconn* pg = CONN(conn)->pg;
+  GString* chunk;
+  char* buf;
+  int len;
+  int retval = 0;
+  struct _gs_copy_pgsql copy = { .base.conn = conn, .out = TRUE };
+
+  if (_pgsql_copy_out_start(conn, sql_string) < 0)
+    return -1;
+
+  // rows are delivered one by one, pass them to the callback in bigger chunks
+  chunk = g_string_sized_new(PGSQL_COPY_BUF + 1024);
+  while ((len = PQgetCopyData(pg, &buf, 0)) >= 0)
+  {
+    g_string_append_len(chunk, buf, len);
+    PQfreemem(buf);
+
+    if (chunk->len >= PGSQL_COPY_BUF)
+    {
+      if (func(chunk->str, chunk->len, user_data) < 0)
+      {
+        _pgsql_cancel(conn);
+        _pgsql_copy_out_end((gs_copy*)&copy);
+        gs_clear_error(conn);
+        gs_set_error(conn, GS_ERR_OTHER, "COPY was stopped by callback.");
+        g_string_free(chunk, TRUE);
+        return -1;
+      }
+      g_string_truncate(chunk, 0);
+    }
+  }
+
+  if (len == -2)
+  {
+    gs_set_error(conn, GS_ERR_OTHER, PQerrorMessage(pg));
+    retval = -1;
+  }
+  else if (chunk->len > 0 && func(chunk->str, chunk->len, user_data) < 0)
+  {
+    gs_set_error(conn, GS_ERR_OTHER, "COPY was stopped by callback.");
+    retval = -1;
+  }
+  g_string_free(chunk, TRUE);
+
+  if (_pgsql_copy_out_end((gs_copy*)&copy) < 0)
+    retval = -1;
+
+  return retval;
 }
 
-static int pgsql_gs_query_get_last_id(gs_query* query, const char* seq_name)
+static gint64 pgsql_gs_query_get_last_id(gs_query* query, const char* seq_name)
 {
   gs_set_error(query->conn, GS_ERR_OTHER, "pgsql_gs_query_get_last_id() is not implemented!");
   return -1;
@@ -290,13 +2032,34 @@ gs_driver pgsql_driver =
   .name = "pgsql",
   .connect = pgsql_gs_connect,
   .disconnect = pgsql_gs_disconnect,
+  .is_alive = pgsql_gs_is_alive,
   .begin = pgsql_gs_begin,
   .commit = pgsql_gs_commit,
   .rollback = pgsql_gs_rollback,
   .query_new = pgsql_gs_query_new,
   .query_free = pgsql_gs_query_free,
-  .query_getv = pgsql_gs_query_getv,
-  .query_putv = pgsql_gs_query_putv,
+  .query_reset = pgsql_gs_query_reset,
+  .query_get_plan = pgsql_gs_query_get_plan,
+  .query_get_batch = pgsql_gs_query_get_batch,
+  .query_put_params = pgsql_gs_query_put_params,
+  .query_set_result_mode = pgsql_gs_query_set_result_mode,
   .query_get_rows = pgsql_gs_query_get_rows,
+  .query_get_columns = pgsql_gs_query_get_columns,
   .query_get_last_id = pgsql_gs_query_get_last_id,
+  .copy_in_new = pgsql_gs_copy_in_new,
+  .copy_put_params = pgsql_gs_copy_put_params,
+  .copy_finish = pgsql_gs_copy_finish,
+  .copy_abort = pgsql_gs_copy_abort,
+  .copy_out_new = pgsql_gs_copy_out_new,
+  .copy_get_plan = pgsql_gs_copy_get_plan,
+  .copy_out = pgsql_gs_copy_out,
+  .query_put_async = pgsql_gs_query_put_async,
+  .explain_prefix = "EXPLAIN ",
+  .explain_fmt = "s",
+#ifdef HAVE_PQENTERPIPELINEMODE
+  .query_put_array = pgsql_gs_query_put_array,
+  .batch_begin = pgsql_gs_batch_begin,
+  .batch_add_params = pgsql_gs_batch_add_params,
+  .batch_flush = pgsql_gs_batch_flush,
+#endif
 };
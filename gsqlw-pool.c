@@ -0,0 +1,285 @@
+/*
+ * Glib sql wrapper.
+ *
+ * Copyright (C) 2008-2010 Zonio s.r.o <developers@zonio.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <config.h>
+
+#include "gsqlw-priv.h"
+
+struct _gs_pool_entry
+{
+  gs_conn* conn;
+  gint64 last_used;  // monotonic time of the last checkin
+};
+
+struct _gs_pool
+{
+  char* dsn;
+  int min_size;
+  int max_size;
+  gint64 idle_timeout;  // in microseconds, 0 means never evict
+  gs_result_cache* result_cache;
+
+  GMutex lock;
+  GCond cond;
+  GQueue idle;          // most recently used entry is at the head
+  int size;             // idle + checked out + being connected
+};
+
+/* Must be called with pool->lock held. Expired connections are only unlinked
+ * here, caller disconnects them after releasing the lock.
+ */
+static GSList* _pool_evict_idle(gs_pool* pool)
+{
+  GSList* evicted = NULL;
+  gint64 now;
+
+  if (pool->idle_timeout <= 0)
+    return NULL;
+
+  now = g_get_monotonic_time();
+  while (pool->size > pool->min_size && !g_queue_is_empty(&pool->idle))
+  {
+    struct _gs_pool_entry* entry = g_queue_peek_tail(&pool->idle);
+    if (now - entry->last_used < pool->idle_timeout)
+      break;
+    g_queue_pop_tail(&pool->idle);
+    evicted = g_slist_prepend(evicted, entry->conn);
+    g_free(entry);
+    pool->size--;
+  }
+
+  return evicted;
+}
+
+static void _pool_disconnect_all(GSList* conns)
+{
+  GSList* iter;
+
+  for (iter = conns; iter; iter = iter->next)
+    gs_disconnect(iter->data);
+  g_slist_free(conns);
+}
+
+/* Returns TRUE if connection can be reused by another pool user. */
+static gboolean _pool_reset_conn(gs_conn* conn)
+{
+  if (conn == NULL)
+    return FALSE;
+
+  // connection was never established or server went away
+  if (conn->driver->is_alive && !conn->driver->is_alive(conn))
+    return FALSE;
+
+  // drivers roll back through gs_exec(), which refuses to run while the
+  // error of the failed statement is set
+  gs_clear_error(conn);
+  if (conn->in_transaction && gs_rollback(conn) < 0)
+    return FALSE;
+
+  return TRUE;
+}
+
+gs_pool* gs_pool_new(const char* dsn, int min_size, int max_size)
+{
+  gs_pool* pool;
+  GSList* conns = NULL;
+  GSList* iter;
+  int i;
+
+  if (dsn == NULL || min_size < 0 || max_size < 1 || min_size > max_size)
+    return NULL;
+
+  pool = g_new0(gs_pool, 1);
+  pool->dsn = g_strdup(dsn);
+  pool->min_size = min_size;
+  pool->max_size = max_size;
+  g_mutex_init(&pool->lock);
+  g_cond_init(&pool->cond);
+  g_queue_init(&pool->idle);
+
+  // prefill, failed connections are not fatal, they will be retried on checkout
+  for (i = 0; i < min_size; i++)
+  {
+    gs_conn* conn = gs_connect(dsn);
+    if (conn == NULL || gs_get_errcode(conn) != GS_ERR_NONE)
+    {
+      gs_disconnect(conn);
+      break;
+    }
+    conns = g_slist_prepend(conns, conn);
+  }
+
+  for (iter = conns; iter; iter = iter->next)
+  {
+    struct _gs_pool_entry* entry = g_new0(struct _gs_pool_entry, 1);
+    entry->conn = iter->data;
+    entry->last_used = g_get_monotonic_time();
+    g_queue_push_tail(&pool->idle, entry);
+    pool->size++;
+  }
+  g_slist_free(conns);
+
+  return pool;
+}
+
+void gs_pool_free(gs_pool* pool)
+{
+  struct _gs_pool_entry* entry;
+
+  if (pool == NULL)
+    return;
+
+  while ((entry = g_queue_pop_head(&pool->idle)) != NULL)
+  {
+    gs_disconnect(entry->conn);
+    g_free(entry);
+  }
+
+  g_cond_clear(&pool->cond);
+  g_mutex_clear(&pool->lock);
+  g_free(pool->dsn);
+  g_free(pool);
+}
+
+void gs_pool_set_idle_timeout(gs_pool* pool, int seconds)
+{
+  GSList* evicted;
+
+  if (pool == NULL)
+    return;
+
+  g_mutex_lock(&pool->lock);
+  pool->idle_timeout = seconds > 0 ? (gint64)seconds * G_USEC_PER_SEC : 0;
+  evicted = _pool_evict_idle(pool);
+  g_mutex_unlock(&pool->lock);
+
+  _pool_disconnect_all(evicted);
+}
+
+void gs_pool_set_result_cache(gs_pool* pool, gs_result_cache* cache)
+{
+  if (pool == NULL)
+    return;
+
+  g_mutex_lock(&pool->lock);
+  pool->result_cache = cache;
+  g_mutex_unlock(&pool->lock);
+}
+
+gs_conn* gs_pool_get(gs_pool* pool, int timeout_ms)
+{
+  struct _gs_pool_entry* entry = NULL;
+  gs_result_cache* cache;
+  gboolean reserved = FALSE;
+  GSList* evicted;
+  gs_conn* conn;
+  gint64 deadline = 0;
+
+  if (pool == NULL)
+    return NULL;
+
+  if (timeout_ms > 0)
+    deadline = g_get_monotonic_time() + (gint64)timeout_ms * 1000;
+
+  g_mutex_lock(&pool->lock);
+  evicted = _pool_evict_idle(pool);
+
+  while (TRUE)
+  {
+    entry = g_queue_pop_head(&pool->idle);
+    if (entry != NULL)
+      break;
+
+    if (pool->size < pool->max_size)
+    {
+      // reserve slot and connect without holding the lock
+      pool->size++;
+      reserved = TRUE;
+      break;
+    }
+
+    if (timeout_ms == 0)
+      break;
+    else if (timeout_ms < 0)
+      g_cond_wait(&pool->cond, &pool->lock);
+    else if (!g_cond_wait_until(&pool->cond, &pool->lock, deadline))
+      break;
+  }
+  cache = pool->result_cache;
+  g_mutex_unlock(&pool->lock);
+
+  _pool_disconnect_all(evicted);
+
+  if (entry != NULL)
+  {
+    conn = entry->conn;
+    conn->result_cache = cache;
+    g_free(entry);
+    return conn;
+  }
+
+  if (!reserved)
+    return NULL;
+
+  conn = gs_connect(pool->dsn);
+  if (conn != NULL)
+    conn->result_cache = cache;
+  else
+  {
+    g_mutex_lock(&pool->lock);
+    pool->size--;
+    g_cond_signal(&pool->cond);
+    g_mutex_unlock(&pool->lock);
+  }
+
+  // connection with error set is returned too, caller must check it using
+  // gs_get_errcode() and give it back using gs_pool_put()
+  return conn;
+}
+
+void gs_pool_put(gs_pool* pool, gs_conn* conn)
+{
+  struct _gs_pool_entry* entry;
+
+  if (pool == NULL || conn == NULL)
+    return;
+
+  if (!_pool_reset_conn(conn))
+  {
+    gs_disconnect(conn);
+    g_mutex_lock(&pool->lock);
+    pool->size--;
+    g_cond_signal(&pool->cond);
+    g_mutex_unlock(&pool->lock);
+    return;
+  }
+
+  entry = g_new0(struct _gs_pool_entry, 1);
+  entry->conn = conn;
+  entry->last_used = g_get_monotonic_time();
+
+  g_mutex_lock(&pool->lock);
+  g_queue_push_head(&pool->idle, entry);
+  g_cond_signal(&pool->cond);
+  g_mutex_unlock(&pool->lock);
+}
@@ -26,6 +26,124 @@
 #include "gsqlw.h"
 
 typedef struct _gs_driver gs_driver;
+typedef struct _gs_param gs_param;
+typedef struct _gs_plan_slot gs_plan_slot;
+typedef struct _gs_array_error gs_array_error;
+typedef struct _gs_time gs_time;
+typedef struct _gs_thread_error gs_thread_error;
+typedef struct _gs_stats_ref gs_stats_ref;
+typedef struct _gs_stats_entry gs_stats_entry;
+typedef struct _gs_stats_shard gs_stats_shard;
+typedef struct _gs_cache_entry gs_cache_entry;
+typedef struct _gs_cache_cell gs_cache_cell;
+typedef struct _gs_snapshot gs_snapshot;
+
+/* Parameter of gs_query_put() taken from the argument list. */
+struct _gs_param
+{
+  char type;                // format code ('s', 'i', 'l', 'd', 'b' or 't')
+  int is_null;              // also set for NULL strings
+  union
+  {
+    int i;                  // 'i' and 'b' (0 or 1)
+    gint64 l;               // 'l' and 't' (microseconds since the epoch)
+    double d;
+    const char* s;
+  } value;
+};
+
+/* One item of compiled format string, see gs_plan_new(). */
+struct _gs_plan_slot
+{
+  char type;                // 's', 'S', 'i', 'l', 'd', 'b', 't' or '?'
+  int col;                  // column or parameter the item refers to
+};
+
+struct _gs_plan
+{
+  char* fmt;
+  int n_slots;
+  int n_cols;               // number of columns or parameters used
+  gs_plan_slot slots[];
+};
+
+/* First error of gs_query_put_array(), reported when all rows are done. */
+struct _gs_array_error
+{
+  int code;
+  char* msg;
+};
+
+/* Error state of one thread in thread-safe mode. */
+struct _gs_thread_error
+{
+  int code;
+  char* msg;
+};
+
+/* Statistics entry of a query, cached to skip the lookup by SQL text. */
+struct _gs_stats_ref
+{
+  char* sql;                // normalized SQL text
+  gs_stats_shard* shard;    // entry is valid while shard generation matches
+  guint generation;
+  gs_stats_entry* entry;
+};
+
+/* Kinds of cached values, see gs_cache_cell. */
+enum _gs_cache_kinds
+{
+  GS_CACHE_TEXT = 0,
+  GS_CACHE_INT,
+  GS_CACHE_DOUBLE,
+  GS_CACHE_TIME
+};
+
+/* Value of cached result, numbers and timestamps are decoded from the text
+ * once when the result is stored.
+ */
+struct _gs_cache_cell
+{
+  int offset;               // text of the value in data, -1 for NULL
+  char kind;                // see enum _gs_cache_kinds
+  union
+  {
+    gint64 l;               // GS_CACHE_INT, microseconds of GS_CACHE_TIME
+    double d;               // GS_CACHE_DOUBLE
+  } value;
+};
+
+/* Result kept by gs_result_cache. */
+struct _gs_cache_entry
+{
+  int refs;
+  int n_cols;
+  int n_rows;
+  gsize size;               // memory accounted to the cache
+  gint64 expires;           // monotonic time
+  GBytes* key;              // set when entry is added to the cache
+  char** tables;            // tables the result was read from
+  GList* link;              // link in the cache LRU
+  const char* data;         // NUL terminated text of the values
+  gs_cache_cell cells[];    // values of all rows, row by row
+};
+
+/* Broken down UTC time of 't' values. */
+struct _gs_time
+{
+  int year;
+  int month;                // 1-12
+  int day;                  // 1-31
+  int hour;
+  int minute;
+  int second;
+  int usec;
+};
+
+/* enough for gs_time_format() output */
+#define GS_TIME_BUF 40
+
+#define GS_PLAN_SIZE(n_slots) (sizeof(gs_plan) + (n_slots) * sizeof(gs_plan_slot))
 
 struct _gs_conn
 {
@@ -34,12 +152,78 @@ struct _gs_conn
   char* errmsg;
   gs_driver* driver;
   int in_transaction;
+
+  /* prepared statement cache */
+  GHashTable* stmt_cache;   // SQL text -> link in stmt_cache_lru
+  GQueue stmt_cache_lru;    // idle queries, most recently used at the head
+  int stmt_cache_size;
+  guint64 stmt_cache_hits;
+  guint64 stmt_cache_misses;
+
+  /* statement batch */
+  int batch_active;
+  int batch_count;          // statements added since gs_batch_begin()
+  int batch_error_index;    // index of the first failed statement or -1
+
+  /* thread-safe mode, see gs_set_thread_safe() */
+  int thread_safe;
+  GRecMutex lock;           // held during driver calls, and for the whole
+                            // transaction, batch or COPY by its thread
+  GMutex error_lock;
+  GHashTable* thread_errors; // GThread* -> gs_thread_error, threads with error
+  int n_thread_errors;      // read atomically to skip lookup of error-free threads
+
+  /* statistics, see gs_get_stats() */
+  int stats_enabled;
+  int stats_used;           // statistics were enabled at some point
+  guint stats_id;           // identifies connection in per-thread counters
+
+  /* slow query reporting, see gs_set_slow_query_handler() */
+  gs_slow_query_func slow_query_func;
+  gpointer slow_query_data;
+  gint64 slow_query_threshold; // in microseconds
+  int slow_query_explain;
+
+  /* result cache, see gs_set_result_cache() */
+  gs_result_cache* result_cache;
+  GPtrArray* cache_written; // tables modified in the current transaction
 };
 
 struct _gs_query
 {
   gs_conn* conn;
   char* sql;
+  char* cache_key;          // original SQL text if query may be cached
+  int result_mode;          // see enum _gs_result_modes
+  int fetch_size;           // rows fetched at once when streaming, 0 for default
+  gs_plan* put_plan;        // last format strings used with the query
+  gs_plan* get_plan;
+  GString* batch_data;      // string values of the last gs_query_get_batch()
+  gs_stats_ref stats;
+  int fetched_rows;         // rows read since the last gs_query_put()
+  char* slow_sql;           // original SQL text if cache_key is not set
+  gs_param* slow_params;    // last parameters while slow query handler is set
+  int slow_n_params;
+  int cache_ttl;            // in milliseconds, 0 if result is not cached
+  gs_cache_entry* cache_rows; // cached result being read
+  int cache_row;
+  int tables_parsed;        // read_tables and write_tables are valid
+  char** read_tables;
+  char** write_tables;
+};
+
+struct _gs_copy
+{
+  gs_conn* conn;
+  gs_query* query;          // used if driver does not implement copy
+  int own_transaction;      // transaction was started by gs_copy_in_new()
+  char* table;              // loaded table, invalidated in result cache
+};
+
+/* Copy of the database from or to a file, extended by the driver. */
+struct _gs_snapshot
+{
+  gs_conn* conn;
 };
 
 struct _gs_driver
@@ -48,6 +232,7 @@ struct _gs_driver
 
   gs_conn* (*connect)(const char* dsn);
   void (*disconnect)(gs_conn* conn);
+  int (*is_alive)(gs_conn* conn);
 
   int (*begin)(gs_conn* conn);
   int (*commit)(gs_conn* conn);
@@ -55,14 +240,82 @@ struct _gs_driver
 
   gs_query* (*query_new)(gs_conn* conn, const char* sql_string);
   void (*query_free)(gs_query* query);
+  int (*query_reset)(gs_query* query);
 
-  int (*query_getv)(gs_query* query, const char* fmt, va_list ap);
-  int (*query_putv)(gs_query* query, const char* fmt, va_list ap);
+  /* targets holds one pointer for each plan slot */
+  int (*query_get_plan)(gs_query* query, const gs_plan* plan, void** targets);
+  int (*query_put_params)(gs_query* query, const gs_param* params, int count);
 
+  int (*query_set_result_mode)(gs_query* query, int mode);
   int (*query_get_rows)(gs_query* query);
-  int (*query_get_last_id)(gs_query* query, const char* seq_name);
+  /* optional, number of result columns after query_put_params, results
+   * are not cached if not implemented */
+  int (*query_get_columns)(gs_query* query);
+  gint64 (*query_get_last_id)(gs_query* query, const char* seq_name);
+
+  /* optional, statements are executed one by one if not implemented */
+  int (*batch_begin)(gs_conn* conn);
+  int (*batch_add_params)(gs_conn* conn, const char* sql_string, const gs_param* params, int count);
+  int (*batch_flush)(gs_conn* conn);
+
+  /* optional, rows are inserted/selected using prepared statement if not
+   * implemented */
+  gs_copy* (*copy_in_new)(gs_conn* conn, const char* table, const char* columns);
+  int (*copy_put_params)(gs_copy* copy, const gs_param* params, int count);
+  gs_copy* (*copy_out_new)(gs_conn* conn, const char* sql_string);
+  int (*copy_get_plan)(gs_copy* copy, const gs_plan* plan, void** targets);
+  int (*copy_out)(gs_conn* conn, const char* sql_string, gs_copy_out_func func, gpointer user_data);
+  int (*copy_finish)(gs_copy* copy);
+  void (*copy_abort)(gs_copy* copy);
+
+  /* optional, query is executed in worker thread if not implemented, driver
+   * must return int result of the task */
+  void (*query_put_async)(gs_query* query, const gs_param* params, int count, GTask* task);
+
+  /* optional, rows are executed one by one if not implemented, row_status
+   * may be NULL */
+  int (*query_put_array)(gs_query* query, const gs_array_column* columns, int n_columns, int n_rows, int* row_status);
+
+  /* optional, rows are read using query_get_plan if not implemented */
+  int (*query_get_batch)(gs_query* query, gs_column_buffer* columns, int n_columns, int max_rows);
+
+  /* optional, database is copied by steps of given number of pages (-1 for
+   * all), step returns 1 when the copy is complete */
+  gs_snapshot* (*snapshot_new)(gs_conn* conn, const char* path, int save);
+  int (*snapshot_step)(gs_snapshot* snapshot, int pages);
+  void (*snapshot_free)(gs_snapshot* snapshot);
+
+  /* optional, prefix that makes statement return its plan and format string
+   * reading rows of the plan, text values of each row form one line */
+  const char* explain_prefix;
+  const char* explain_fmt;
 };
 
+int gs_params_collect(gs_conn* conn, const char* fmt, va_list ap, gs_param* params) G_GNUC_INTERNAL;
+void gs_column_set_null(gs_column_buffer* column, int row) G_GNUC_INTERNAL;
+void gs_column_set_text(gs_query* query, gs_column_buffer* column, int row, const char* value, int length) G_GNUC_INTERNAL;
+void gs_array_row_params(const gs_array_column* columns, int n_columns, int row, gs_param* params) G_GNUC_INTERNAL;
+void gs_array_row_error(gs_array_error* err, int* row_status, int row, int code, const char* msg) G_GNUC_INTERNAL;
+int gs_array_finish(gs_conn* conn, gs_array_error* err) G_GNUC_INTERNAL;
+int gs_params_collect_plan(gs_conn* conn, const gs_plan* plan, va_list ap, gs_param* params) G_GNUC_INTERNAL;
+void gs_time_split(gint64 usec, gs_time* tm) G_GNUC_INTERNAL;
+gint64 gs_time_join(const gs_time* tm) G_GNUC_INTERNAL;
+int gs_time_parse(const char* str, gint64* usec) G_GNUC_INTERNAL;
+void gs_time_format(gint64 usec, char* buf) G_GNUC_INTERNAL;
+char* gs_stats_normalize(const char* sql) G_GNUC_INTERNAL;
+void gs_stats_conn_open(gs_conn* conn) G_GNUC_INTERNAL;
+void gs_stats_conn_close(gs_conn* conn) G_GNUC_INTERNAL;
+void gs_stats_record(gs_conn* conn, gs_stats_ref* ref, int phase, gint64 start, int failed, int rows) G_GNUC_INTERNAL;
+gs_cache_entry* gs_cache_entry_new(int n_cols, int n_rows, const gs_cache_cell* cells, const char* data, gsize data_len) G_GNUC_INTERNAL;
+void gs_cache_entry_unref(gs_cache_entry* entry) G_GNUC_INTERNAL;
+gs_cache_entry* gs_result_cache_lookup(gs_result_cache* cache, GBytes* key) G_GNUC_INTERNAL;
+guint64 gs_result_cache_generation(gs_result_cache* cache) G_GNUC_INTERNAL;
+void gs_result_cache_insert(gs_result_cache* cache, GBytes* key, gs_cache_entry* entry, int ttl_ms, char** tables, guint64 generation) G_GNUC_INTERNAL;
+void gs_result_cache_invalidate(gs_result_cache* cache, char** tables) G_GNUC_INTERNAL;
+void gs_sql_tables(const char* sql, char*** reads, char*** writes) G_GNUC_INTERNAL;
+
+#define GS_STMT_CACHE_DEFAULT_SIZE 16
+
 #ifdef HAVE_SQLITE
 extern gs_driver sqlite_driver G_GNUC_INTERNAL;
 #endif
@@ -24,10 +24,30 @@
 
 #include "gsqlw-priv.h"
 
+/* Writer handle shared by connections to the same file opened with
+ * single_writer option. It is owned by one connection at a time, so their
+ * writes queue in the process instead of retrying on SQLITE_BUSY. Owner is
+ * the connection, not the thread, transaction may end in other thread than
+ * it began.
+ */
+struct _sqlite_writer
+{
+  char* path;
+  int refs;                 // guarded by sqlite_writers_lock
+  sqlite3* handle;
+  GMutex lock;              // guards owner, thread and depth
+  GCond released;
+  gs_conn* owner;           // connection holding the writer
+  GThread* thread;          // thread that last took it through owner
+  int depth;
+};
+
 struct _gs_conn_sqlite
 {
   gs_conn base;
-  sqlite3* handle;
+  sqlite3* handle;          // read-only in single writer mode
+  struct _sqlite_writer* writer;
+  int writer_tx;            // transaction holds the writer
 };
 
 enum _sqlite_query_state
@@ -36,49 +56,484 @@ enum _sqlite_query_state
   QUERY_STATE_ROW_PENDING,   // sqlite3_step was called and row was not retrieved using getv
   QUERY_STATE_ROW_READ,      // row was retrieved using getv
   QUERY_STATE_COMPLETED,     // no more rows
+  QUERY_STATE_BUFFERED,      // remaining rows are read from the row buffer
+};
+
+/* One value of the buffered result. Text of all non-NULL values is stored in
+ * the data buffer so that 's' pointers stay valid, integer value is kept to
+ * avoid parsing the text again.
+ */
+struct _sqlite_cell
+{
+  sqlite3_int64 i;
+  double d;
+  guint offset;             // text position in buf_data
+  int length;               // -1 for NULL
 };
 
 struct _gs_query_sqlite
 {
   gs_query base;
   sqlite3_stmt* stmt;
+  sqlite3* handle;          // connection the statement was prepared on
+  int readonly;             // statement does not modify the database
+  int writer_locked;        // statement holds the shared writer
   int state;
+
+  int rows_read;            // rows returned by getv since put
+  int row_count;            // -1 until the result is buffered
+  int n_cols;
+  GArray* buf_cells;        // n_cols cells per row
+  GByteArray* buf_data;
+  int buf_rows;
+  int buf_pos;              // next buffered row
 };
 
 #define CONN(c) ((struct _gs_conn_sqlite*)(c))
 #define QUERY(c) ((struct _gs_query_sqlite*)(c))
 
-// dsn is filename
+/* DSN options applied as PRAGMAs after open. Value must be one of values or
+ * an integer if values is NULL, so it can be put into the statement as is.
+ */
+struct _sqlite_pragma
+{
+  const char* name;
+  const char* const* values;
+};
+
+static const char* const sqlite_journal_modes[] = { "delete", "truncate", "persist", "memory", "wal", "off", NULL };
+static const char* const sqlite_sync_levels[] = { "off", "normal", "full", "extra", NULL };
+static const char* const sqlite_temp_stores[] = { "default", "file", "memory", NULL };
+static const char* const sqlite_switch_values[] = { "on", "off", "1", "0", NULL };
+
+/* parameters of "file:" URI handled by sqlite itself */
+static const char* const sqlite_uri_params[] = { "vfs", "mode", "cache", "psow", "nolock", "immutable", NULL };
+
+static const struct _sqlite_pragma sqlite_pragmas[] = {
+  { "synchronous", sqlite_sync_levels },
+  { "mmap_size", NULL },
+  { "cache_size", NULL },
+  { "temp_store", sqlite_temp_stores },
+  { NULL, NULL }
+};
+
+#define SQLITE_DEFAULT_BUSY_TIMEOUT 10000
+
+/* Parsed "path?name=value&..." DSN. */
+struct _sqlite_dsn
+{
+  char* path;
+  int flags;                // sqlite3_open_v2() flags
+  int busy_timeout;         // in milliseconds
+  int single_writer;
+  char* journal_mode;
+  GString* pragmas;         // statements run after open
+};
+
+static gboolean _sqlite_is_integer(const char* value)
+{
+  if (*value == '-')
+    value++;
+  if (*value == '\0')
+    return FALSE;
+  for (; *value; value++)
+    if (!g_ascii_isdigit(*value))
+      return FALSE;
+  return TRUE;
+}
+
+static gboolean _sqlite_is_value(const char* value, const char* const* values)
+{
+  for (; *values; values++)
+    if (!g_ascii_strcasecmp(value, *values))
+      return TRUE;
+  return FALSE;
+}
+
+/* Apply one DSN option, returns FALSE if it is unknown or invalid. */
+static gboolean _sqlite_dsn_option(struct _sqlite_dsn* opts, const char* name, const char* value)
+{
+  const struct _sqlite_pragma* pragma;
+
+  if (!strcmp(name, "busy_timeout"))
+  {
+    if (!_sqlite_is_integer(value))
+      return FALSE;
+    opts->busy_timeout = atoi(value);
+    return TRUE;
+  }
+
+  if (!strcmp(name, "journal_mode"))
+  {
+    if (!_sqlite_is_value(value, sqlite_journal_modes))
+      return FALSE;
+    g_free(opts->journal_mode);
+    opts->journal_mode = g_ascii_strdown(value, -1);
+    return TRUE;
+  }
+
+  if (!strcmp(name, "single_writer"))
+  {
+    if (!_sqlite_is_value(value, sqlite_switch_values))
+      return FALSE;
+    opts->single_writer = !g_ascii_strcasecmp(value, "on") || !strcmp(value, "1");
+    return TRUE;
+  }
+
+  if (!strcmp(name, "mode"))
+  {
+    if (!strcmp(value, "ro"))
+      opts->flags = SQLITE_OPEN_READONLY;
+    else if (!strcmp(value, "rw"))
+      opts->flags = SQLITE_OPEN_READWRITE;
+    else if (!strcmp(value, "rwc"))
+      opts->flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+    else
+      return FALSE;
+    return TRUE;
+  }
+
+  for (pragma = sqlite_pragmas; pragma->name; pragma++)
+  {
+    if (strcmp(name, pragma->name))
+      continue;
+    if (pragma->values ? !_sqlite_is_value(value, pragma->values) : !_sqlite_is_integer(value))
+      return FALSE;
+    g_string_append_printf(opts->pragmas, "PRAGMA %s = %s;", name, value);
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+static void _sqlite_dsn_free(struct _sqlite_dsn* opts)
+{
+  g_free(opts->path);
+  g_free(opts->journal_mode);
+  g_string_free(opts->pragmas, TRUE);
+}
+
+/* Split DSN to path and options, sets error and returns -1 on invalid
+ * option. Parameters of "file:" URI that are not driver options are left in
+ * the path for sqlite.
+ */
+static int _sqlite_parse_dsn(gs_conn* conn, const char* dsn, struct _sqlite_dsn* opts)
+{
+  const char* options = strchr(dsn, '?');
+  gboolean uri = g_str_has_prefix(dsn, "file:");
+  GString* uri_params = NULL;
+  char** items;
+  int i, retval = 0;
+
+  opts->path = options ? g_strndup(dsn, options - dsn) : g_strdup(dsn);
+  opts->flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | (uri ? SQLITE_OPEN_URI : 0);
+  opts->busy_timeout = SQLITE_DEFAULT_BUSY_TIMEOUT;
+  opts->single_writer = FALSE;
+  opts->journal_mode = NULL;
+  opts->pragmas = g_string_new(NULL);
+  if (options == NULL)
+    return 0;
+
+  items = g_strsplit(options + 1, "&", 0);
+  for (i = 0; items[i] && retval == 0; i++)
+  {
+    char* value = strchr(items[i], '=');
+
+    if (*items[i] == '\0')
+      continue;
+    if (value)
+      *value++ = '\0';
+    if (uri && value && _sqlite_is_value(items[i], sqlite_uri_params))
+    {
+      if (uri_params == NULL)
+        uri_params = g_string_new(NULL);
+      g_string_append_printf(uri_params, "%c%s=%s", uri_params->len ? '&' : '?', items[i], value);
+    }
+    else if (value == NULL || !_sqlite_dsn_option(opts, items[i], value))
+    {
+      char* msg = g_strdup_printf("Invalid sqlite DSN option '%s'.", items[i]);
+
+      gs_set_error(conn, GS_ERR_OTHER, msg);
+      g_free(msg);
+      retval = -1;
+    }
+  }
+  g_strfreev(items);
+
+  if (uri_params)
+  {
+    char* path = g_strconcat(opts->path, uri_params->str, NULL);
+
+    g_free(opts->path);
+    opts->path = path;
+    g_string_free(uri_params, TRUE);
+  }
+
+  return retval;
+}
+
+/* Database exists only while it is open, ":memory:", "" or URI with
+ * mode=memory.
+ */
+static gboolean _sqlite_is_memory(const struct _sqlite_dsn* opts)
+{
+  const char* params = strchr(opts->path, '?');
+
+  if (*opts->path == '\0' || !strcmp(opts->path, ":memory:") || g_str_has_prefix(opts->path, "file::memory:"))
+    return TRUE;
+  if (!(opts->flags & SQLITE_OPEN_URI) || params == NULL)
+    return FALSE;
+  return strstr(params, "?mode=memory") != NULL || strstr(params, "&mode=memory") != NULL;
+}
+
+static int _sqlite_exec(gs_conn* conn, sqlite3* handle, const char* sql)
+{
+  char* errmsg = NULL;
+
+  if (sqlite3_exec(handle, sql, NULL, NULL, &errmsg) == SQLITE_OK)
+    return 0;
+
+  gs_set_error(conn, GS_ERR_OTHER, errmsg ? errmsg : sqlite3_errmsg(handle));
+  sqlite3_free(errmsg);
+  return -1;
+}
+
+/* Open database and apply journal mode (if not NULL) and other options. */
+static sqlite3* _sqlite_open(gs_conn* conn, const struct _sqlite_dsn* opts, int flags, const char* journal_mode)
+{
+  sqlite3* handle = NULL;
+  GString* sql;
+  int retval = 0;
+
+  if (sqlite3_open_v2(opts->path, &handle, flags, NULL) != SQLITE_OK)
+  {
+    gs_set_error(conn, GS_ERR_OTHER, sqlite3_errmsg(handle));
+    sqlite3_close(handle);
+    return NULL;
+  }
+
+  sqlite3_busy_timeout(handle, opts->busy_timeout);
+  sql = g_string_new(NULL);
+  if (journal_mode)
+    g_string_append_printf(sql, "PRAGMA journal_mode = %s;", journal_mode);
+  g_string_append(sql, opts->pragmas->str);
+  if (sql->len > 0)
+    retval = _sqlite_exec(conn, handle, sql->str);
+  g_string_free(sql, TRUE);
+
+  if (retval < 0)
+  {
+    sqlite3_close(handle);
+    return NULL;
+  }
+
+  return handle;
+}
+
+/* single writer mode */
+
+static GMutex sqlite_writers_lock;
+static GHashTable* sqlite_writers;  // path -> struct _sqlite_writer
+
+static struct _sqlite_writer* _sqlite_writer_ref(gs_conn* conn, const struct _sqlite_dsn* opts)
+{
+  struct _sqlite_writer* writer;
+
+  g_mutex_lock(&sqlite_writers_lock);
+  if (sqlite_writers == NULL)
+    sqlite_writers = g_hash_table_new(g_str_hash, g_str_equal);
+
+  writer = g_hash_table_lookup(sqlite_writers, opts->path);
+  if (writer == NULL)
+  {
+    // handle is used by threads of all connections, one at a time
+    sqlite3* handle = _sqlite_open(conn, opts, opts->flags | SQLITE_OPEN_FULLMUTEX, "wal");
+
+    if (handle == NULL)
+    {
+      g_mutex_unlock(&sqlite_writers_lock);
+      return NULL;
+    }
+    writer = g_new0(struct _sqlite_writer, 1);
+    writer->path = g_strdup(opts->path);
+    writer->handle = handle;
+    g_mutex_init(&writer->lock);
+    g_cond_init(&writer->released);
+    g_hash_table_insert(sqlite_writers, writer->path, writer);
+  }
+  writer->refs++;
+  g_mutex_unlock(&sqlite_writers_lock);
+
+  return writer;
+}
+
+static void _sqlite_writer_unref(struct _sqlite_writer* writer)
+{
+  g_mutex_lock(&sqlite_writers_lock);
+  if (--writer->refs == 0)
+  {
+    g_hash_table_remove(sqlite_writers, writer->path);
+    sqlite3_close(writer->handle);
+    g_mutex_clear(&writer->lock);
+    g_cond_clear(&writer->released);
+    g_free(writer->path);
+    g_free(writer);
+  }
+  g_mutex_unlock(&sqlite_writers_lock);
+}
+
+/* Wait until the writer is released by other connection. Connection that
+ * holds it takes it again without waiting. Thread that holds it through
+ * another connection would wait for itself, that is an error.
+ */
+static int _sqlite_writer_lock(gs_conn* conn)
+{
+  struct _sqlite_writer* writer = CONN(conn)->writer;
+  GThread* self = g_thread_self();
+
+  g_mutex_lock(&writer->lock);
+  while (writer->owner != NULL && writer->owner != conn)
+  {
+    if (writer->thread == self)
+    {
+      g_mutex_unlock(&writer->lock);
+      gs_set_error(conn, GS_ERR_OTHER, "Invalid API use, sqlite writer is held by another connection of this thread.");
+      return -1;
+    }
+    g_cond_wait(&writer->released, &writer->lock);
+  }
+  writer->owner = conn;
+  writer->thread = self;
+  writer->depth++;
+  g_mutex_unlock(&writer->lock);
+  return 0;
+}
+
+static void _sqlite_writer_unlock(gs_conn* conn)
+{
+  struct _sqlite_writer* writer = CONN(conn)->writer;
+
+  g_mutex_lock(&writer->lock);
+  if (--writer->depth == 0)
+  {
+    writer->owner = NULL;
+    writer->thread = NULL;
+    g_cond_signal(&writer->released);
+  }
+  g_mutex_unlock(&writer->lock);
+}
+
+// dsn is filename followed by optional "?name=value&..." options
 static gs_conn* sqlite_gs_connect(const char* dsn)
 {
   struct _gs_conn_sqlite* conn;
+  struct _sqlite_dsn opts;
 
   conn = g_new0(struct _gs_conn_sqlite, 1);
-  if (sqlite3_open(dsn, &conn->handle) == SQLITE_OK)
-    sqlite3_busy_timeout(conn->handle, 10000);
-  else
-    gs_set_error((gs_conn*)conn, GS_ERR_OTHER, sqlite3_errmsg(conn->handle));
+  if (_sqlite_parse_dsn((gs_conn*)conn, dsn, &opts) < 0)
+  {
+    _sqlite_dsn_free(&opts);
+    return (gs_conn*)conn;
+  }
+
+  if (!opts.single_writer)
+    conn->handle = _sqlite_open((gs_conn*)conn, &opts, opts.flags, opts.journal_mode);
+  else if ((opts.flags & SQLITE_OPEN_READONLY) || (opts.journal_mode && strcmp(opts.journal_mode, "wal")) ||
+           _sqlite_is_memory(&opts))
+    gs_set_error((gs_conn*)conn, GS_ERR_OTHER, "Invalid sqlite DSN, single_writer needs writable database file in WAL mode.");
+  else if ((conn->writer = _sqlite_writer_ref((gs_conn*)conn, &opts)) != NULL)
+  {
+    // readers see committed data only and never wait for the writer
+    conn->handle = _sqlite_open((gs_conn*)conn, &opts, SQLITE_OPEN_READONLY, NULL);
+    if (conn->handle == NULL)
+    {
+      _sqlite_writer_unref(conn->writer);
+      conn->writer = NULL;
+    }
+  }
+  _sqlite_dsn_free(&opts);
 
   return (gs_conn*)conn;
 }
 
 static void sqlite_gs_disconnect(gs_conn* conn)
 {
+  struct _sqlite_writer* writer = CONN(conn)->writer;
+
   sqlite3_close(CONN(conn)->handle);
+  if (writer == NULL)
+    return;
+
+  if (CONN(conn)->writer_tx)
+  {
+    sqlite3_exec(writer->handle, "ROLLBACK", NULL, NULL, NULL);
+    _sqlite_writer_unlock(conn);
+  }
+  _sqlite_writer_unref(writer);
 }
 
+static int sqlite_gs_is_alive(gs_conn* conn)
+{
+  return CONN(conn)->handle != NULL;
+}
+
+/* In single writer mode transaction holds the writer until it ends,
+ * IMMEDIATE takes the database lock right away so that it is never upgraded
+ * later.
+ */
 static int sqlite_gs_begin(gs_conn* conn)
 {
-  return gs_exec(conn, "BEGIN", NULL);
+  if (CONN(conn)->writer == NULL)
+    return gs_exec(conn, "BEGIN", NULL);
+
+  if (CONN(conn)->writer_tx)
+  {
+    gs_set_error(conn, GS_ERR_OTHER, "cannot start a transaction within a transaction");
+    return -1;
+  }
+  if (_sqlite_writer_lock(conn) < 0)
+    return -1;
+  if (_sqlite_exec(conn, CONN(conn)->writer->handle, "BEGIN IMMEDIATE") < 0)
+  {
+    _sqlite_writer_unlock(conn);
+    return -1;
+  }
+  CONN(conn)->writer_tx = TRUE;
+  return 0;
+}
+
+static int _sqlite_writer_end(gs_conn* conn, const char* sql)
+{
+  sqlite3* handle = CONN(conn)->writer->handle;
+  int retval;
+
+  if (!CONN(conn)->writer_tx)
+  {
+    gs_set_error(conn, GS_ERR_OTHER, "cannot end transaction - no transaction is active");
+    return -1;
+  }
+
+  retval = _sqlite_exec(conn, handle, sql);
+  // failed COMMIT may leave the transaction open
+  if (sqlite3_get_autocommit(handle))
+  {
+    CONN(conn)->writer_tx = FALSE;
+    _sqlite_writer_unlock(conn);
+  }
+  return retval;
 }
 
 static int sqlite_gs_commit(gs_conn* conn)
 {
+  if (CONN(conn)->writer)
+    return _sqlite_writer_end(conn, "COMMIT");
   return gs_exec(conn, "COMMIT", NULL);
 }
 
 static int sqlite_gs_rollback(gs_conn* conn)
 {
+  if (CONN(conn)->writer)
+    return _sqlite_writer_end(conn, "ROLLBACK");
   return gs_exec(conn, "ROLLBACK", NULL);
 }
 
@@ -104,6 +559,56 @@ static char* _sqlite_fixup_sql(const char* str)
 
 static void sqlite_gs_query_free(gs_query* query);
 
+/* Prepare statement on the connection handle or on the shared writer. */
+static int _sqlite_query_prepare(gs_query* query, gboolean on_writer)
+{
+  gs_conn* conn = query->conn;
+  sqlite3* handle = on_writer ? CONN(conn)->writer->handle : CONN(conn)->handle;
+  int rs;
+
+  if (QUERY(query)->stmt != NULL)
+    sqlite3_finalize(QUERY(query)->stmt);
+  QUERY(query)->stmt = NULL;
+  QUERY(query)->handle = handle;
+  QUERY(query)->state = QUERY_STATE_INIT;
+
+#if defined(HAVE_SQLITE_PREPARE_V3)
+  // cached statements are long lived, let sqlite allocate them accordingly
+  rs = sqlite3_prepare_v3(handle, query->sql, -1,
+                          conn->stmt_cache_size > 0 ? SQLITE_PREPARE_PERSISTENT : 0,
+                          &QUERY(query)->stmt, NULL);
+#elif defined(HAVE_SQLITE_V2_METHODS)
+  rs = sqlite3_prepare_v2(handle, query->sql, -1, &QUERY(query)->stmt, NULL);
+#else
+  rs = sqlite3_prepare(handle, query->sql, -1, &QUERY(query)->stmt, NULL);
+#endif
+  if (rs != SQLITE_OK)
+  {
+    gs_set_error(conn, GS_ERR_OTHER, sqlite3_errmsg(handle));
+    return -1;
+  }
+
+  QUERY(query)->readonly = sqlite3_stmt_readonly(QUERY(query)->stmt);
+  return 0;
+}
+
+/* In single writer mode statements that modify the database and all
+ * statements of a transaction run on the writer, the rest on the reader.
+ */
+static gboolean _sqlite_query_on_writer(gs_query* query)
+{
+  return CONN(query->conn)->writer != NULL && (CONN(query->conn)->writer_tx || !QUERY(query)->readonly);
+}
+
+/* Release the writer taken by the statement once it has finished. */
+static void _sqlite_query_unlock(gs_query* query)
+{
+  if (!QUERY(query)->writer_locked)
+    return;
+  QUERY(query)->writer_locked = FALSE;
+  _sqlite_writer_unlock(query->conn);
+}
+
 static gs_query* sqlite_gs_query_new(gs_conn* conn, const char* sql_string)
 {
   struct _gs_query_sqlite* query;
@@ -114,14 +619,11 @@ static gs_query* sqlite_gs_query_new(gs_conn* conn, const char* sql_string)
   query->base.sql = _sqlite_fixup_sql(sql_string);
   query->state = QUERY_STATE_INIT;
 
-#ifndef HAVE_SQLITE_V2_METHODS
-  rs = sqlite3_prepare(CONN(conn)->handle, query->base.sql, -1, &query->stmt, NULL);
-#else
-  rs = sqlite3_prepare_v2(CONN(conn)->handle, query->base.sql, -1, &query->stmt, NULL);
-#endif
-  if (rs != SQLITE_OK)
+  rs = _sqlite_query_prepare((gs_query*)query, CONN(conn)->writer_tx);
+  if (rs == 0 && _sqlite_query_on_writer((gs_query*)query) && query->handle != CONN(conn)->writer->handle)
+    rs = _sqlite_query_prepare((gs_query*)query, TRUE);
+  if (rs < 0)
   {
-    gs_set_error(conn, GS_ERR_OTHER, sqlite3_errmsg(CONN(conn)->handle));
     sqlite_gs_query_free((gs_query*)query);
     return NULL;
   }
@@ -129,20 +631,198 @@ static gs_query* sqlite_gs_query_new(gs_conn* conn, const char* sql_string)
   return (gs_query*)query;
 }
 
+static void _sqlite_buffer_free(gs_query* query)
+{
+  if (QUERY(query)->buf_cells != NULL)
+    g_array_free(QUERY(query)->buf_cells, TRUE);
+  if (QUERY(query)->buf_data != NULL)
+    g_byte_array_free(QUERY(query)->buf_data, TRUE);
+  QUERY(query)->buf_cells = NULL;
+  QUERY(query)->buf_data = NULL;
+  QUERY(query)->buf_rows = 0;
+  QUERY(query)->buf_pos = 0;
+  QUERY(query)->row_count = -1;
+}
+
+/* Step through the rest of the result and store it in the row buffer, so
+ * that its size is known without executing the statement again.
+ */
+static int _sqlite_buffer_rows(gs_query* query)
+{
+  sqlite3_stmt* stmt = QUERY(query)->stmt;
+  int state = QUERY(query)->state;
+  int n_cols = sqlite3_column_count(stmt);
+  int rs = SQLITE_ROW;
+  int i;
+
+  if (state == QUERY_STATE_BUFFERED)
+    return 0;
+
+  _sqlite_buffer_free(query);
+  QUERY(query)->n_cols = n_cols;
+  QUERY(query)->buf_cells = g_array_new(FALSE, FALSE, sizeof(struct _sqlite_cell));
+  QUERY(query)->buf_data = g_byte_array_new();
+
+  // current row was not returned yet
+  if (state == QUERY_STATE_ROW_READ)
+    rs = sqlite3_step(stmt);
+  else if (state != QUERY_STATE_ROW_PENDING)
+    rs = SQLITE_DONE;
+
+  while (rs == SQLITE_ROW)
+  {
+    for (i = 0; i < n_cols; i++)
+    {
+      struct _sqlite_cell cell;
+      const unsigned char* text;
+
+      cell.i = 0;
+      cell.d = 0;
+      cell.offset = QUERY(query)->buf_data->len;
+      cell.length = -1;
+      if (sqlite3_column_type(stmt, i) != SQLITE_NULL)
+      {
+        // int first, text conversion does not change the integer value
+        cell.i = sqlite3_column_int64(stmt, i);
+        cell.d = sqlite3_column_double(stmt, i);
+        text = sqlite3_column_text(stmt, i);
+        cell.length = sqlite3_column_bytes(stmt, i);
+        g_byte_array_append(QUERY(query)->buf_data, text, cell.length);
+        g_byte_array_append(QUERY(query)->buf_data, (const guint8*)"", 1);
+      }
+      g_array_append_val(QUERY(query)->buf_cells, cell);
+    }
+    QUERY(query)->buf_rows++;
+    rs = sqlite3_step(stmt);
+  }
+
+  if (rs != SQLITE_DONE)
+  {
+    //XXX: set error based on sqlite state
+    gs_set_error(query->conn, GS_ERR_OTHER, sqlite3_errmsg(QUERY(query)->handle));
+    _sqlite_query_unlock(query);
+    return -1;
+  }
+
+  // release locks held by the statement
+  sqlite3_reset(stmt);
+  _sqlite_query_unlock(query);
+
+  QUERY(query)->row_count = QUERY(query)->rows_read + QUERY(query)->buf_rows;
+  QUERY(query)->state = QUERY_STATE_BUFFERED;
+  return 0;
+}
+
+static int _sqlite_buffer_get(gs_query* query, const gs_plan* plan, void** targets)
+{
+  struct _sqlite_cell* row;
+  const char* data = (const char*)QUERY(query)->buf_data->data;
+  int i;
+
+  if (QUERY(query)->buf_pos >= QUERY(query)->buf_rows)
+    return 1;
+
+  if (plan->n_cols > QUERY(query)->n_cols)
+  {
+    gs_set_error(query->conn, GS_ERR_OTHER, "Invalid format string.");
+    return -1;
+  }
+
+  row = &g_array_index(QUERY(query)->buf_cells, struct _sqlite_cell,
+                       QUERY(query)->buf_pos * QUERY(query)->n_cols);
+
+  for (i = 0; i < plan->n_slots; i++)
+  {
+    const struct _sqlite_cell* cell = row + plan->slots[i].col;
+
+    switch (plan->slots[i].type)
+    {
+      case 's':
+      {
+        const char** str_ptr = (const char**)targets[i];
+        *str_ptr = cell->length < 0 ? NULL : data + cell->offset;
+        break;
+      }
+      case 'S':
+      {
+        char** str_ptr = (char**)targets[i];
+        *str_ptr = cell->length < 0 ? NULL : g_strndup(data + cell->offset, cell->length);
+        break;
+      }
+      case 'i':
+      {
+        int* int_ptr = (int*)targets[i];
+        *int_ptr = (int)cell->i;
+        break;
+      }
+      case 'l':
+      {
+        gint64* int_ptr = (gint64*)targets[i];
+        *int_ptr = cell->i;
+        break;
+      }
+      case 'd':
+      {
+        double* double_ptr = (double*)targets[i];
+        *double_ptr = cell->d;
+        break;
+      }
+      case 'b':
+      {
+        gboolean* bool_ptr = (gboolean*)targets[i];
+        *bool_ptr = cell->i != 0;
+        break;
+      }
+      case 't':
+      {
+        gint64* time_ptr = (gint64*)targets[i];
+        // integer text never parses as timestamp
+        if (cell->length < 0 || gs_time_parse(data + cell->offset, time_ptr) < 0)
+          *time_ptr = cell->i;
+        break;
+      }
+      case '?': // null flag
+      {
+        int* int_ptr = (int*)targets[i];
+        *int_ptr = cell->length < 0;
+        break;
+      }
+    }
+  }
+
+  QUERY(query)->buf_pos++;
+  QUERY(query)->rows_read++;
+  return 0;
+}
+
 static void sqlite_gs_query_free(gs_query* query)
 {
+  _sqlite_buffer_free(query);
   if (QUERY(query)->stmt != NULL)
     sqlite3_finalize(QUERY(query)->stmt);
+  _sqlite_query_unlock(query);
   g_free(query->sql);
   g_free(query);
 }
 
-static int sqlite_gs_query_getv(gs_query* query, const char* fmt, va_list ap)
+static int sqlite_gs_query_reset(gs_query* query)
+{
+  // reset is needed even if previous step failed, its return code is not
+  // interesting
+  sqlite3_reset(QUERY(query)->stmt);
+  sqlite3_clear_bindings(QUERY(query)->stmt);
+  _sqlite_query_unlock(query);
+  // do not keep result of cached statement in memory
+  _sqlite_buffer_free(query);
+  QUERY(query)->rows_read = 0;
+  QUERY(query)->state = QUERY_STATE_INIT;
+  return 0;
+}
+
+static int sqlite_gs_query_get_plan(gs_query* query, const gs_plan* plan, void** targets)
 {
   sqlite3_stmt* stmt = QUERY(query)->stmt;
-  int param_count = fmt != NULL ? strlen(fmt) : 0;
   int i, rs;
-  int col = 0;
 
   switch (QUERY(query)->state)
   {
@@ -151,194 +831,300 @@ static int sqlite_gs_query_getv(gs_query* query, const char* fmt, va_list ap)
       return -1;
     case QUERY_STATE_COMPLETED:
       return 1;
+    case QUERY_STATE_BUFFERED:
+      return _sqlite_buffer_get(query, plan, targets);
     case QUERY_STATE_ROW_READ:
       // fetch next row
       rs = sqlite3_step(stmt);
       if (rs == SQLITE_ROW)
+      {
+        QUERY(query)->rows_read++;
         break;
+      }
       else if (rs == SQLITE_DONE)
       {
         QUERY(query)->state = QUERY_STATE_COMPLETED;
+        _sqlite_query_unlock(query);
         return 1;
       }
       else
       {
         //XXX: set error based on sqlite state
-        gs_set_error(query->conn, GS_ERR_OTHER, sqlite3_errmsg(CONN(query->conn)->handle));
+        gs_set_error(query->conn, GS_ERR_OTHER, sqlite3_errmsg(QUERY(query)->handle));
+        _sqlite_query_unlock(query);
         return -1;
       }
     case QUERY_STATE_ROW_PENDING:
       QUERY(query)->state = QUERY_STATE_ROW_READ;
+      QUERY(query)->rows_read++;
       break;
   }
 
-  for (i = 0; i < param_count; i++)
+  for (i = 0; i < plan->n_slots; i++)
   {
-    if (fmt[i] == 's')
-    {
-      char** str_ptr = (char**)va_arg(ap, char**);
-      *str_ptr = (char*)sqlite3_column_text(stmt, col);
-      col++;
-    }
-    else if (fmt[i] == 'S')
-    {
-      char** str_ptr = (char**)va_arg(ap, char**);
-      *str_ptr = g_strdup((char*)sqlite3_column_text(stmt, col));
-      col++;
-    }
-    else if (fmt[i] == 'i')
-    {
-      int* int_ptr = (int*)va_arg(ap, int*);
-      *int_ptr = sqlite3_column_int(stmt, col);
-      col++;
-    }
-    else if (fmt[i] == '?') // null flag
-    {
-      int* int_ptr = (int*)va_arg(ap, int*);
-      //*int_ptr = sqlite3_value_type(sqlite3_column_value(stmt, col)) == SQLITE_NULL; //original, non thread-save usage
-      *int_ptr = sqlite3_column_type(stmt, col) == SQLITE_NULL;
-    }
-    else
+    int col = plan->slots[i].col;
+
+    switch (plan->slots[i].type)
     {
-      gs_set_error(query->conn, GS_ERR_OTHER, "Invalid format string.");
-      va_end(ap);
-      return -1;
+      case 's':
+      {
+        char** str_ptr = (char**)targets[i];
+        *str_ptr = (char*)sqlite3_column_text(stmt, col);
+        break;
+      }
+      case 'S':
+      {
+        char** str_ptr = (char**)targets[i];
+        *str_ptr = g_strdup((char*)sqlite3_column_text(stmt, col));
+        break;
+      }
+      case 'i':
+      {
+        int* int_ptr = (int*)targets[i];
+        *int_ptr = sqlite3_column_int(stmt, col);
+        break;
+      }
+      case 'l':
+      {
+        gint64* int_ptr = (gint64*)targets[i];
+        *int_ptr = sqlite3_column_int64(stmt, col);
+        break;
+      }
+      case 'd':
+      {
+        double* double_ptr = (double*)targets[i];
+        *double_ptr = sqlite3_column_double(stmt, col);
+        break;
+      }
+      case 'b':
+      {
+        gboolean* bool_ptr = (gboolean*)targets[i];
+        *bool_ptr = sqlite3_column_int64(stmt, col) != 0;
+        break;
+      }
+      case 't':
+      {
+        gint64* time_ptr = (gint64*)targets[i];
+        // 't' is stored as integer, but text timestamps are accepted too
+        if (sqlite3_column_type(stmt, col) != SQLITE_TEXT ||
+            gs_time_parse((const char*)sqlite3_column_text(stmt, col), time_ptr) < 0)
+          *time_ptr = sqlite3_column_int64(stmt, col);
+        break;
+      }
+      case '?': // null flag
+      {
+        int* int_ptr = (int*)targets[i];
+        *int_ptr = sqlite3_column_type(stmt, col) == SQLITE_NULL;
+        break;
+      }
     }
   }
 
   return 0;
 }
 
-static int sqlite_gs_query_putv(gs_query* query, const char* fmt, va_list ap)
+static int sqlite_gs_query_put_params(gs_query* query, const gs_param* params, int count)
 {
-  sqlite3_stmt* stmt = QUERY(query)->stmt;
-  int param_count = (fmt != NULL) ? strlen(fmt) : 0;
+  sqlite3_stmt* stmt;
   int i, rs;
-  int col = 1;
-
-  if (QUERY(query)->state != QUERY_STATE_INIT)
-  {
-    if (sqlite3_reset(stmt) != SQLITE_OK)
-    {
-      gs_set_error(query->conn, GS_ERR_OTHER, sqlite3_errmsg(CONN(query->conn)->handle));
-      return -1;
-    }
-  }
 
-  for (i = 0; i < param_count; i++)
+  if (CONN(query->conn)->writer)
   {
-    int is_null = 0;
+    gboolean on_writer = _sqlite_query_on_writer(query);
 
-    if (fmt[i] == '?')
+    // cached statement moves between reader and writer with the transaction
+    if (on_writer != (QUERY(query)->handle == CONN(query->conn)->writer->handle))
     {
-      is_null = (int)va_arg(ap, int);
-      if (is_null)
-        sqlite3_bind_null(stmt, col);
-      i++;
-    }
-
-    if (fmt[i] == 's')
-    {
-      char* value = (char*)va_arg(ap, char*);
-      if (!is_null)
-      {
-        if (value == NULL)
-          sqlite3_bind_null(stmt, col);
-        else
-          sqlite3_bind_text(stmt, col, value, -1, SQLITE_TRANSIENT);
-      }
-      col++;
+      _sqlite_query_unlock(query);
+      if (_sqlite_query_prepare(query, on_writer) < 0)
+        return -1;
     }
-    else if (fmt[i] == 'i')
+    if (on_writer && !QUERY(query)->writer_locked)
     {
-      int value = (int)va_arg(ap, int);
-      if (!is_null)
-        sqlite3_bind_int(stmt, col, value);
-      col++;
+      if (_sqlite_writer_lock(query->conn) < 0)
+        return -1;
+      QUERY(query)->writer_locked = TRUE;
     }
-    else
+  }
+
+  stmt = QUERY(query)->stmt;
+  if (QUERY(query)->state != QUERY_STATE_INIT)
+  {
+    if (sqlite3_reset(stmt) != SQLITE_OK)
     {
-      gs_set_error(query->conn, GS_ERR_OTHER, "Invalid format string.");
+      gs_set_error(query->conn, GS_ERR_OTHER, sqlite3_errmsg(QUERY(query)->handle));
+      _sqlite_query_unlock(query);
       return -1;
     }
   }
+  QUERY(query)->buf_rows = 0;
+  QUERY(query)->buf_pos = 0;
+  QUERY(query)->rows_read = 0;
+  QUERY(query)->row_count = -1;
+
+  for (i = 0; i < count; i++)
+  {
+    if (params[i].is_null)
+      sqlite3_bind_null(stmt, i + 1);
+    else if (params[i].type == 's')
+      sqlite3_bind_text(stmt, i + 1, params[i].value.s, -1, SQLITE_TRANSIENT);
+    else if (params[i].type == 'i' || params[i].type == 'b')
+      sqlite3_bind_int(stmt, i + 1, params[i].value.i);
+    else if (params[i].type == 'l' || params[i].type == 't')
+      sqlite3_bind_int64(stmt, i + 1, params[i].value.l);
+    else if (params[i].type == 'd')
+      sqlite3_bind_double(stmt, i + 1, params[i].value.d);
+  }
 
   rs = sqlite3_step(stmt);
   if (rs == SQLITE_DONE)
+  {
+    // autocommit write is committed when statement finishes
     QUERY(query)->state = QUERY_STATE_COMPLETED;
+    _sqlite_query_unlock(query);
+  }
   else if (rs == SQLITE_ROW)
     QUERY(query)->state = QUERY_STATE_ROW_PENDING;
   else
   {
     //XXX: set error based on sqlite state
-    gs_set_error(query->conn, GS_ERR_OTHER, sqlite3_errmsg(CONN(query->conn)->handle));
+    gs_set_error(query->conn, GS_ERR_OTHER, sqlite3_errmsg(QUERY(query)->handle));
+    _sqlite_query_unlock(query);
     return -1;
   }
 
+  if (query->result_mode == GS_RESULT_BUFFERED)
+    return _sqlite_buffer_rows(query);
+
   return 0;
 }
 
-static int sqlite_gs_query_get_rows(gs_query* query)
+static int sqlite_gs_query_set_result_mode(gs_query* query G_GNUC_UNUSED, int mode)
 {
-  int rs;
-  int count = 0;
-  sqlite3_stmt* stmt = QUERY(query)->stmt;
+  // statements are stepped row by row, result is buffered on put or when
+  // row count is requested
+  if (mode != GS_RESULT_DEFAULT && mode != GS_RESULT_STREAMING && mode != GS_RESULT_BUFFERED)
+    return -1;
+  return 0;
+}
 
+static int sqlite_gs_query_get_rows(gs_query* query)
+{
   if (QUERY(query)->state == QUERY_STATE_INIT)
   {
     gs_set_error(query->conn, GS_ERR_OTHER, "Invalid API use, call gs_query_put() before gs_query_get_rows().");
     return -1;
   }
 
-  if (sqlite3_reset(stmt) != SQLITE_OK)
-  {
-    gs_set_error(query->conn, GS_ERR_OTHER, sqlite3_errmsg(CONN(query->conn)->handle));
+  // counting would read the whole result
+  if (query->result_mode == GS_RESULT_STREAMING)
+    return GS_ROWS_UNKNOWN;
+
+  if (_sqlite_buffer_rows(query) < 0)
     return -1;
-  }
 
-  while (TRUE)
+  return QUERY(query)->row_count;
+}
+
+static int sqlite_gs_query_get_columns(gs_query* query)
+{
+  return sqlite3_column_count(QUERY(query)->stmt);
+}
+
+static gint64 sqlite_gs_query_get_last_id(gs_query* query, const char* seq_name)
+{
+  // writer is shared in single writer mode, ID is only reliable inside
+  // transaction
+  return sqlite3_last_insert_rowid(QUERY(query)->handle);
+}
+
+/* snapshots */
+
+struct _gs_snapshot_sqlite
+{
+  gs_snapshot base;
+  sqlite3* file;
+  sqlite3* dest;            // file or connection database
+  sqlite3_backup* backup;
+  int writer_locked;
+  int busy_ms;              // time spent waiting for locks
+};
+
+#define SNAPSHOT(s) ((struct _gs_snapshot_sqlite*)(s))
+
+static void sqlite_gs_snapshot_free(gs_snapshot* snapshot)
+{
+  if (SNAPSHOT(snapshot)->backup)
+    sqlite3_backup_finish(SNAPSHOT(snapshot)->backup);
+  sqlite3_close(SNAPSHOT(snapshot)->file);
+  if (SNAPSHOT(snapshot)->writer_locked)
+    _sqlite_writer_unlock(snapshot->conn);
+  g_free(snapshot);
+}
+
+static gs_snapshot* sqlite_gs_snapshot_new(gs_conn* conn, const char* path, int save)
+{
+  struct _gs_snapshot_sqlite* snapshot;
+  sqlite3* db = CONN(conn)->handle;
+  int flags = save ? SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE : SQLITE_OPEN_READONLY;
+
+  snapshot = g_new0(struct _gs_snapshot_sqlite, 1);
+  snapshot->base.conn = conn;
+
+  if (sqlite3_open_v2(path, &snapshot->file, flags, NULL) != SQLITE_OK)
   {
-    rs = sqlite3_step(stmt);
-    if (rs == SQLITE_DONE)
-      break;
-    else if (rs == SQLITE_ROW)
-      count++;
-    else
-    {
-      //XXX: set error based on sqlite state
-      gs_set_error(query->conn, GS_ERR_OTHER, sqlite3_errmsg(CONN(query->conn)->handle));
-      return -1;
-    }
+    gs_set_error(conn, GS_ERR_OTHER, sqlite3_errmsg(snapshot->file));
+    sqlite_gs_snapshot_free((gs_snapshot*)snapshot);
+    return NULL;
   }
 
-  if (sqlite3_reset(stmt) != SQLITE_OK)
+  // save reads committed data through the reader, load replaces the
+  // database through the writer
+  if (!save && CONN(conn)->writer)
   {
-    gs_set_error(query->conn, GS_ERR_OTHER, sqlite3_errmsg(CONN(query->conn)->handle));
-    return -1;
+    if (_sqlite_writer_lock(conn) < 0)
+    {
+      sqlite_gs_snapshot_free((gs_snapshot*)snapshot);
+      return NULL;
+    }
+    snapshot->writer_locked = TRUE;
+    db = CONN(conn)->writer->handle;
   }
 
-  rs = sqlite3_step(stmt);
-  if (rs == SQLITE_ROW)
-    QUERY(query)->state = QUERY_STATE_ROW_PENDING;
-  else if (rs == SQLITE_DONE)
-    QUERY(query)->state = QUERY_STATE_COMPLETED;
+  snapshot->dest = save ? snapshot->file : db;
+  if (save)
+    snapshot->backup = sqlite3_backup_init(snapshot->file, "main", db, "main");
   else
+    snapshot->backup = sqlite3_backup_init(db, "main", snapshot->file, "main");
+  if (snapshot->backup == NULL)
   {
-    //XXX: set error based on sqlite state
-    gs_set_error(query->conn, GS_ERR_OTHER, sqlite3_errmsg(CONN(query->conn)->handle));
-    return -1;
+    gs_set_error(conn, GS_ERR_OTHER, sqlite3_errmsg(snapshot->dest));
+    sqlite_gs_snapshot_free((gs_snapshot*)snapshot);
+    return NULL;
   }
 
-  return count;
+  return (gs_snapshot*)snapshot;
 }
 
-static int sqlite_gs_query_get_last_id(gs_query* query, const char* seq_name)
+static int sqlite_gs_snapshot_step(gs_snapshot* snapshot, int pages)
 {
-  int id;
+  int rs = sqlite3_backup_step(SNAPSHOT(snapshot)->backup, pages);
+
+  if (rs == SQLITE_DONE)
+    return 1;
+  if (rs == SQLITE_OK)
+    return 0;
 
-  id = sqlite3_last_insert_rowid(CONN(query->conn)->handle);
+  // locked by another connection, wait like busy handler would
+  if ((rs == SQLITE_BUSY || rs == SQLITE_LOCKED) && SNAPSHOT(snapshot)->busy_ms < SQLITE_DEFAULT_BUSY_TIMEOUT)
+  {
+    sqlite3_sleep(10);
+    SNAPSHOT(snapshot)->busy_ms += 10;
+    return 0;
+  }
 
-  return id;
+  gs_set_error(snapshot->conn, GS_ERR_OTHER, sqlite3_errstr(rs));
+  return -1;
 }
 
 gs_driver sqlite_driver =
@@ -346,13 +1132,22 @@ gs_driver sqlite_driver =
   .name = "sqlite",
   .connect = sqlite_gs_connect,
   .disconnect = sqlite_gs_disconnect,
+  .is_alive = sqlite_gs_is_alive,
   .begin = sqlite_gs_begin,
   .commit = sqlite_gs_commit,
   .rollback = sqlite_gs_rollback,
   .query_new = sqlite_gs_query_new,
   .query_free = sqlite_gs_query_free,
-  .query_getv = sqlite_gs_query_getv,
-  .query_putv = sqlite_gs_query_putv,
+  .query_reset = sqlite_gs_query_reset,
+  .query_get_plan = sqlite_gs_query_get_plan,
+  .query_put_params = sqlite_gs_query_put_params,
+  .query_set_result_mode = sqlite_gs_query_set_result_mode,
   .query_get_rows = sqlite_gs_query_get_rows,
+  .query_get_columns = sqlite_gs_query_get_columns,
   .query_get_last_id = sqlite_gs_query_get_last_id,
+  .snapshot_new = sqlite_gs_snapshot_new,
+  .snapshot_step = sqlite_gs_snapshot_step,
+  .snapshot_free = sqlite_gs_snapshot_free,
+  .explain_prefix = "EXPLAIN QUERY PLAN ",
+  .explain_fmt = "iiis",  // id, parent, notused, detail
 };
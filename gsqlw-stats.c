@@ -0,0 +1,461 @@
+/*
+ * Glib sql wrapper.
+ *
+ * Copyright (C) 2008-2010 Zonio s.r.o <developers@zonio.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <config.h>
+
+#include "gsqlw-priv.h"
+
+/* Statistics are collected into per-thread shards, so that recording never
+ * waits for other threads. Shard lock is only contended when statistics are
+ * read or reset, readers merge all shards.
+ */
+
+/* Counters of one statement of one connection. */
+struct _gs_stats_entry
+{
+  guint conn_id;            // 0 for connections that were disconnected
+  gs_stats stats;           // stats.sql is owned by the entry
+};
+
+struct _gs_stats_shard
+{
+  GMutex lock;
+  GHashTable* entries;      // gs_stats_entry -> itself
+  guint generation;         // changed when entries are removed
+};
+
+static void _stats_shard_retire(gpointer data);
+
+static GMutex stats_lock;   // guards stats_shards
+static GSList* stats_shards;
+static gs_stats_shard stats_retired; // entries of finished threads
+static GPrivate stats_shard_key = G_PRIVATE_INIT(_stats_shard_retire);
+static int stats_last_conn_id;
+static int stats_last_generation;  // generations are unique across shards
+static int stats_default_enabled;
+
+static guint _stats_entry_hash(gconstpointer key)
+{
+  const gs_stats_entry* entry = key;
+
+  return g_str_hash(entry->stats.sql) ^ entry->conn_id;
+}
+
+static gboolean _stats_entry_equal(gconstpointer a, gconstpointer b)
+{
+  const gs_stats_entry* x = a;
+  const gs_stats_entry* y = b;
+
+  return x->conn_id == y->conn_id && !strcmp(x->stats.sql, y->stats.sql);
+}
+
+static void _stats_entry_free(gpointer data)
+{
+  gs_stats_entry* entry = data;
+
+  g_free(entry->stats.sql);
+  g_free(entry);
+}
+
+static void _stats_shard_init(gs_stats_shard* shard)
+{
+  g_mutex_init(&shard->lock);
+  shard->entries = g_hash_table_new_full(_stats_entry_hash, _stats_entry_equal, _stats_entry_free, NULL);
+  shard->generation = g_atomic_int_add(&stats_last_generation, 1) + 1;
+}
+
+/* Invalidate entries cached by gs_stats_ref. */
+static void _stats_shard_changed(gs_stats_shard* shard)
+{
+  shard->generation = g_atomic_int_add(&stats_last_generation, 1) + 1;
+}
+
+/* Lookup entry of the shard, create it if it does not exist yet. Must be
+ * called with shard->lock held.
+ */
+static gs_stats_entry* _stats_shard_entry(gs_stats_shard* shard, guint conn_id, const char* sql)
+{
+  gs_stats_entry key, *entry;
+
+  key.conn_id = conn_id;
+  key.stats.sql = (char*)sql;
+  entry = g_hash_table_lookup(shard->entries, &key);
+  if (entry == NULL)
+  {
+    entry = g_new0(gs_stats_entry, 1);
+    entry->conn_id = conn_id;
+    entry->stats.sql = g_strdup(sql);
+    g_hash_table_add(shard->entries, entry);
+  }
+
+  return entry;
+}
+
+static void _stats_add(gs_stats* dst, const gs_stats* src)
+{
+  int i, j;
+
+  dst->calls += src->calls;
+  dst->rows += src->rows;
+  for (i = 0; i < GS_STATS_ERRORS; i++)
+    dst->errors[i] += src->errors[i];
+  for (i = 0; i < GS_STATS_PHASES; i++)
+  {
+    dst->count[i] += src->count[i];
+    dst->total_usec[i] += src->total_usec[i];
+    dst->max_usec[i] = MAX(dst->max_usec[i], src->max_usec[i]);
+    for (j = 0; j < GS_STATS_BUCKETS; j++)
+      dst->histogram[i][j] += src->histogram[i][j];
+  }
+}
+
+/* Move entries of the connection (all entries if conn_id is 0) of src to dst,
+ * detached entries are merged into totals of disconnected connections. Must
+ * be called with both locks held.
+ */
+static void _stats_shard_move(gs_stats_shard* src, gs_stats_shard* dst, guint conn_id, gboolean detach)
+{
+  GHashTableIter iter;
+  gs_stats_entry* entry;
+  GSList* moved = NULL, *l;
+
+  g_hash_table_iter_init(&iter, src->entries);
+  while (g_hash_table_iter_next(&iter, (gpointer*)&entry, NULL))
+  {
+    if (conn_id != 0 && entry->conn_id != conn_id)
+      continue;
+    g_hash_table_iter_steal(&iter);
+    moved = g_slist_prepend(moved, entry);
+  }
+
+  // entries are added only after iteration, src and dst may be the same
+  for (l = moved; l; l = l->next)
+  {
+    entry = l->data;
+    _stats_add(&_stats_shard_entry(dst, detach ? 0 : entry->conn_id, entry->stats.sql)->stats, &entry->stats);
+    _stats_entry_free(entry);
+  }
+  g_slist_free(moved);
+
+  if (moved)
+    _stats_shard_changed(src);
+}
+
+static void _stats_shard_retire(gpointer data)
+{
+  gs_stats_shard* shard = data;
+
+  g_mutex_lock(&stats_lock);
+  stats_shards = g_slist_remove(stats_shards, shard);
+  g_mutex_lock(&stats_retired.lock);
+  g_mutex_lock(&shard->lock);
+  _stats_shard_move(shard, &stats_retired, 0, FALSE);
+  g_mutex_unlock(&shard->lock);
+  g_mutex_unlock(&stats_retired.lock);
+  g_mutex_unlock(&stats_lock);
+
+  g_hash_table_destroy(shard->entries);
+  g_mutex_clear(&shard->lock);
+  g_free(shard);
+}
+
+static gs_stats_shard* _stats_thread_shard(void)
+{
+  gs_stats_shard* shard = g_private_get(&stats_shard_key);
+
+  if (shard)
+    return shard;
+
+  shard = g_new0(gs_stats_shard, 1);
+  _stats_shard_init(shard);
+  g_private_set(&stats_shard_key, shard);
+
+  g_mutex_lock(&stats_lock);
+  if (stats_retired.entries == NULL)
+    _stats_shard_init(&stats_retired);
+  stats_shards = g_slist_prepend(stats_shards, shard);
+  g_mutex_unlock(&stats_lock);
+
+  return shard;
+}
+
+/* normalization */
+
+#define SQL_IDENT_CHAR(c) \
+  (g_ascii_isalnum(c) || (c) == '_' || (c) == '$')
+
+/* Collapse whitespace, strip comments and replace literals with '?', so that
+ * statements differing only in constants are counted together.
+ */
+char* gs_stats_normalize(const char* sql)
+{
+  GString* str = g_string_sized_new(sql ? strlen(sql) : 0);
+  const char* p = sql;
+
+  while (p && *p)
+  {
+    char last = str->len > 0 ? str->str[str->len - 1] : ' ';
+
+    if (g_ascii_isspace(*p) || (p[0] == '-' && p[1] == '-') || (p[0] == '/' && p[1] == '*'))
+    {
+      if (g_ascii_isspace(*p))
+        p++;
+      else if (*p == '-')
+        p += strcspn(p, "\n");
+      else
+      {
+        const char* end = strstr(p + 2, "*/");
+        p = end ? end + 2 : p + strlen(p);
+      }
+      if (last != ' ')
+        g_string_append_c(str, ' ');
+    }
+    else if (*p == '\'')
+    {
+      // '' is an escaped quote, so it just starts next part of the literal
+      while (*p == '\'')
+      {
+        const char* end = strchr(p + 1, '\'');
+        p = end ? end + 1 : p + strlen(p);
+      }
+      g_string_append_c(str, '?');
+    }
+    else if (g_ascii_isdigit(*p) && !SQL_IDENT_CHAR(last))
+    {
+      while (g_ascii_isalnum(*p) || *p == '.')
+        p++;
+      g_string_append_c(str, '?');
+    }
+    else
+      g_string_append_c(str, *p++);
+  }
+
+  if (str->len > 0 && str->str[str->len - 1] == ' ')
+    g_string_truncate(str, str->len - 1);
+
+  return g_string_free(str, FALSE);
+}
+
+/* recording */
+
+void gs_stats_conn_open(gs_conn* conn)
+{
+  conn->stats_id = g_atomic_int_add(&stats_last_conn_id, 1) + 1;
+  conn->stats_enabled = g_atomic_int_get(&stats_default_enabled);
+  conn->stats_used = conn->stats_enabled;
+}
+
+/* Counters of the closed connection are kept only in process-wide totals. */
+void gs_stats_conn_close(gs_conn* conn)
+{
+  GSList* l;
+
+  // connection has no entries to retire
+  if (!conn->stats_used)
+    return;
+
+  g_mutex_lock(&stats_lock);
+  for (l = stats_shards; l; l = l->next)
+  {
+    gs_stats_shard* shard = l->data;
+
+    g_mutex_lock(&shard->lock);
+    _stats_shard_move(shard, shard, conn->stats_id, TRUE);
+    g_mutex_unlock(&shard->lock);
+  }
+  if (stats_retired.entries)
+  {
+    g_mutex_lock(&stats_retired.lock);
+    _stats_shard_move(&stats_retired, &stats_retired, conn->stats_id, TRUE);
+    g_mutex_unlock(&stats_retired.lock);
+  }
+  g_mutex_unlock(&stats_lock);
+}
+
+void gs_stats_record(gs_conn* conn, gs_stats_ref* ref, int phase, gint64 start, int failed, int rows)
+{
+  guint64 usec = MAX(g_get_monotonic_time() - start, 0);
+  gs_stats_shard* shard;
+  gs_stats_entry* entry;
+  gs_stats* stats;
+  int code;
+
+  if (ref->sql == NULL)
+    return;
+  shard = _stats_thread_shard();
+
+  code = failed ? gs_get_errcode(conn) : GS_ERR_NONE;
+  if (failed && (code <= GS_ERR_NONE || code >= GS_STATS_ERRORS))
+    code = GS_ERR_OTHER;
+
+  g_mutex_lock(&shard->lock);
+  if (ref->shard == shard && ref->generation == shard->generation)
+    entry = ref->entry;
+  else
+  {
+    entry = _stats_shard_entry(shard, conn->stats_id, ref->sql);
+    ref->shard = shard;
+    ref->generation = shard->generation;
+    ref->entry = entry;
+  }
+
+  stats = &entry->stats;
+  if (phase == GS_STATS_EXECUTE)
+    stats->calls++;
+  stats->rows += rows;
+  if (code != GS_ERR_NONE)
+    stats->errors[code]++;
+  stats->count[phase]++;
+  stats->total_usec[phase] += usec;
+  stats->max_usec[phase] = MAX(stats->max_usec[phase], usec);
+  // g_bit_storage(0) is 1, bucket 0 is for calls under 1us
+  stats->histogram[phase][usec == 0 ? 0 : MIN(g_bit_storage(usec), GS_STATS_BUCKETS - 1)]++;
+  g_mutex_unlock(&shard->lock);
+}
+
+/* public API */
+
+void gs_set_stats_enabled(gs_conn* conn, gboolean enabled)
+{
+  if (conn == NULL)
+    g_atomic_int_set(&stats_default_enabled, enabled != FALSE);
+  else
+  {
+    conn->stats_enabled = enabled != FALSE;
+    conn->stats_used = conn->stats_used || conn->stats_enabled;
+  }
+}
+
+/* Add entries of the shard matching conn_id (any if 0) to merged. */
+static void _stats_shard_collect(gs_stats_shard* shard, guint conn_id, GHashTable* merged)
+{
+  GHashTableIter iter;
+  gs_stats_entry* entry;
+
+  g_mutex_lock(&shard->lock);
+  g_hash_table_iter_init(&iter, shard->entries);
+  while (g_hash_table_iter_next(&iter, (gpointer*)&entry, NULL))
+  {
+    gs_stats* stats;
+
+    if (conn_id != 0 && entry->conn_id != conn_id)
+      continue;
+    stats = g_hash_table_lookup(merged, entry->stats.sql);
+    if (stats == NULL)
+    {
+      stats = g_new0(gs_stats, 1);
+      stats->sql = g_strdup(entry->stats.sql);
+      g_hash_table_insert(merged, stats->sql, stats);
+    }
+    _stats_add(stats, &entry->stats);
+  }
+  g_mutex_unlock(&shard->lock);
+}
+
+static guint64 _stats_total_usec(const gs_stats* stats)
+{
+  guint64 total = 0;
+  int i;
+
+  for (i = 0; i < GS_STATS_PHASES; i++)
+    total += stats->total_usec[i];
+  return total;
+}
+
+static int _stats_compare(const void* a, const void* b)
+{
+  guint64 x = _stats_total_usec(a);
+  guint64 y = _stats_total_usec(b);
+
+  if (x != y)
+    return x > y ? -1 : 1;
+  return strcmp(((const gs_stats*)a)->sql, ((const gs_stats*)b)->sql);
+}
+
+gs_stats* gs_get_stats(gs_conn* conn, int* n_stats)
+{
+  GHashTable* merged = g_hash_table_new(g_str_hash, g_str_equal);
+  GHashTableIter iter;
+  gs_stats* stats, *result;
+  GSList* l;
+  int n = 0;
+
+  g_mutex_lock(&stats_lock);
+  for (l = stats_shards; l; l = l->next)
+    _stats_shard_collect(l->data, conn ? conn->stats_id : 0, merged);
+  if (stats_retired.entries)
+    _stats_shard_collect(&stats_retired, conn ? conn->stats_id : 0, merged);
+  g_mutex_unlock(&stats_lock);
+
+  result = g_new(gs_stats, g_hash_table_size(merged) + 1);
+  g_hash_table_iter_init(&iter, merged);
+  while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&stats))
+  {
+    result[n++] = *stats;
+    g_free(stats);
+  }
+  g_hash_table_destroy(merged);
+
+  qsort(result, n, sizeof(gs_stats), _stats_compare);
+  if (n_stats)
+    *n_stats = n;
+  return result;
+}
+
+/* Remove entries of the connection, or all entries if conn_id is 0. */
+static void _stats_shard_reset(gs_stats_shard* shard, guint conn_id)
+{
+  GHashTableIter iter;
+  gs_stats_entry* entry;
+
+  g_mutex_lock(&shard->lock);
+  g_hash_table_iter_init(&iter, shard->entries);
+  while (g_hash_table_iter_next(&iter, (gpointer*)&entry, NULL))
+    if (conn_id == 0 || entry->conn_id == conn_id)
+      g_hash_table_iter_remove(&iter);
+  _stats_shard_changed(shard);
+  g_mutex_unlock(&shard->lock);
+}
+
+void gs_reset_stats(gs_conn* conn)
+{
+  GSList* l;
+
+  g_mutex_lock(&stats_lock);
+  for (l = stats_shards; l; l = l->next)
+    _stats_shard_reset(l->data, conn ? conn->stats_id : 0);
+  if (stats_retired.entries)
+    _stats_shard_reset(&stats_retired, conn ? conn->stats_id : 0);
+  g_mutex_unlock(&stats_lock);
+}
+
+void gs_stats_free(gs_stats* stats, int n_stats)
+{
+  int i;
+
+  if (stats == NULL)
+    return;
+  for (i = 0; i < n_stats; i++)
+    g_free(stats[i].sql);
+  g_free(stats);
+}
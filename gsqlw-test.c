@@ -19,6 +19,7 @@
 */
 
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <config.h>
@@ -128,6 +129,722 @@ static void test7(void)
     gs_exec(c, "INSERT INTO test2 (id, name1, name2) VALUES ($2, $1, $1)", "si", "hola", 3);
 }
 
+/** gs_pool: checkout/checkin
+ */
+static void test8(void)
+{
+  gs_pool* pool = gs_pool_new(DSN, 1, 2);
+  gs_conn* pc1 = gs_pool_get(pool, 0);
+  gs_conn* pc2 = gs_pool_get(pool, 0);
+  gs_conn* failed = pc1;
+
+  if (gs_pool_get(pool, 10) != NULL)
+    g_print("ASSERT FAILED: pool should be exhausted\n");
+
+  gs_begin(pc1);
+  gs_exec(pc1, "SELECT nonsense FROM nowhere", NULL);
+  gs_pool_put(pool, pc2);
+  gs_pool_put(pool, pc1);
+
+  // connection of the failed transaction is reset, not reconnected
+  pc1 = gs_pool_get(pool, 0);
+  if (pc1 == NULL || gs_get_errcode(pc1) != GS_ERR_NONE)
+    g_print("ASSERT FAILED: pool should return clean connection\n");
+  if (pc1 != failed)
+    g_print("ASSERT FAILED: pool should reuse connection after failed transaction\n");
+  gs_pool_put(pool, pc1);
+
+  gs_pool_free(pool);
+}
+
+/** prepared statement cache
+ */
+static void test9(void)
+{
+  guint64 hits, misses;
+  int i;
+
+  for (i = 0; i < 3; i++)
+    gs_exec(c, "SELECT id FROM test WHERE id = $1", "i", i);
+
+  gs_get_stmt_cache_stats(c, &hits, &misses);
+  if (hits < 2)
+    g_print("ASSERT FAILED: statement should be reused (hits: %d, misses: %d)\n", (int)hits, (int)misses);
+}
+
+/** streaming result mode
+ */
+static void test10(void)
+{
+  int id_val;
+  const char* str_val;
+  int count = 0;
+
+  q = gs_query_new(c, "SELECT id, name FROM test WHERE id > $1");
+  if (gs_query_set_result_mode(q, GS_RESULT_STREAMING) == 0)
+  {
+    gs_query_set_fetch_size(q, 2);
+    gs_query_put(q, "i", 0);
+    if (gs_query_get_rows(q) != GS_ROWS_UNKNOWN)
+      g_print("ASSERT FAILED: streamed query should not know row count\n");
+    while (gs_query_get(q, "is", &id_val, &str_val) == 0)
+      count++;
+    g_print("streamed rows %d\n", count);
+  }
+  gs_query_free(q);
+}
+
+/** statement batch
+ */
+static void test11(void)
+{
+  gs_batch_begin(c);
+  gs_batch_add(c, "INSERT INTO test (id, name) VALUES ($1, $2)", "is", 20, "batch 1");
+  gs_batch_add(c, "INSERT INTO test (id, name) VALUES ($1, $2)", "is", 21, "batch 2");
+  if (gs_batch_flush(c) < 0)
+    g_print("ERROR: %s\n", gs_get_errmsg(c));
+
+  gs_exec(c, "CREATE TABLE bt (id INT UNIQUE)", NULL);
+  gs_batch_begin(c);
+  gs_batch_add(c, "INSERT INTO bt (id) VALUES ($1)", "i", 1);
+  gs_batch_add(c, "INSERT INTO bt (id) VALUES ($1)", "i", 1);
+  gs_batch_add(c, "INSERT INTO bt (id) VALUES ($1)", "i", 2);
+  if (gs_batch_flush(c) == 0 || gs_batch_get_error_index(c) != 1)
+    g_print("ASSERT FAILED: second statement should fail (%d:%s)\n", gs_batch_get_error_index(c), gs_get_errmsg(c));
+}
+
+/** bulk load
+ */
+static void test12(void)
+{
+  gs_copy* cp;
+  int i, count = 0;
+
+  cp = gs_copy_in_new(c, "test", "id, name");
+  for (i = 100; i < 200; i++)
+    gs_copy_put(cp, "i?s", i, i % 10 == 0, "copied\ttext");
+  if (gs_copy_finish(cp) < 0)
+    g_print("ERROR: %s\n", gs_get_errmsg(c));
+
+  q = gs_query_new(c, "SELECT COUNT(*) FROM test WHERE id >= $1");
+  gs_query_put(q, "i", 100);
+  gs_query_get(q, "i", &count);
+  if (count != 100)
+    g_print("ASSERT FAILED: should load 100 rows (%d)\n", count);
+  gs_query_free(q);
+}
+
+static int copy_out_cb(const char* data G_GNUC_UNUSED, int length, gpointer user_data)
+{
+  *(int*)user_data += length;
+  return 0;
+}
+
+/** bulk export
+ */
+static void test13(void)
+{
+  gs_copy* cp;
+  int id_val, id_null, bytes = 0;
+  const char* str_val;
+
+  cp = gs_copy_out_new(c, "SELECT id, name FROM test ORDER BY id");
+  while (gs_copy_get(cp, "?is", &id_null, &id_val, &str_val) == 0)
+    g_print("  copied row: '%s' %d (%s)\n", str_val, id_val, id_null ? "IS NULL" : "IS NOT NULL");
+  gs_copy_finish(cp);
+
+  if (!strcmp(gs_get_backend(c), "pgsql"))
+  {
+    GOutputStream* stream = g_memory_output_stream_new(NULL, 0, g_realloc, g_free);
+
+    if (gs_copy_out(c, "SELECT id, name FROM test", copy_out_cb, &bytes) < 0)
+      g_print("ERROR: %s\n", gs_get_errmsg(c));
+    g_print("copied %d bytes\n", bytes);
+
+    if (gs_copy_out_stream(c, "SELECT id, name FROM test", stream, NULL) < 0)
+      g_print("ERROR: %s\n", gs_get_errmsg(c));
+    if (g_memory_output_stream_get_data_size(G_MEMORY_OUTPUT_STREAM(stream)) != (gsize)bytes)
+      g_print("ASSERT FAILED: stream got %d bytes, callback %d\n",
+              (int)g_memory_output_stream_get_data_size(G_MEMORY_OUTPUT_STREAM(stream)), bytes);
+    g_object_unref(stream);
+  }
+}
+
+static void put_async_cb(GObject* source G_GNUC_UNUSED, GAsyncResult* result, gpointer user_data)
+{
+  if (gs_query_put_finish(q, result) < 0)
+    g_print("ERROR: %s\n", gs_get_errmsg(c));
+  g_main_loop_quit(user_data);
+}
+
+/** asynchronous query
+ */
+static void test14(void)
+{
+  GMainLoop* loop = g_main_loop_new(NULL, FALSE);
+  int count = 0;
+
+  q = gs_query_new(c, "SELECT COUNT(*) FROM test WHERE id < $1");
+  gs_query_put_async(q, NULL, put_async_cb, loop, "i", 100);
+  g_main_loop_run(loop);
+  gs_query_get(q, "i", &count);
+  g_print("async count %d\n", count);
+  gs_query_free(q);
+  g_main_loop_unref(loop);
+}
+
+/** buffered result mode
+ */
+static void test15(void)
+{
+  int id_val, rows, count = 0;
+  const char* str_val;
+
+  q = gs_query_new(c, "SELECT id, name FROM test WHERE id < $1 ORDER BY id");
+  if (gs_query_set_result_mode(q, GS_RESULT_BUFFERED) == 0)
+  {
+    gs_query_put(q, "i", 100);
+    rows = gs_query_get_rows(q);
+    while (gs_query_get(q, "is", &id_val, &str_val) == 0)
+      count++;
+    if (rows != count || gs_query_get_rows(q) != rows)
+      g_print("ASSERT FAILED: buffered row count %d, read %d\n", rows, count);
+  }
+  gs_query_free(q);
+
+  // rows read before the count was requested are part of it
+  q = gs_query_new(c, "SELECT id FROM test WHERE id < $1 ORDER BY id");
+  gs_query_put(q, "i", 100);
+  for (count = 0; count < 2 && gs_query_get(q, "i", &id_val) == 0; count++)
+    ;
+  rows = gs_query_get_rows(q);
+  while (gs_query_get(q, "i", &id_val) == 0)
+    count++;
+  if (rows != count)
+    g_print("ASSERT FAILED: row count %d after partial read, read %d\n", rows, count);
+  gs_query_free(q);
+}
+
+/** long text values
+ */
+static void test16(void)
+{
+  char* long_val = g_strnfill(5000, 'x');
+  const char* str_val = NULL;
+  char* dup_val = NULL;
+
+  gs_exec(c, "INSERT INTO test (id, name) VALUES ($1, $2)", "is", 300, long_val);
+  q = gs_query_new(c, "SELECT name, name FROM test WHERE id = $1");
+  gs_query_put(q, "i", 300);
+  if (gs_query_get(q, "sS", &str_val, &dup_val) != 0 || str_val == NULL || dup_val == NULL ||
+      strcmp(str_val, long_val) || strcmp(dup_val, long_val))
+    g_print("ASSERT FAILED: long value was not read back\n");
+  g_free(dup_val);
+  gs_query_free(q);
+  g_free(long_val);
+}
+
+/** precompiled format strings
+ */
+static void test17(void)
+{
+  gs_plan* put_plan = gs_plan_new("i?s");
+  gs_plan* get_plan = gs_plan_new("?is");
+  int i, id_val, id_null, count = 0;
+  const char* str_val;
+
+  if (gs_plan_new("?") != NULL || gs_plan_new("ix") != NULL)
+    g_print("ASSERT FAILED: invalid format string accepted\n");
+
+  q = gs_query_new(c, "INSERT INTO test (id, name) VALUES ($1, $2)");
+  for (i = 400; i < 410; i++)
+    gs_query_put_plan(q, put_plan, i, i % 2, "plan");
+  gs_query_free(q);
+
+  q = gs_query_new(c, "SELECT id, name FROM test WHERE id >= $1");
+  gs_query_put(q, "i", 400);
+  while (gs_query_get_plan(q, get_plan, &id_null, &id_val, &str_val) == 0)
+    if (!id_null && id_val >= 400 && (str_val == NULL) == (id_val % 2))
+      count++;
+  if (count != 10)
+    g_print("ASSERT FAILED: should read 10 rows using plan (%d)\n", count);
+  gs_query_free(q);
+
+  gs_plan_free(put_plan);
+  gs_plan_free(get_plan);
+}
+
+/** array execution
+ */
+static void test18(void)
+{
+  int ids[50], status[3], i, count = 0;
+  const char* names[50];
+  guint8 nulls[7] = { 0 };
+  gs_array_column columns[2] = {
+    { 'i', ids, NULL },
+    { 's', names, nulls },
+  };
+  int unique_ids[3] = { 1, 2, 1 };
+  gs_array_column unique_column = { 'i', unique_ids, NULL };
+
+  for (i = 0; i < 50; i++)
+  {
+    ids[i] = 500 + i;
+    names[i] = "array";
+    if (i % 3 == 0)
+      nulls[i / 8] |= 1 << (i % 8);
+  }
+
+  q = gs_query_new(c, "INSERT INTO test (id, name) VALUES ($1, $2)");
+  if (gs_query_put_array(q, columns, 2, 50, NULL) < 0)
+    g_print("ERROR: %s\n", gs_get_errmsg(c));
+  gs_query_free(q);
+
+  q = gs_query_new(c, "SELECT COUNT(*) FROM test WHERE id >= $1 AND name IS NULL");
+  gs_query_put(q, "i", 500);
+  gs_query_get(q, "i", &count);
+  if (count != 17)
+    g_print("ASSERT FAILED: should insert 17 NULL names (%d)\n", count);
+  gs_query_free(q);
+
+  gs_exec(c, "CREATE TABLE at (id INT UNIQUE)", NULL);
+  q = gs_query_new(c, "INSERT INTO at (id) VALUES ($1)");
+  if (gs_query_put_array(q, &unique_column, 1, 3, status) == 0 ||
+      status[0] != GS_ERR_NONE || status[1] != GS_ERR_NONE || status[2] == GS_ERR_NONE)
+    g_print("ASSERT FAILED: third row should fail (%d %d %d)\n", status[0], status[1], status[2]);
+  gs_query_free(q);
+}
+
+/** columnar batch fetch
+ */
+static void test19(void)
+{
+  gint32 ids[7];
+  int offsets[7], lengths[7];
+  guint8 nulls[1];
+  gs_column_buffer columns[2] = {
+    { 'i', ids, NULL, NULL, NULL, NULL },
+    { 's', NULL, offsets, lengths, nulls, NULL },
+  };
+  int i, n, rows = 0, count = -1, bad = 0;
+
+  q = gs_query_new(c, "SELECT id, name FROM test WHERE id >= $1 ORDER BY id");
+  gs_query_put(q, "i", 0);
+  while ((n = gs_query_get_batch(q, columns, 2, 7)) > 0)
+  {
+    for (i = 0; i < n; i++)
+      if (((nulls[0] >> i) & 1) != (lengths[i] < 0) ||
+          (lengths[i] >= 0 && strlen(columns[1].data + offsets[i]) != (size_t)lengths[i]))
+        bad++;
+    rows += n;
+  }
+  if (n < 0)
+    g_print("ERROR: %s\n", gs_get_errmsg(c));
+  gs_query_free(q);
+
+  q = gs_query_new(c, "SELECT COUNT(*) FROM test WHERE id >= $1");
+  gs_query_put(q, "i", 0);
+  gs_query_get(q, "i", &count);
+  if (rows != count || bad)
+    g_print("ASSERT FAILED: batch fetch read %d of %d rows, %d bad\n", rows, count, bad);
+  gs_query_free(q);
+}
+
+/** typed format codes
+ */
+static void test20(void)
+{
+  gint64 id_val = 0, time_val = 0;
+  double score_val = 0;
+  gboolean flag_val = FALSE;
+  int time_null = 0;
+
+  gs_exec(c, "CREATE TABLE typed (id BIGINT, score DOUBLE PRECISION, flag BOOLEAN, created TIMESTAMP NULL)", NULL);
+  gs_exec(c, "INSERT INTO typed (id, score, flag, created) VALUES ($1, $2, $3, $4)", "ldbt",
+          G_GINT64_CONSTANT(5000000000), 0.1, TRUE, G_GINT64_CONSTANT(1700000000000000));
+  gs_exec(c, "INSERT INTO typed (id, score, flag, created) VALUES ($1, $2, $3, $4)", "ldb?t",
+          G_GINT64_CONSTANT(-5000000000), -2.5, FALSE, TRUE, G_GINT64_CONSTANT(0));
+
+  q = gs_query_new(c, "SELECT id, score, flag, created FROM typed WHERE id > $1");
+  gs_query_put(q, "l", G_GINT64_CONSTANT(4000000000));
+  if (gs_query_get(q, "ldbt", &id_val, &score_val, &flag_val, &time_val) != 0 ||
+      id_val != G_GINT64_CONSTANT(5000000000) || score_val != 0.1 || flag_val != TRUE ||
+      time_val != G_GINT64_CONSTANT(1700000000000000))
+    g_print("ASSERT FAILED: typed values were not read back\n");
+  gs_query_free(q);
+
+  q = gs_query_new(c, "SELECT id, score, flag, created FROM typed WHERE id < $1");
+  gs_query_put(q, "l", G_GINT64_CONSTANT(0));
+  if (gs_query_get(q, "ldb?t", &id_val, &score_val, &flag_val, &time_null, &time_val) != 0 ||
+      id_val != G_GINT64_CONSTANT(-5000000000) || score_val != -2.5 || flag_val != FALSE || !time_null)
+    g_print("ASSERT FAILED: negative typed values were not read back\n");
+  gs_query_free(q);
+}
+
+/** connection shared by threads
+ */
+static gpointer shared_conn_thread(gpointer data)
+{
+  int n = GPOINTER_TO_INT(data);
+  int i, failed = 0;
+
+  // errors of one thread must not leak into others
+  if (n == 0)
+  {
+    if (gs_exec(c, "SELECT * FROM no_such_table", NULL) == 0 || gs_get_errcode(c) == GS_ERR_NONE)
+      failed++;
+    gs_clear_error(c);
+  }
+
+  if (gs_begin(c) < 0)
+    failed++;
+  for (i = 0; i < 25; i++)
+    if (gs_exec(c, "INSERT INTO test (id, name) VALUES ($1, $2)", "is", 1000 + n * 100 + i, "thread") < 0)
+      failed++;
+  if (gs_commit(c) < 0)
+    failed++;
+
+  for (i = 25; i < 50; i++)
+    if (gs_exec(c, "INSERT INTO test (id, name) VALUES ($1, $2)", "is", 1000 + n * 100 + i, "thread") < 0)
+      failed++;
+
+  return GINT_TO_POINTER(failed);
+}
+
+static void put_async_failed_cb(GObject* source G_GNUC_UNUSED, GAsyncResult* result, gpointer user_data)
+{
+  // error of the worker thread belongs to the caller
+  if (gs_query_put_finish(q, result) == 0 || gs_get_errmsg(c) == NULL)
+    g_print("ASSERT FAILED: error of asynchronous query was lost\n");
+  gs_clear_error(c);
+  g_main_loop_quit(user_data);
+}
+
+static void test21(void)
+{
+  GThread* threads[4];
+  GMainLoop* loop;
+  int i, failed = 0, count = 0;
+
+  // workers run their own transactions
+  gs_commit(c);
+  if (gs_set_thread_safe(c) < 0)
+  {
+    g_print("ASSERT FAILED: thread-safe mode was not enabled: %s\n", gs_get_errmsg(c));
+    gs_clear_error(c);
+    gs_begin(c);
+    return;
+  }
+
+  for (i = 0; i < 4; i++)
+    threads[i] = g_thread_new("test", shared_conn_thread, GINT_TO_POINTER(i));
+  for (i = 0; i < 4; i++)
+    failed += GPOINTER_TO_INT(g_thread_join(threads[i]));
+
+  q = gs_query_new(c, "SELECT COUNT(*) FROM test WHERE id >= $1 AND name = $2");
+  gs_query_put(q, "is", 1000, "thread");
+  gs_query_get(q, "i", &count);
+  if (failed || count != 200)
+    g_print("ASSERT FAILED: shared connection inserted %d rows, %d failures\n", count, failed);
+  gs_query_free(q);
+
+  gs_exec(c, "CREATE TABLE ts (id INT UNIQUE)", NULL);
+  gs_exec(c, "INSERT INTO ts (id) VALUES (1)", NULL);
+  loop = g_main_loop_new(NULL, FALSE);
+  q = gs_query_new(c, "INSERT INTO ts (id) VALUES ($1)");
+  gs_query_put_async(q, NULL, put_async_failed_cb, loop, "i", 1);
+  g_main_loop_run(loop);
+  gs_query_free(q);
+  g_main_loop_unref(loop);
+
+  gs_begin(c);
+}
+
+/** per-statement statistics
+ */
+static void test22(void)
+{
+  gs_stats* stats;
+  int i, j, n, found = 0, hist = 0, rows = 0;
+
+  gs_set_stats_enabled(c, TRUE);
+  gs_exec(c, "INSERT INTO test (id, name) VALUES (2001, 'stats')", NULL);
+  gs_exec(c, "INSERT  INTO test (id, name)\n  VALUES (2002, 'stats ''2''')", NULL);
+
+  q = gs_query_new(c, "SELECT id FROM test WHERE id > $1");
+  gs_query_put(q, "i", 2000);
+  while (gs_query_get(q, "i", &i) == 0)
+    rows++;
+  gs_query_free(q);
+
+  stats = gs_get_stats(c, &n);
+  for (i = 0; i < n; i++)
+  {
+    if (!strcmp(stats[i].sql, "INSERT INTO test (id, name) VALUES (?, ?)") && stats[i].calls == 2)
+      found++;
+    if (!strcmp(stats[i].sql, "SELECT id FROM test WHERE id > $1") && stats[i].rows == (guint64)rows)
+      found++;
+    for (j = 0; j < GS_STATS_BUCKETS; j++)
+      hist += stats[i].histogram[GS_STATS_EXECUTE][j];
+    hist -= stats[i].count[GS_STATS_EXECUTE];
+  }
+  gs_stats_free(stats, n);
+  if (found != 2 || hist != 0 || rows != 2)
+    g_print("ASSERT FAILED: statistics of %d statements, %d matched\n", n, found);
+
+  gs_reset_stats(c);
+  stats = gs_get_stats(c, &n);
+  if (n != 0)
+    g_print("ASSERT FAILED: %d statistics left after reset\n", n);
+  gs_stats_free(stats, n);
+}
+
+/** slow query handler
+ */
+struct slow_report
+{
+  int count;
+  int with_param;
+  int with_plan;
+  int rows;
+};
+
+static void slow_query_cb(gs_conn* conn G_GNUC_UNUSED, const gs_slow_query* slow, gpointer user_data)
+{
+  struct slow_report* report = user_data;
+
+  if (strcmp(slow->sql, "SELECT id, name FROM test WHERE id < $1") || slow->phase != GS_STATS_EXECUTE)
+    return;
+  report->count++;
+  if (slow->n_params == 1 && slow->params[0] && !strcmp(slow->params[0], "3"))
+    report->with_param++;
+  if (slow->plan && *slow->plan)
+    report->with_plan++;
+  report->rows = slow->rows;
+}
+
+static void test23(void)
+{
+  struct slow_report report = { 0 };
+  int id;
+
+  gs_set_slow_query_handler(c, 0, slow_query_cb, &report);
+  gs_set_slow_query_explain(c, TRUE);
+
+  q = gs_query_new(c, "SELECT id, name FROM test WHERE id < $1");
+  gs_query_put(q, "i", 3);
+  while (gs_query_get(q, "i", &id) == 0)
+    ;
+  gs_query_free(q);
+
+  gs_set_slow_query_handler(c, 0, NULL, NULL);
+  if (report.count != 1 || report.with_param != 1 || report.with_plan != 1 || report.rows < 0)
+    g_print("ASSERT FAILED: slow query reported %d times, %d with parameter, %d with plan\n",
+            report.count, report.with_param, report.with_plan);
+}
+
+/** result cache
+ */
+static void test24(void)
+{
+  gs_result_cache* cache = gs_result_cache_new(1024 * 1024);
+  guint64 hits, misses;
+  int i, count = -1, before = -1;
+  double d = 0;
+  gint64 l = 0;
+  const char* s = NULL;
+
+  // cache is bypassed inside transaction
+  gs_commit(c);
+  gs_set_result_cache(c, cache);
+
+  q = gs_query_new(c, "SELECT COUNT(*) FROM test WHERE id >= $1");
+  gs_query_set_cache_ttl(q, 60000);
+  for (i = 0; i < 3; i++)
+  {
+    gs_query_put(q, "i", 3000);
+    gs_query_get(q, "i", &before);
+  }
+
+  gs_exec(c, "INSERT INTO test (id, name) VALUES (3001, 'cache')", NULL);
+  gs_query_put(q, "i", 3000);
+  gs_query_get(q, "i", &count);
+  gs_query_free(q);
+
+  gs_result_cache_get_stats(cache, &hits, &misses, NULL);
+  if (hits != 2 || misses != 2 || count != before + 1)
+    g_print("ASSERT FAILED: result cache %d hits, %d misses, count %d -> %d\n",
+            (int)hits, (int)misses, before, count);
+
+  // values of the hit are decoded when the result is stored
+  q = gs_query_new(c, "SELECT 2.5, 42, 'cached' FROM test WHERE id = $1");
+  gs_query_set_cache_ttl(q, 60000);
+  for (i = 0; i < 2; i++)
+  {
+    gs_query_put(q, "i", 3001);
+    gs_query_get(q, "dls", &d, &l, &s);
+  }
+  if (d != 2.5 || l != 42 || s == NULL || strcmp(s, "cached") != 0)
+    g_print("ASSERT FAILED: cached values %g, %d, %s\n", d, (int)l, s ? s : "NULL");
+  gs_query_free(q);
+
+  gs_set_result_cache(c, NULL);
+  gs_result_cache_free(cache);
+  gs_begin(c);
+}
+
+/** sqlite DSN options
+ */
+static void test25(void)
+{
+  gs_conn* conn;
+  char* mode = NULL;
+  int cache_size = 0;
+
+  if (strcmp(gs_get_backend(c), "sqlite"))
+    return;
+
+  conn = gs_connect("sqlite:.test-opts.db?journal_mode=wal&synchronous=normal&cache_size=-4096&temp_store=memory&busy_timeout=500");
+  q = gs_query_new(conn, "PRAGMA journal_mode");
+  gs_query_put(q, NULL);
+  gs_query_get(q, "S", &mode);
+  gs_query_free(q);
+  q = gs_query_new(conn, "PRAGMA cache_size");
+  gs_query_put(q, NULL);
+  gs_query_get(q, "i", &cache_size);
+  gs_query_free(q);
+  if (gs_get_errcode(conn) != GS_ERR_NONE || g_strcmp0(mode, "wal") || cache_size != -4096)
+    g_print("ASSERT FAILED: sqlite options gave journal_mode %s, cache_size %d\n", mode, cache_size);
+  g_free(mode);
+  gs_disconnect(conn);
+
+  conn = gs_connect("sqlite:.test-opts.db?journal_mode=wal;DROP TABLE test");
+  if (gs_get_errcode(conn) == GS_ERR_NONE)
+    g_print("ASSERT FAILED: invalid sqlite option accepted\n");
+  gs_disconnect(conn);
+
+  unlink(".test-opts.db");
+  unlink(".test-opts.db-wal");
+  unlink(".test-opts.db-shm");
+}
+
+static gpointer single_writer_insert(gpointer data)
+{
+  return GINT_TO_POINTER(gs_exec(data, "INSERT INTO sw (id) VALUES (2)", NULL) < 0);
+}
+
+static gpointer single_writer_commit(gpointer data)
+{
+  return GINT_TO_POINTER(gs_commit(data) < 0);
+}
+
+/** sqlite single writer
+ */
+static void test26(void)
+{
+  const char* dsn = "sqlite:.test-sw.db?single_writer=on&synchronous=normal";
+  gs_conn* writer;
+  gs_conn* reader;
+  GThread* insert;
+  GThread* commit;
+  int before = -1, during = -1, after = -1, failed;
+
+  if (strcmp(gs_get_backend(c), "sqlite"))
+    return;
+
+  writer = gs_connect(dsn);
+  reader = gs_connect(dsn);
+  gs_exec(writer, "CREATE TABLE sw (id INT)", NULL);
+
+  q = gs_query_new(reader, "SELECT COUNT(*) FROM sw");
+  gs_query_put(q, NULL);
+  gs_query_get(q, "i", &before);
+
+  // reader is not blocked by open write transaction and does not see it
+  gs_begin(writer);
+  gs_exec(writer, "INSERT INTO sw (id) VALUES (1)", NULL);
+  gs_query_put(q, NULL);
+  gs_query_get(q, "i", &during);
+
+  // write of the other connection waits for the transaction, which is
+  // committed by other thread than it began
+  insert = g_thread_new("insert", single_writer_insert, reader);
+  commit = g_thread_new("commit", single_writer_commit, writer);
+  failed = GPOINTER_TO_INT(g_thread_join(commit));
+  failed += GPOINTER_TO_INT(g_thread_join(insert));
+
+  gs_query_put(q, NULL);
+  gs_query_get(q, "i", &after);
+  gs_query_free(q);
+
+  if (before != 0 || during != 0 || after != 2 || failed || gs_get_errcode(writer) != GS_ERR_NONE)
+    g_print("ASSERT FAILED: single writer counts %d, %d, %d\n", before, during, after);
+
+  // thread holding the writer must not wait for itself through other connection
+  gs_begin(writer);
+  if (gs_exec(reader, "INSERT INTO sw (id) VALUES (3)", NULL) == 0 || gs_get_errcode(reader) == GS_ERR_NONE)
+    g_print("ASSERT FAILED: write through second connection of writer thread did not fail\n");
+  gs_clear_error(reader);
+  gs_rollback(writer);
+
+  gs_disconnect(reader);
+  gs_disconnect(writer);
+  unlink(".test-sw.db");
+  unlink(".test-sw.db-wal");
+  unlink(".test-sw.db-shm");
+}
+
+static int count_rows(gs_conn* conn, const char* table)
+{
+  char* sql = g_strdup_printf("SELECT COUNT(*) FROM %s", table);
+  int count = -1;
+
+  q = gs_query_new(conn, sql);
+  gs_query_put(q, NULL);
+  gs_query_get(q, "i", &count);
+  gs_query_free(q);
+  g_free(sql);
+
+  return count;
+}
+
+/** sqlite in-memory database and snapshots
+ */
+static void test27(void)
+{
+  gs_conn* mem1;
+  gs_conn* mem2;
+  gs_conn* copy;
+  int shared, saved, loaded;
+
+  if (strcmp(gs_get_backend(c), "sqlite"))
+    return;
+
+  mem1 = gs_connect("sqlite:file:gsqlw_test?mode=memory&cache=shared");
+  mem2 = gs_connect("sqlite:file:gsqlw_test?mode=memory&cache=shared");
+  gs_exec(mem1, "CREATE TABLE snap (id INT)", NULL);
+  gs_exec(mem1, "INSERT INTO snap (id) VALUES (1), (2)", NULL);
+  shared = count_rows(mem2, "snap");
+
+  gs_snapshot_save(mem1, ".test-snap.db");
+  copy = gs_connect("sqlite:.test-snap.db");
+  saved = count_rows(copy, "snap");
+  gs_disconnect(copy);
+
+  copy = gs_connect("sqlite::memory:");
+  gs_snapshot_load(copy, ".test-snap.db");
+  loaded = count_rows(copy, "snap");
+
+  if (shared != 2 || saved != 2 || loaded != 2 || gs_get_errcode(mem1) != GS_ERR_NONE || gs_get_errcode(copy) != GS_ERR_NONE)
+    g_print("ASSERT FAILED: in-memory database shared %d, saved %d, loaded %d rows\n", shared, saved, loaded);
+
+  gs_disconnect(copy);
+  gs_disconnect(mem2);
+  gs_disconnect(mem1);
+  unlink(".test-snap.db");
+}
+
 int main(int ac, char* av[])
 {
   guint i;
@@ -145,6 +862,26 @@ int main(int ac, char* av[])
     test5,
     test6,
     test7,
+    test8,
+    test9,
+    test10,
+    test11,
+    test12,
+    test13,
+    test14,
+    test15,
+    test16,
+    test17,
+    test18,
+    test19,
+    test20,
+    test21,
+    test22,
+    test23,
+    test24,
+    test25,
+    test26,
+    test27,
   };
 
   for (i = 0; i < G_N_ELEMENTS(tests); i++)
@@ -18,6 +18,7 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -59,6 +60,21 @@ static gs_driver* drivers[] = {
   if (q == NULL || gs_get_errcode(q->conn) != GS_ERR_NONE) \
     return val;
 
+/* serialization of driver calls in thread-safe mode */
+#define CONN_LOCK(c) \
+  G_STMT_START { if ((c)->thread_safe) g_rec_mutex_lock(&(c)->lock); } G_STMT_END
+
+#define CONN_UNLOCK(c) \
+  G_STMT_START { if ((c)->thread_safe) g_rec_mutex_unlock(&(c)->lock); } G_STMT_END
+
+/* start time of measured driver call, 0 if statistics are disabled */
+#define STATS_START(c) \
+  ((c)->stats_enabled ? g_get_monotonic_time() : 0)
+
+/* the same for calls that are also reported to slow query handler */
+#define CALL_START(c) \
+  ((c)->stats_enabled || (c)->slow_query_func ? g_get_monotonic_time() : 0)
+
 gs_conn* gs_connect(const char* dsn)
 {
   guint i;
@@ -78,6 +94,8 @@ gs_conn* gs_connect(const char* dsn)
       {
         conn->dsn = g_strdup(drv_dsn);
         conn->driver = drivers[i];
+        conn->stmt_cache_size = GS_STMT_CACHE_DEFAULT_SIZE;
+        gs_stats_conn_open(conn);
       }
       return conn;
     }
@@ -86,12 +104,139 @@ gs_conn* gs_connect(const char* dsn)
   return NULL;
 }
 
+/* prepared statement cache */
+
+static void _query_drop_cached(gs_query* query);
+
+static void _query_destroy(gs_query* query)
+{
+  g_free(query->cache_key);
+  query->cache_key = NULL;
+  g_free(query->stats.sql);
+  query->stats.sql = NULL;
+  g_free(query->slow_sql);
+  query->slow_sql = NULL;
+  g_free(query->slow_params);
+  query->slow_params = NULL;
+  _query_drop_cached(query);
+  g_strfreev(query->read_tables);
+  g_strfreev(query->write_tables);
+  gs_plan_free(query->put_plan);
+  gs_plan_free(query->get_plan);
+  if (query->batch_data)
+    g_string_free(query->batch_data, TRUE);
+  QUERY_DRIVER(query)->query_free(query);
+}
+
+static void _stmt_cache_trim(gs_conn* conn, int size)
+{
+  while (g_queue_get_length(&conn->stmt_cache_lru) > (guint)size)
+  {
+    gs_query* query = g_queue_pop_tail(&conn->stmt_cache_lru);
+    g_hash_table_remove(conn->stmt_cache, query->cache_key);
+    _query_destroy(query);
+  }
+}
+
+static gs_query* _stmt_cache_take(gs_conn* conn, const char* sql_string)
+{
+  GList* link;
+  gs_query* query;
+
+  if (conn->stmt_cache_size <= 0 || sql_string == NULL)
+    return NULL;
+
+  link = conn->stmt_cache ? g_hash_table_lookup(conn->stmt_cache, sql_string) : NULL;
+  if (link == NULL)
+  {
+    conn->stmt_cache_misses++;
+    return NULL;
+  }
+
+  g_hash_table_remove(conn->stmt_cache, sql_string);
+  g_queue_unlink(&conn->stmt_cache_lru, link);
+  conn->stmt_cache_hits++;
+
+  query = link->data;
+  g_list_free(link);
+  return query;
+}
+
+/* Returns TRUE if query was taken over by the cache. */
+static gboolean _stmt_cache_put(gs_query* query)
+{
+  gs_conn* conn = query->conn;
+
+  if (query->cache_key == NULL || conn->stmt_cache_size <= 0 || QUERY_DRIVER(query)->query_reset == NULL)
+    return FALSE;
+
+  if (query->result_mode != GS_RESULT_DEFAULT)
+    return FALSE;
+
+  // query state is undefined after an error
+  if (gs_get_errcode(conn) != GS_ERR_NONE)
+    return FALSE;
+
+  if (conn->stmt_cache == NULL)
+    conn->stmt_cache = g_hash_table_new(g_str_hash, g_str_equal);
+  else if (g_hash_table_lookup(conn->stmt_cache, query->cache_key))
+    return FALSE;
+
+  if (QUERY_DRIVER(query)->query_reset(query) < 0)
+    return FALSE;
+
+  // TTL is set by the owner of the query, next one must opt in again
+  _query_drop_cached(query);
+  query->cache_ttl = 0;
+  g_queue_push_head(&conn->stmt_cache_lru, query);
+  g_hash_table_insert(conn->stmt_cache, query->cache_key, conn->stmt_cache_lru.head);
+  _stmt_cache_trim(conn, conn->stmt_cache_size);
+  return TRUE;
+}
+
+void gs_set_stmt_cache_size(gs_conn* conn, int size)
+{
+  if (conn == NULL)
+    return;
+  CONN_LOCK(conn);
+  conn->stmt_cache_size = MAX(size, 0);
+  if (conn->stmt_cache)
+    _stmt_cache_trim(conn, conn->stmt_cache_size);
+  CONN_UNLOCK(conn);
+}
+
+void gs_get_stmt_cache_stats(gs_conn* conn, guint64* hits, guint64* misses)
+{
+  if (conn)
+    CONN_LOCK(conn);
+  if (hits)
+    *hits = conn ? conn->stmt_cache_hits : 0;
+  if (misses)
+    *misses = conn ? conn->stmt_cache_misses : 0;
+  if (conn)
+    CONN_UNLOCK(conn);
+}
+
 void gs_disconnect(gs_conn* conn)
 {
   if (conn == NULL)
     return;
+  if (conn->stmt_cache)
+  {
+    _stmt_cache_trim(conn, 0);
+    g_hash_table_destroy(conn->stmt_cache);
+  }
+  if (conn->cache_written)
+    g_ptr_array_free(conn->cache_written, TRUE);
   CONN_DRIVER(conn)->disconnect(conn);
+  gs_stats_conn_close(conn);
   gs_clear_error(conn);
+  if (conn->thread_safe)
+  {
+    g_hash_table_destroy(conn->thread_errors);
+    g_mutex_clear(&conn->error_lock);
+    g_rec_mutex_clear(&conn->lock);
+  }
   g_free(conn->dsn);
   g_free(conn);
 }
@@ -103,144 +248,2168 @@ const char* gs_get_backend(gs_conn* conn)
   return conn->driver->name;
 }
 
+/* Error of the calling thread in thread-safe mode. */
+static gs_thread_error* _thread_error(gs_conn* conn)
+{
+  gs_thread_error* err;
+
+  // most threads have no error, skip the lookup
+  if (g_atomic_int_get(&conn->n_thread_errors) == 0)
+    return NULL;
+
+  g_mutex_lock(&conn->error_lock);
+  err = g_hash_table_lookup(conn->thread_errors, g_thread_self());
+  g_mutex_unlock(&conn->error_lock);
+
+  // only the owning thread changes or frees its entry
+  return err;
+}
+
+static void _thread_error_free(gpointer data)
+{
+  gs_thread_error* err = data;
+
+  g_free(err->msg);
+  g_free(err);
+}
+
 const char* gs_get_errmsg(gs_conn* conn)
 {
+  gs_thread_error* err;
+
   if (conn == NULL)
     return "Connection object is NULL.";
-  return conn->errmsg;
+  if (!conn->thread_safe)
+    return conn->errmsg;
+  err = _thread_error(conn);
+  return err ? err->msg : NULL;
 }
 
 int gs_get_errcode(gs_conn* conn)
 {
+  gs_thread_error* err;
+
   if (conn == NULL)
     return GS_ERR_OTHER;
-  return conn->errcode;
+  if (!conn->thread_safe)
+    return conn->errcode;
+  err = _thread_error(conn);
+  return err ? err->code : GS_ERR_NONE;
 }
 
 void gs_set_error(gs_conn* conn, int code, const char* msg)
 {
+  gs_thread_error* err;
+
   CONN_RETURN_IF_INVALID(conn);
-  conn->errcode = code;
-  g_free(conn->errmsg);
-  conn->errmsg = g_strdup(msg);
+  if (!conn->thread_safe)
+  {
+    conn->errcode = code;
+    g_free(conn->errmsg);
+    conn->errmsg = g_strdup(msg);
+    return;
+  }
+
+  err = g_new0(gs_thread_error, 1);
+  err->code = code;
+  err->msg = g_strdup(msg);
+  g_mutex_lock(&conn->error_lock);
+  g_hash_table_insert(conn->thread_errors, g_thread_self(), err);
+  g_atomic_int_set(&conn->n_thread_errors, g_hash_table_size(conn->thread_errors));
+  g_mutex_unlock(&conn->error_lock);
 }
 
 void gs_clear_error(gs_conn* conn)
 {
   if (conn == NULL)
     return;
-  conn->errcode = GS_ERR_NONE;
-  g_free(conn->errmsg);
-  conn->errmsg = NULL;
+  if (!conn->thread_safe)
+  {
+    conn->errcode = GS_ERR_NONE;
+    g_free(conn->errmsg);
+    conn->errmsg = NULL;
+    return;
+  }
+
+  if (_thread_error(conn) == NULL)
+    return;
+  g_mutex_lock(&conn->error_lock);
+  g_hash_table_remove(conn->thread_errors, g_thread_self());
+  g_atomic_int_set(&conn->n_thread_errors, g_hash_table_size(conn->thread_errors));
+  g_mutex_unlock(&conn->error_lock);
+}
+
+int gs_set_thread_safe(gs_conn* conn)
+{
+  CONN_RETURN_VAL_IF_INVALID(conn, -1);
+  if (conn->thread_safe)
+    return 0;
+  if (conn->in_transaction || conn->batch_active)
+  {
+    gs_set_error(conn, GS_ERR_OTHER, "Invalid API use, thread-safe mode must be enabled outside of transaction.");
+    return -1;
+  }
+
+  g_rec_mutex_init(&conn->lock);
+  g_mutex_init(&conn->error_lock);
+  conn->thread_errors = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, _thread_error_free);
+  conn->thread_safe = TRUE;
+  return 0;
 }
 
+static void _conn_cache_commit(gs_conn* conn, gboolean committed);
+
+/* In thread-safe mode transaction keeps the connection locked from gs_begin()
+ * until it is finished, so that statements of other threads can't get into
+ * it.
+ */
 int gs_begin(gs_conn* conn)
 {
+  int retval, was_active;
+
   CONN_RETURN_VAL_IF_INVALID(conn, -1);
-  int retval = CONN_DRIVER(conn)->begin(conn);
+  CONN_LOCK(conn);
+  was_active = conn->in_transaction;
+  retval = CONN_DRIVER(conn)->begin(conn);
   if (retval == 0)
     conn->in_transaction = TRUE;
+  if (retval < 0 || was_active)
+    CONN_UNLOCK(conn);
   return retval;
 }
 
 int gs_commit(gs_conn* conn)
 {
+  int retval, was_active;
+
   CONN_RETURN_VAL_IF_INVALID(conn, -1);
-  int retval = CONN_DRIVER(conn)->commit(conn);
+  CONN_LOCK(conn);
+  was_active = conn->in_transaction;
+  retval = CONN_DRIVER(conn)->commit(conn);
+  _conn_cache_commit(conn, retval == 0);
   if (retval == 0)
+  {
     conn->in_transaction = FALSE;
+    if (was_active)
+      CONN_UNLOCK(conn);
+  }
+  CONN_UNLOCK(conn);
   return retval;
 }
 
 int gs_rollback(gs_conn* conn)
 {
+  int retval, was_active;
+
   if (conn == NULL)
     return -1;
-  int retval = CONN_DRIVER(conn)->rollback(conn);
+  CONN_LOCK(conn);
+  was_active = conn->in_transaction;
+  retval = CONN_DRIVER(conn)->rollback(conn);
+  _conn_cache_commit(conn, FALSE);
   if (retval == 0)
+  {
     conn->in_transaction = FALSE;
+    if (was_active)
+      CONN_UNLOCK(conn);
+  }
+  CONN_UNLOCK(conn);
   return retval;
 }
 
+/* Record statistics of the driver call started at start. */
+static void _query_stats(gs_query* query, int phase, gint64 start, int failed, int rows)
+{
+  // statistics may be enabled after cached query was created
+  if (query->stats.sql == NULL)
+    query->stats.sql = gs_stats_normalize(query->cache_key ? query->cache_key : query->sql);
+  gs_stats_record(query->conn, &query->stats, phase, start, failed, rows);
+}
+
 gs_query* gs_query_new(gs_conn* conn, const char* sql_string)
 {
+  gs_query* query;
+  gint64 start;
+
   CONN_RETURN_VAL_IF_INVALID(conn, NULL);
-  return CONN_DRIVER(conn)->query_new(conn, sql_string);
+
+  CONN_LOCK(conn);
+  query = _stmt_cache_take(conn, sql_string);
+  if (query == NULL)
+  {
+    start = STATS_START(conn);
+    query = CONN_DRIVER(conn)->query_new(conn, sql_string);
+    if (query && conn->stmt_cache_size > 0 && CONN_DRIVER(conn)->query_reset)
+      query->cache_key = g_strdup(sql_string);
+    if (query && query->cache_key == NULL && conn->slow_query_func)
+      query->slow_sql = g_strdup(sql_string);
+    if (start && query)
+    {
+      query->stats.sql = gs_stats_normalize(sql_string);
+      _query_stats(query, GS_STATS_PREPARE, start, FALSE, 0);
+    }
+    else if (start)
+    {
+      gs_stats_ref ref = { gs_stats_normalize(sql_string), NULL, 0, NULL };
+
+      gs_stats_record(conn, &ref, GS_STATS_PREPARE, start, TRUE, 0);
+      g_free(ref.sql);
+    }
+  }
+  CONN_UNLOCK(conn);
+
+  return query;
 }
 
-int gs_query_putv(gs_query* query, const char* fmt, va_list ap)
+/* format strings */
+
+/* format codes of values, '?' may precede any of them */
+#define FORMAT_VALUE_CODES "sSildbt"
+
+/* plan must have room for strlen(fmt) slots */
+static int _plan_parse(const char* fmt, gs_plan* plan)
 {
-  QUERY_RETURN_VAL_IF_INVALID(query, -1);
-  return QUERY_DRIVER(query)->query_putv(query, fmt, ap);
+  int fmt_len = (fmt != NULL) ? strlen(fmt) : 0;
+  int i, col = 0;
+
+  plan->n_slots = 0;
+  for (i = 0; i < fmt_len; i++)
+  {
+    gs_plan_slot* slot = plan->slots + plan->n_slots++;
+
+    slot->type = fmt[i];
+    slot->col = col;
+    if (strchr(FORMAT_VALUE_CODES, fmt[i]))
+      col++;
+    else if (fmt[i] != '?' || fmt[i+1] == '\0' || !strchr(FORMAT_VALUE_CODES, fmt[i+1]))
+      return -1;
+  }
+  plan->n_cols = col;
+
+  return 0;
 }
 
-int gs_query_put(gs_query* query, const char* fmt, ...)
+gs_plan* gs_plan_new(const char* fmt)
 {
-  int retval;
-  va_list ap;
+  gs_plan* plan = g_malloc(GS_PLAN_SIZE(fmt != NULL ? strlen(fmt) : 0));
 
-  va_start(ap, fmt);
-  retval = gs_query_putv(query, fmt, ap);
-  va_end(ap);
+  if (_plan_parse(fmt, plan) < 0)
+  {
+    g_free(plan);
+    return NULL;
+  }
+  plan->fmt = g_strdup(fmt != NULL ? fmt : "");
 
-  return retval;
+  return plan;
 }
 
-void gs_query_free(gs_query* query)
+void gs_plan_free(gs_plan* plan)
 {
-  if (query)
-    QUERY_DRIVER(query)->query_free(query);
+  if (plan == NULL)
+    return;
+  g_free(plan->fmt);
+  g_free(plan);
 }
 
-int gs_query_getv(gs_query* query, const char* fmt, va_list ap)
+/* Return plan of fmt, last plan used with the query is reused. */
+static const gs_plan* _query_plan(gs_query* query, gs_plan** cache, const char* fmt)
 {
-  QUERY_RETURN_VAL_IF_INVALID(query, -1);
-  return QUERY_DRIVER(query)->query_getv(query, fmt, ap);
+  if (*cache != NULL && !strcmp((*cache)->fmt, fmt != NULL ? fmt : ""))
+    return *cache;
+
+  gs_plan_free(*cache);
+  *cache = gs_plan_new(fmt);
+  if (*cache == NULL)
+    gs_set_error(query->conn, GS_ERR_OTHER, "Invalid format string.");
+
+  return *cache;
 }
 
-int gs_query_get(gs_query* query, const char* fmt, ...)
+/* params must have room for plan->n_cols items */
+int gs_params_collect_plan(gs_conn* conn, const gs_plan* plan, va_list ap, gs_param* params)
 {
-  int retval;
-  va_list ap;
+  int i;
 
-  va_start(ap, fmt);
-  retval = gs_query_getv(query, fmt, ap);
-  va_end(ap);
+  for (i = 0; i < plan->n_slots; i++)
+  {
+    const gs_plan_slot* slot = plan->slots + i;
+    gs_param* param = params + slot->col;
+
+    if (slot->type == '?')
+    {
+      param->is_null = (int)va_arg(ap, int);
+      i++;
+      slot++;
+    }
+    else
+      param->is_null = 0;
+
+    if (slot->type == 's')
+    {
+      param->value.s = (const char*)va_arg(ap, const char*);
+      param->is_null = param->is_null || param->value.s == NULL;
+    }
+    else if (slot->type == 'i')
+      param->value.i = (int)va_arg(ap, int);
+    else if (slot->type == 'l' || slot->type == 't')
+      param->value.l = (gint64)va_arg(ap, gint64);
+    else if (slot->type == 'd')
+      param->value.d = (double)va_arg(ap, double);
+    else if (slot->type == 'b')
+      param->value.i = (int)va_arg(ap, gboolean) != FALSE;
+    else
+    {
+      gs_set_error(conn, GS_ERR_OTHER, "Invalid format string.");
+      return -1;
+    }
+    param->type = slot->type;
+  }
+
+  return plan->n_cols;
+}
+
+/* params must have room for strlen(fmt) items */
+int gs_params_collect(gs_conn* conn, const char* fmt, va_list ap, gs_param* params)
+{
+  gs_plan* plan = g_alloca(GS_PLAN_SIZE(fmt != NULL ? strlen(fmt) : 0));
+
+  if (_plan_parse(fmt, plan) < 0)
+  {
+    gs_set_error(conn, GS_ERR_OTHER, "Invalid format string.");
+    return -1;
+  }
+
+  return gs_params_collect_plan(conn, plan, ap, params);
+}
+
+#define PARAMS_ALLOCA(fmt) \
+  g_newa(gs_param, (fmt) != NULL ? strlen(fmt) + 1 : 1)
+
+/* slow query reporting */
+
+static gs_param* _params_dup(const gs_param* params, int count);
+
+void gs_set_slow_query_handler(gs_conn* conn, gint64 threshold_us, gs_slow_query_func func, gpointer user_data)
+{
+  if (conn == NULL)
+    return;
+  CONN_LOCK(conn);
+  conn->slow_query_func = func;
+  conn->slow_query_data = user_data;
+  conn->slow_query_threshold = MAX(threshold_us, 0);
+  CONN_UNLOCK(conn);
+}
+
+void gs_set_slow_query_explain(gs_conn* conn, gboolean enabled)
+{
+  if (conn == NULL)
+    return;
+  CONN_LOCK(conn);
+  conn->slow_query_explain = enabled != FALSE;
+  CONN_UNLOCK(conn);
+}
+
+/* Keep parameters of the last execution for the report of slow fetch. */
+static void _query_save_params(gs_query* query, const gs_param* params, int count)
+{
+  g_free(query->slow_params);
+  query->slow_params = count > 0 ? _params_dup(params, count) : NULL;
+  query->slow_n_params = count;
+}
+
+/* Text of the parameter value, NULL for SQL NULL. */
+static char* _param_text(const gs_param* param)
+{
+  char buf[MAX(GS_TIME_BUF, G_ASCII_DTOSTR_BUF_SIZE)];
+
+  if (param->is_null)
+    return NULL;
+  if (param->type == 's')
+    return g_strdup(param->value.s);
+  if (param->type == 'i')
+    return g_strdup_printf("%d", param->value.i);
+  if (param->type == 'l')
+    return g_strdup_printf("%" G_GINT64_FORMAT, param->value.l);
+  if (param->type == 'd')
+    return g_strdup(g_ascii_dtostr(buf, sizeof(buf), param->value.d));
+  if (param->type == 'b')
+    return g_strdup(param->value.i ? "true" : "false");
+  gs_time_format(param->value.l, buf);
+  return g_strdup(buf);
+}
+
+/* TRUE for statements that EXPLAIN accepts, failed EXPLAIN would abort pgsql
+ * transaction.
+ */
+static gboolean _sql_explainable(const char* sql)
+{
+  static const char* const keywords[] = { "SELECT", "INSERT", "UPDATE", "DELETE", "WITH" };
+  guint i;
+
+  while (g_ascii_isspace(*sql) || *sql == '(')
+    sql++;
+  for (i = 0; i < G_N_ELEMENTS(keywords); i++)
+  {
+    gsize len = strlen(keywords[i]);
+    if (!g_ascii_strncasecmp(sql, keywords[i], len) && !g_ascii_isalnum(sql[len]))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/* Run statement without parameters and result directly by the driver. */
+static int _conn_driver_exec(gs_conn* conn, const char* sql)
+{
+  gs_query* query = CONN_DRIVER(conn)->query_new(conn, sql);
+  int retval = -1;
+
+  if (query)
+  {
+    retval = CONN_DRIVER(conn)->query_put_params(query, NULL, 0);
+    CONN_DRIVER(conn)->query_free(query);
+  }
 
   return retval;
 }
 
-int gs_query_get_rows(gs_query* query)
+/* Run EXPLAIN of the statement with parameters of its last execution. Plan
+ * rows are returned as lines of text values, NULL if plan is not available.
+ * Inside transaction the EXPLAIN runs in a savepoint, its failure would
+ * abort the user's transaction on pgsql.
+ */
+static char* _query_explain(gs_query* query, const char* sql_string)
 {
-  QUERY_RETURN_VAL_IF_INVALID(query, -1);
-  return QUERY_DRIVER(query)->query_get_rows(query);
+  gs_conn* conn = query->conn;
+  gs_driver* driver = QUERY_DRIVER(query);
+  union { int i; gint64 l; double d; const char* s; } *values;
+  gs_query* explain;
+  gs_plan* plan;
+  GString* text;
+  void** targets;
+  char* sql;
+  int i;
+
+  if (driver->explain_prefix == NULL || sql_string == NULL || !_sql_explainable(sql_string))
+    return NULL;
+  // unread streamed result or batch occupies the connection
+  if (query->result_mode == GS_RESULT_STREAMING || conn->batch_active)
+    return NULL;
+
+  plan = gs_plan_new(driver->explain_fmt);
+  values = g_alloca(sizeof(*values) * (plan->n_slots + 1));
+  targets = g_newa(void*, plan->n_slots + 1);
+  for (i = 0; i < plan->n_slots; i++)
+    targets[i] = &values[i];
+
+  if (conn->in_transaction && _conn_driver_exec(conn, "SAVEPOINT gs_explain") < 0)
+  {
+    gs_clear_error(conn);
+    gs_plan_free(plan);
+    return NULL;
+  }
+
+  sql = g_strconcat(driver->explain_prefix, sql_string, NULL);
+  explain = driver->query_new(conn, sql);
+  g_free(sql);
+
+  text = g_string_new(NULL);
+  if (explain && driver->query_put_params(explain, query->slow_params, query->slow_n_params) == 0)
+  {
+    while (driver->query_get_plan(explain, plan, targets) == 0)
+    {
+      for (i = 0; i < plan->n_slots; i++)
+      {
+        if (plan->slots[i].type != 's' || values[i].s == NULL)
+          continue;
+        if (text->len > 0 && text->str[text->len - 1] != '\n')
+          g_string_append_c(text, ' ');
+        g_string_append(text, values[i].s);
+      }
+      g_string_append_c(text, '\n');
+    }
+  }
+  if (explain)
+    driver->query_free(explain);
+  gs_plan_free(plan);
+
+  // plan is only a hint, its failure must not fail the statement
+  if (gs_get_errcode(conn) != GS_ERR_NONE)
+  {
+    gs_clear_error(conn);
+    if (conn->in_transaction)
+      _conn_driver_exec(conn, "ROLLBACK TO SAVEPOINT gs_explain");
+    g_string_free(text, TRUE);
+    text = NULL;
+  }
+  if (conn->in_transaction)
+  {
+    _conn_driver_exec(conn, "RELEASE SAVEPOINT gs_explain");
+    gs_clear_error(conn);
+  }
+  if (text == NULL)
+    return NULL;
+
+  if (text->len > 0 && text->str[text->len - 1] == '\n')
+    g_string_truncate(text, text->len - 1);
+  return g_string_free(text, FALSE);
 }
 
-int gs_query_get_last_id(gs_query* query, const char* seq_name)
+static void _query_slow(gs_query* query, int phase, gint64 elapsed, int failed)
 {
-  QUERY_RETURN_VAL_IF_INVALID(query, -1);
-  return QUERY_DRIVER(query)->query_get_last_id(query, seq_name);
+  gs_conn* conn = query->conn;
+  const char* sql_string = query->cache_key ? query->cache_key : query->slow_sql;
+  char** params = g_newa(char*, query->slow_n_params + 1);
+  char* plan = NULL;
+  gs_slow_query slow;
+  int i;
+
+  for (i = 0; i < query->slow_n_params; i++)
+    params[i] = _param_text(query->slow_params + i);
+
+  slow.sql = sql_string ? sql_string : query->sql;
+  slow.params = (const char* const*)params;
+  slow.n_params = query->slow_n_params;
+  slow.elapsed_usec = elapsed;
+  slow.phase = phase;
+  slow.failed = failed;
+  slow.rows = query->fetched_rows;
+  if (phase == GS_STATS_EXECUTE)
+  {
+    slow.rows = GS_ROWS_UNKNOWN;
+    if (!failed && query->result_mode != GS_RESULT_STREAMING)
+      slow.rows = MAX(QUERY_DRIVER(query)->query_get_rows(query), GS_ROWS_UNKNOWN);
+  }
+  if (conn->slow_query_explain && !failed && gs_get_errcode(conn) == GS_ERR_NONE)
+    plan = _query_explain(query, sql_string);
+  slow.plan = plan;
+
+  conn->slow_query_func(conn, &slow, conn->slow_query_data);
+
+  for (i = 0; i < query->slow_n_params; i++)
+    g_free(params[i]);
+  g_free(plan);
 }
 
-/* helper functions */
+/* Record statistics of the driver call started at start and report it if it
+ * was slow.
+ */
+static void _query_timed(gs_query* query, int phase, gint64 start, int failed, int rows)
+{
+  gs_conn* conn = query->conn;
+  gint64 elapsed;
 
-int gs_exec(gs_conn* conn, const char* sql_string, const char* fmt, ...)
+  if (conn->stats_enabled)
+    _query_stats(query, phase, start, failed, rows);
+
+  if (conn->slow_query_func == NULL)
+    return;
+  elapsed = g_get_monotonic_time() - start;
+  if (elapsed >= conn->slow_query_threshold)
+    _query_slow(query, phase, elapsed, failed);
+}
+
+/* result cache */
+
+void gs_set_result_cache(gs_conn* conn, gs_result_cache* cache)
 {
-  int retval;
-  va_list ap;
-  gs_query* query;
+  if (conn == NULL)
+    return;
+  CONN_LOCK(conn);
+  conn->result_cache = cache;
+  CONN_UNLOCK(conn);
+}
 
-  query = gs_query_new(conn, sql_string);
-  if (!query)
+int gs_query_set_cache_ttl(gs_query* query, int ttl_ms)
+{
+  QUERY_RETURN_VAL_IF_INVALID(query, -1);
+  if (ttl_ms < 0)
     return -1;
+  query->cache_ttl = ttl_ms;
+  return 0;
+}
 
-  va_start(ap, fmt);
-  retval = gs_query_putv(query, fmt, ap);
-  va_end(ap);
+/* Tables are parsed from the original SQL text on first use. */
+static void _query_parse_tables(gs_query* query)
+{
+  if (query->tables_parsed)
+    return;
+  gs_sql_tables(query->cache_key ? query->cache_key : query->sql, &query->read_tables, &query->write_tables);
+  query->tables_parsed = TRUE;
+}
 
-  gs_query_free(query);
+static void _query_drop_cached(gs_query* query)
+{
+  gs_cache_entry_unref(query->cache_rows);
+  query->cache_rows = NULL;
+}
 
-  return retval;
+/* Invalidate results read from tables written by the connection. Inside
+ * transaction the tables are invalidated again on commit, other connections
+ * could cache the old data in the meantime.
+ */
+static void _conn_cache_written(gs_conn* conn, char** tables)
+{
+  guint j;
+  int i;
+
+  if (conn->result_cache == NULL || tables == NULL || tables[0] == NULL)
+    return;
+
+  gs_result_cache_invalidate(conn->result_cache, tables);
+  if (!conn->in_transaction)
+    return;
+
+  if (conn->cache_written == NULL)
+    conn->cache_written = g_ptr_array_new_with_free_func(g_free);
+  for (i = 0; tables[i]; i++)
+  {
+    for (j = 0; j < conn->cache_written->len; j++)
+      if (strcmp(g_ptr_array_index(conn->cache_written, j), tables[i]) == 0)
+        break;
+    if (j == conn->cache_written->len)
+      g_ptr_array_add(conn->cache_written, g_strdup(tables[i]));
+  }
+}
+
+/* Transaction finished, tables it wrote are invalidated if it was committed. */
+static void _conn_cache_commit(gs_conn* conn, gboolean committed)
+{
+  if (conn->cache_written == NULL || conn->cache_written->len == 0)
+    return;
+
+  if (committed && conn->result_cache)
+  {
+    g_ptr_array_add(conn->cache_written, NULL);
+    gs_result_cache_invalidate(conn->result_cache, (char**)conn->cache_written->pdata);
+  }
+  g_ptr_array_set_size(conn->cache_written, 0);
+}
+
+/* Key of the result is the SQL text followed by the parameter values. */
+static GBytes* _cache_key(gs_query* query, const gs_param* params, int count)
+{
+  const char* sql = query->cache_key ? query->cache_key : query->sql;
+  GByteArray* key = g_byte_array_sized_new(strlen(sql) + 1 + count * 10);
+  int i;
+
+  g_byte_array_append(key, (const guint8*)sql, strlen(sql) + 1);
+  for (i = 0; i < count; i++)
+  {
+    const gs_param* param = params + i;
+    guint8 head[2] = { (guint8)param->type, param->is_null != 0 };
+
+    g_byte_array_append(key, head, 2);
+    if (param->is_null)
+      continue;
+
+    switch (param->type)
+    {
+      case 's':
+        g_byte_array_append(key, (const guint8*)param->value.s, strlen(param->value.s) + 1);
+        break;
+      case 'l':
+      case 't':
+        g_byte_array_append(key, (const guint8*)&param->value.l, sizeof(gint64));
+        break;
+      case 'd':
+        g_byte_array_append(key, (const guint8*)&param->value.d, sizeof(double));
+        break;
+      default:
+        g_byte_array_append(key, (const guint8*)&param->value.i, sizeof(int));
+    }
+  }
+
+  return g_byte_array_free_to_bytes(key);
+}
+
+/* Return TRUE if execution is served from the cache. On miss key is set if
+ * the result should be cached after execution, generation is then taken
+ * before the execution for gs_result_cache_insert().
+ */
+static gboolean _query_cache_lookup(gs_query* query, const gs_param* params, int count, GBytes** key, guint64* generation)
+{
+  gs_conn* conn = query->conn;
+  gs_cache_entry* entry;
+
+  *key = NULL;
+  // transaction may see its own uncommitted writes
+  if (query->cache_ttl <= 0 || conn->result_cache == NULL || conn->in_transaction || conn->batch_active ||
+      query->result_mode != GS_RESULT_DEFAULT || QUERY_DRIVER(query)->query_get_columns == NULL)
+    return FALSE;
+
+  _query_parse_tables(query);
+  if (query->write_tables && query->write_tables[0])
+    return FALSE;
+
+  *key = _cache_key(query, params, count);
+  entry = gs_result_cache_lookup(conn->result_cache, *key);
+  if (entry == NULL)
+  {
+    *generation = gs_result_cache_generation(conn->result_cache);
+    return FALSE;
+  }
+
+  g_bytes_unref(*key);
+  *key = NULL;
+  // unread result of the previous execution would keep sqlite locks
+  if (QUERY_DRIVER(query)->query_reset)
+    QUERY_DRIVER(query)->query_reset(query);
+  query->cache_rows = entry;
+  query->cache_row = 0;
+  return TRUE;
+}
+
+/* Decode text of the value to cache, so that it is not parsed again on
+ * each gs_query_get().
+ */
+static void _cache_cell_decode(gs_cache_cell* cell, const char* value)
+{
+  char* end;
+
+  cell->kind = GS_CACHE_TEXT;
+  if (value[0] == '\0')
+    return;
+
+  errno = 0;
+  cell->value.l = g_ascii_strtoll(value, &end, 10);
+  if (*end == '\0' && errno == 0)
+  {
+    cell->kind = GS_CACHE_INT;
+    return;
+  }
+
+  cell->value.d = g_ascii_strtod(value, &end);
+  if (*end == '\0')
+  {
+    cell->kind = GS_CACHE_DOUBLE;
+    return;
+  }
+
+  if (gs_time_parse(value, &cell->value.l) == 0)
+    cell->kind = GS_CACHE_TIME;
+}
+
+/* Read whole result of the executed query and store it in the cache, rows
+ * are then returned from the cache entry.
+ */
+static int _query_cache_store(gs_query* query, GBytes* key, guint64 generation)
+{
+  int n_cols = QUERY_DRIVER(query)->query_get_columns(query);
+  char* fmt;
+  gs_plan* plan;
+  void** targets;
+  int* is_null;
+  const char** strs;
+  GArray* cells;
+  GString* data;
+  gs_cache_entry* entry;
+  int i, rs, n_rows = 0;
+
+  // statement without result set
+  if (n_cols <= 0)
+    return 0;
+
+  fmt = g_newa(char, 2 * n_cols + 1);
+  plan = g_alloca(GS_PLAN_SIZE(2 * n_cols));
+  targets = g_newa(void*, 2 * n_cols);
+  is_null = g_newa(int, n_cols);
+  strs = g_newa(const char*, n_cols);
+  for (i = 0; i < n_cols; i++)
+  {
+    fmt[2 * i] = '?';
+    fmt[2 * i + 1] = 's';
+    targets[2 * i] = &is_null[i];
+    targets[2 * i + 1] = &strs[i];
+  }
+  fmt[2 * n_cols] = '\0';
+  _plan_parse(fmt, plan);
+  plan->fmt = fmt;
+
+  cells = g_array_new(FALSE, TRUE, sizeof(gs_cache_cell));
+  data = g_string_sized_new(1024);
+  while (TRUE)
+  {
+    memset(is_null, 0, n_cols * sizeof(int));
+    rs = QUERY_DRIVER(query)->query_get_plan(query, plan, targets);
+    if (rs != 0)
+      break;
+
+    for (i = 0; i < n_cols; i++)
+    {
+      gs_cache_cell cell = { -1, GS_CACHE_TEXT, { 0 } };
+
+      if (!is_null[i] && strs[i] != NULL)
+      {
+        cell.offset = data->len;
+        g_string_append(data, strs[i]);
+        g_string_append_c(data, '\0');
+        _cache_cell_decode(&cell, strs[i]);
+      }
+      g_array_append_val(cells, cell);
+    }
+    n_rows++;
+  }
+
+  if (rs == 1)
+  {
+    entry = gs_cache_entry_new(n_cols, n_rows, (const gs_cache_cell*)cells->data, data->str, data->len);
+    gs_result_cache_insert(query->conn->result_cache, key, entry, query->cache_ttl, query->read_tables, generation);
+    query->cache_rows = entry;
+    query->cache_row = 0;
+  }
+  g_array_free(cells, TRUE);
+  g_string_free(data, TRUE);
+
+  return rs < 0 ? -1 : 0;
+}
+
+/* gs_query_get_planv() of the result read from the cache. */
+static int _query_cache_get_plan(gs_query* query, const gs_plan* plan, void** targets)
+{
+  gs_cache_entry* entry = query->cache_rows;
+  const gs_cache_cell* cells;
+  int i;
+
+  if (plan->n_cols > entry->n_cols)
+  {
+    gs_set_error(query->conn, GS_ERR_OTHER, "Invalid format string.");
+    return -1;
+  }
+  if (query->cache_row >= entry->n_rows)
+    return 1;
+
+  cells = entry->cells + (gsize)query->cache_row * entry->n_cols;
+  for (i = 0; i < plan->n_slots; i++)
+  {
+    const gs_cache_cell* cell = &cells[plan->slots[i].col];
+    const char* value = cell->offset < 0 ? NULL : entry->data + cell->offset;
+
+    switch (plan->slots[i].type)
+    {
+      case 's':
+        *(const char**)targets[i] = value;
+        break;
+      case 'S':
+        *(char**)targets[i] = g_strdup(value);
+        break;
+      case 'i':
+      case 'l':
+      case 't':
+      {
+        gint64 v;
+
+        // sqlite keeps timestamps as integers
+        if (value == NULL)
+          v = 0;
+        else if (cell->kind == GS_CACHE_INT || cell->kind == GS_CACHE_TIME)
+          v = cell->value.l;
+        else if (cell->kind == GS_CACHE_DOUBLE)
+          v = (gint64)cell->value.d;
+        else
+          v = g_ascii_strtoll(value, NULL, 10);
+        if (plan->slots[i].type == 'i')
+          *(int*)targets[i] = (int)v;
+        else
+          *(gint64*)targets[i] = v;
+        break;
+      }
+      case 'd':
+        if (value == NULL)
+          *(double*)targets[i] = 0;
+        else if (cell->kind == GS_CACHE_INT || cell->kind == GS_CACHE_TIME)
+          *(double*)targets[i] = cell->value.l;
+        else if (cell->kind == GS_CACHE_DOUBLE)
+          *(double*)targets[i] = cell->value.d;
+        else
+          *(double*)targets[i] = g_ascii_strtod(value, NULL);
+        break;
+      case 'b':
+        if (value == NULL)
+          *(gboolean*)targets[i] = FALSE;
+        else if (cell->kind == GS_CACHE_INT)
+          *(gboolean*)targets[i] = cell->value.l != 0;
+        else if (cell->kind == GS_CACHE_DOUBLE)
+          *(gboolean*)targets[i] = cell->value.d != 0;
+        else
+          *(gboolean*)targets[i] = (value[0] != '\0' && strchr("tTyY1", value[0]) != NULL) ||
+                                   g_ascii_strcasecmp(value, "on") == 0;
+        break;
+      case '?':
+        *(int*)targets[i] = value == NULL;
+        break;
+    }
+  }
+
+  query->cache_row++;
+  return 0;
+}
+
+/* Fetch next row from the cached result or from the driver. */
+static int _query_get_row(gs_query* query, const gs_plan* plan, void** targets)
+{
+  if (query->cache_rows)
+    return _query_cache_get_plan(query, plan, targets);
+  return QUERY_DRIVER(query)->query_get_plan(query, plan, targets);
+}
+
+/* Execute query with the connection locked in thread-safe mode. */
+static int _query_put_params(gs_query* query, const gs_param* params, int count)
+{
+  gs_conn* conn = query->conn;
+  int retval;
+
+  CONN_LOCK(conn);
+  // streamed result occupies the connection until it is read, that is
+  // only safe while this thread holds it for the whole transaction
+  if (conn->thread_safe && query->result_mode == GS_RESULT_STREAMING && !conn->in_transaction)
+  {
+    gs_set_error(conn, GS_ERR_OTHER, "Invalid API use, streaming query of shared connection must run in transaction.");
+    retval = -1;
+  }
+  else
+  {
+    gint64 start;
+    GBytes* key;
+    guint64 generation = 0;
+
+    query->fetched_rows = 0;
+    _query_drop_cached(query);
+    if (_query_cache_lookup(query, params, count, &key, &generation))
+      retval = 0;
+    else
+    {
+      start = CALL_START(conn);
+      retval = QUERY_DRIVER(query)->query_put_params(query, params, count);
+      if (conn->slow_query_func)
+        _query_save_params(query, params, count);
+      if (start)
+        _query_timed(query, GS_STATS_EXECUTE, start, retval < 0, 0);
+      if (key && retval == 0)
+        retval = _query_cache_store(query, key, generation);
+      if (conn->result_cache)
+      {
+        _query_parse_tables(query);
+        _conn_cache_written(conn, query->write_tables);
+      }
+    }
+    if (key)
+      g_bytes_unref(key);
+  }
+  CONN_UNLOCK(conn);
+
+  return retval;
+}
+
+int gs_query_put_planv(gs_query* query, const gs_plan* plan, va_list ap)
+{
+  gs_param* params;
+  int count;
+
+  QUERY_RETURN_VAL_IF_INVALID(query, -1);
+  if (plan == NULL)
+    return -1;
+
+  params = g_newa(gs_param, plan->n_cols + 1);
+  count = gs_params_collect_plan(query->conn, plan, ap, params);
+  if (count < 0)
+    return -1;
+  return _query_put_params(query, params, count);
+}
+
+int gs_query_putv(gs_query* query, const char* fmt, va_list ap)
+{
+  QUERY_RETURN_VAL_IF_INVALID(query, -1);
+  return gs_query_put_planv(query, _query_plan(query, &query->put_plan, fmt), ap);
+}
+
+/* array execution */
+
+void gs_array_row_params(const gs_array_column* columns, int n_columns, int row, gs_param* params)
+{
+  int i;
+
+  for (i = 0; i < n_columns; i++)
+  {
+    const gs_array_column* column = columns + i;
+
+    params[i].type = column->type;
+    params[i].is_null = column->nulls != NULL && (column->nulls[row / 8] & (1 << (row % 8)));
+    if (column->type == 's')
+    {
+      params[i].value.s = ((const char* const*)column->values)[row];
+      params[i].is_null = params[i].is_null || params[i].value.s == NULL;
+    }
+    else
+      params[i].value.i = ((const int*)column->values)[row];
+  }
+}
+
+void gs_array_row_error(gs_array_error* err, int* row_status, int row, int code, const char* msg)
+{
+  if (code == GS_ERR_NONE)
+    code = GS_ERR_OTHER;
+  if (row_status)
+    row_status[row] = code;
+  if (err->code == GS_ERR_NONE)
+  {
+    err->code = code;
+    err->msg = g_strdup(msg);
+  }
+}
+
+int gs_array_finish(gs_conn* conn, gs_array_error* err)
+{
+  if (err->code == GS_ERR_NONE)
+    return 0;
+
+  gs_set_error(conn, err->code, err->msg);
+  g_free(err->msg);
+  err->msg = NULL;
+  return -1;
+}
+
+int gs_query_put_array(gs_query* query, const gs_array_column* columns, int n_columns, int n_rows, int* row_status)
+{
+  gs_array_error err = { GS_ERR_NONE, NULL };
+  gs_param* params;
+  int i;
+
+  QUERY_RETURN_VAL_IF_INVALID(query, -1);
+
+  for (i = 0; i < n_columns; i++)
+  {
+    if ((columns[i].type != 's' && columns[i].type != 'i') || columns[i].values == NULL)
+    {
+      gs_set_error(query->conn, GS_ERR_OTHER, "Invalid array column.");
+      return -1;
+    }
+  }
+
+  if (row_status)
+    for (i = 0; i < n_rows; i++)
+      row_status[i] = GS_ERR_NONE;
+
+  CONN_LOCK(query->conn);
+  if (QUERY_DRIVER(query)->query_put_array && !query->conn->batch_active)
+  {
+    gint64 start = CALL_START(query->conn);
+
+    query->fetched_rows = 0;
+    _query_drop_cached(query);
+    i = QUERY_DRIVER(query)->query_put_array(query, columns, n_columns, n_rows, row_status);
+    _query_save_params(query, NULL, 0);
+    if (start)
+      _query_timed(query, GS_STATS_EXECUTE, start, i < 0, 0);
+    if (query->conn->result_cache)
+    {
+      _query_parse_tables(query);
+      _conn_cache_written(query->conn, query->write_tables);
+    }
+    CONN_UNLOCK(query->conn);
+    return i;
+  }
+  CONN_UNLOCK(query->conn);
+
+  params = g_newa(gs_param, n_columns + 1);
+  for (i = 0; i < n_rows; i++)
+  {
+    gs_array_row_params(columns, n_columns, i, params);
+    if (_query_put_params(query, params, n_columns) < 0)
+    {
+      gs_array_row_error(&err, row_status, i, gs_get_errcode(query->conn), gs_get_errmsg(query->conn));
+      gs_clear_error(query->conn);
+    }
+  }
+
+  return gs_array_finish(query->conn, &err);
+}
+
+int gs_query_put_plan(gs_query* query, const gs_plan* plan, ...)
+{
+  int retval;
+  va_list ap;
+
+  va_start(ap, plan);
+  retval = gs_query_put_planv(query, plan, ap);
+  va_end(ap);
+
+  return retval;
+}
+
+int gs_query_put(gs_query* query, const char* fmt, ...)
+{
+  int retval;
+  va_list ap;
+
+  va_start(ap, fmt);
+  retval = gs_query_putv(query, fmt, ap);
+  va_end(ap);
+
+  return retval;
+}
+
+/* asynchronous execution */
+
+/* domain of errors passed from worker thread, code is one of _gs_errors */
+#define GS_TASK_ERROR g_quark_from_static_string("gs-task-error")
+
+struct _put_async_data
+{
+  gs_query* query;
+  gs_param* params;         // strings are stored in the same allocation
+  int count;
+};
+
+static void _put_async_data_free(gpointer data)
+{
+  struct _put_async_data* d = data;
+
+  g_free(d->params);
+  g_free(d);
+}
+
+/* Copy parameters so that they outlive caller's stack frame. */
+static gs_param* _params_dup(const gs_param* params, int count)
+{
+  gsize size = sizeof(gs_param) * count;
+  gs_param* copy;
+  char* strings;
+  int i;
+
+  for (i = 0; i < count; i++)
+    if (params[i].type == 's' && !params[i].is_null)
+      size += strlen(params[i].value.s) + 1;
+
+  copy = g_malloc(size > 0 ? size : 1);
+  memcpy(copy, params, sizeof(gs_param) * count);
+  strings = (char*)(copy + count);
+
+  for (i = 0; i < count; i++)
+  {
+    if (params[i].type == 's' && !params[i].is_null)
+    {
+      gsize len = strlen(params[i].value.s) + 1;
+
+      memcpy(strings, params[i].value.s, len);
+      copy[i].value.s = strings;
+      strings += len;
+    }
+  }
+
+  return copy;
+}
+
+static void _put_async_thread(GTask* task, gpointer source_object G_GNUC_UNUSED, gpointer task_data, GCancellable* cancellable G_GNUC_UNUSED)
+{
+  struct _put_async_data* d = task_data;
+  gs_conn* conn = d->query->conn;
+  int code;
+
+  if (g_task_return_error_if_cancelled(task))
+    return;
+
+  if (_query_put_params(d->query, d->params, d->count) == 0)
+  {
+    g_task_return_int(task, 0);
+    return;
+  }
+
+  // error of shared connection belongs to this thread, pass it to the caller
+  code = gs_get_errcode(conn);
+  g_task_return_new_error(task, GS_TASK_ERROR, code != GS_ERR_NONE ? code : GS_ERR_OTHER, "%s",
+                          gs_get_errmsg(conn) ? gs_get_errmsg(conn) : "Query failed.");
+  gs_clear_error(conn);
+}
+
+void gs_query_put_async(gs_query* query, GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data, const char* fmt, ...)
+{
+  gs_param* params = PARAMS_ALLOCA(fmt);
+  struct _put_async_data* d;
+  GTask* task;
+  va_list ap;
+  int count;
+
+  task = g_task_new(NULL, cancellable, callback, user_data);
+  g_task_set_source_tag(task, gs_query_put_async);
+
+  if (query == NULL || gs_get_errcode(query->conn) != GS_ERR_NONE)
+  {
+    g_task_return_int(task, -1);
+    g_object_unref(task);
+    return;
+  }
+
+  va_start(ap, fmt);
+  count = gs_params_collect(query->conn, fmt, ap, params);
+  va_end(ap);
+
+  if (count < 0)
+  {
+    g_task_return_int(task, -1);
+    g_object_unref(task);
+    return;
+  }
+
+  d = g_new0(struct _put_async_data, 1);
+  d->query = query;
+  d->params = _params_dup(params, count);
+  d->count = count;
+  g_task_set_task_data(task, d, _put_async_data_free);
+
+  // driver completes the query in the main loop, shared connection can't be
+  // locked for that long
+  if (QUERY_DRIVER(query)->query_put_async && !query->conn->thread_safe)
+    QUERY_DRIVER(query)->query_put_async(query, d->params, d->count, task);
+  else
+    g_task_run_in_thread(task, _put_async_thread);
+
+  g_object_unref(task);
+}
+
+int gs_query_put_finish(gs_query* query, GAsyncResult* result)
+{
+  GError* error = NULL;
+  gssize retval;
+
+  g_return_val_if_fail(g_task_is_valid(result, NULL), -1);
+
+  retval = g_task_propagate_int(G_TASK(result), &error);
+  if (error != NULL)
+  {
+    if (query)
+      gs_set_error(query->conn, error->domain == GS_TASK_ERROR ? error->code : GS_ERR_OTHER, error->message);
+    g_error_free(error);
+    return -1;
+  }
+
+  return (int)retval;
+}
+
+void gs_query_free(gs_query* query)
+{
+  gs_conn* conn;
+
+  if (query == NULL)
+    return;
+
+  conn = query->conn;
+  CONN_LOCK(conn);
+  if (!_stmt_cache_put(query))
+    _query_destroy(query);
+  CONN_UNLOCK(conn);
+}
+
+#define TARGETS_COLLECT(targets, plan, ap) \
+  G_STMT_START { \
+    int _i; \
+    targets = g_newa(void*, (plan)->n_slots + 1); \
+    for (_i = 0; _i < (plan)->n_slots; _i++) \
+      targets[_i] = va_arg(ap, void*); \
+  } G_STMT_END
+
+int gs_query_get_planv(gs_query* query, const gs_plan* plan, va_list ap)
+{
+  void** targets;
+  gint64 start;
+  int retval;
+
+  QUERY_RETURN_VAL_IF_INVALID(query, -1);
+  if (plan == NULL)
+    return -1;
+
+  TARGETS_COLLECT(targets, plan, ap);
+  CONN_LOCK(query->conn);
+  start = query->cache_rows ? 0 : CALL_START(query->conn);
+  retval = _query_get_row(query, plan, targets);
+  if (retval == 0)
+    query->fetched_rows++;
+  if (start)
+    _query_timed(query, GS_STATS_FETCH, start, retval < 0, retval == 0);
+  CONN_UNLOCK(query->conn);
+
+  return retval;
+}
+
+int gs_query_getv(gs_query* query, const char* fmt, va_list ap)
+{
+  QUERY_RETURN_VAL_IF_INVALID(query, -1);
+  return gs_query_get_planv(query, _query_plan(query, &query->get_plan, fmt), ap);
+}
+
+/* columnar fetch */
+
+void gs_column_set_null(gs_column_buffer* column, int row)
+{
+  if (column->nulls)
+    column->nulls[row / 8] |= 1 << (row % 8);
+  if (column->type == 'i')
+    column->ints[row] = 0;
+  else
+  {
+    column->offsets[row] = 0;
+    column->lengths[row] = -1;
+  }
+}
+
+void gs_column_set_text(gs_query* query, gs_column_buffer* column, int row, const char* value, int length)
+{
+  column->offsets[row] = query->batch_data->len;
+  column->lengths[row] = length;
+  g_string_append_len(query->batch_data, value, length);
+  g_string_append_c(query->batch_data, '\0');
+}
+
+/* Read rows one by one through "?i?s..." plan of the columns. */
+static int _query_get_batch(gs_query* query, gs_column_buffer* columns, int n_columns, int max_rows)
+{
+  char* fmt = g_newa(char, 2 * n_columns + 1);
+  gs_plan* plan = g_alloca(GS_PLAN_SIZE(2 * n_columns));
+  void** targets = g_newa(void*, 2 * n_columns + 1);
+  int* is_null = g_newa(int, n_columns + 1);
+  int* ints = g_newa(int, n_columns + 1);
+  const char** strs = g_newa(const char*, n_columns + 1);
+  int i, row, rs;
+
+  for (i = 0; i < n_columns; i++)
+  {
+    fmt[2 * i] = '?';
+    fmt[2 * i + 1] = columns[i].type;
+    targets[2 * i] = &is_null[i];
+    targets[2 * i + 1] = columns[i].type == 'i' ? (void*)&ints[i] : (void*)&strs[i];
+  }
+  fmt[2 * n_columns] = '\0';
+  _plan_parse(fmt, plan);
+  plan->fmt = fmt;
+
+  for (row = 0; row < max_rows; row++)
+  {
+    rs = _query_get_row(query, plan, targets);
+    if (rs < 0)
+      return -1;
+    if (rs == 1)
+      break;
+
+    for (i = 0; i < n_columns; i++)
+    {
+      if (is_null[i])
+        gs_column_set_null(columns + i, row);
+      else if (columns[i].type == 'i')
+        columns[i].ints[row] = ints[i];
+      else
+        gs_column_set_text(query, columns + i, row, strs[i], strlen(strs[i]));
+    }
+  }
+
+  return row;
+}
+
+int gs_query_get_batch(gs_query* query, gs_column_buffer* columns, int n_columns, int max_rows)
+{
+  gint64 start;
+  int i, rows;
+
+  QUERY_RETURN_VAL_IF_INVALID(query, -1);
+  if (max_rows <= 0)
+  {
+    gs_set_error(query->conn, GS_ERR_OTHER, "Invalid API use, max_rows must be positive.");
+    return -1;
+  }
+
+  for (i = 0; i < n_columns; i++)
+  {
+    if ((columns[i].type == 'i' && columns[i].ints == NULL) ||
+        (columns[i].type == 's' && (columns[i].offsets == NULL || columns[i].lengths == NULL)) ||
+        (columns[i].type != 'i' && columns[i].type != 's'))
+    {
+      gs_set_error(query->conn, GS_ERR_OTHER, "Invalid batch column.");
+      return -1;
+    }
+    if (columns[i].nulls)
+      memset(columns[i].nulls, 0, (max_rows + 7) / 8);
+  }
+
+  if (query->batch_data == NULL)
+    query->batch_data = g_string_sized_new(4096);
+  else
+    g_string_truncate(query->batch_data, 0);
+
+  CONN_LOCK(query->conn);
+  start = query->cache_rows ? 0 : CALL_START(query->conn);
+  if (QUERY_DRIVER(query)->query_get_batch && query->cache_rows == NULL)
+    rows = QUERY_DRIVER(query)->query_get_batch(query, columns, n_columns, max_rows);
+  else
+    rows = _query_get_batch(query, columns, n_columns, max_rows);
+  query->fetched_rows += MAX(rows, 0);
+  if (start)
+    _query_timed(query, GS_STATS_FETCH, start, rows < 0, MAX(rows, 0));
+  CONN_UNLOCK(query->conn);
+  if (rows < 0)
+    return -1;
+
+  for (i = 0; i < n_columns; i++)
+    if (columns[i].type == 's')
+      columns[i].data = query->batch_data->str;
+
+  return rows;
+}
+
+int gs_query_get_plan(gs_query* query, const gs_plan* plan, ...)
+{
+  int retval;
+  va_list ap;
+
+  va_start(ap, plan);
+  retval = gs_query_get_planv(query, plan, ap);
+  va_end(ap);
+
+  return retval;
+}
+
+int gs_query_get(gs_query* query, const char* fmt, ...)
+{
+  int retval;
+  va_list ap;
+
+  va_start(ap, fmt);
+  retval = gs_query_getv(query, fmt, ap);
+  va_end(ap);
+
+  return retval;
+}
+
+int gs_query_set_result_mode(gs_query* query, int mode)
+{
+  QUERY_RETURN_VAL_IF_INVALID(query, -1);
+  if (mode == query->result_mode)
+    return 0;
+  if (QUERY_DRIVER(query)->query_set_result_mode == NULL)
+    return -1;
+  if (QUERY_DRIVER(query)->query_set_result_mode(query, mode) < 0)
+    return -1;
+  query->result_mode = mode;
+  return 0;
+}
+
+int gs_query_set_fetch_size(gs_query* query, int rows)
+{
+  QUERY_RETURN_VAL_IF_INVALID(query, -1);
+  if (rows < 0)
+    return -1;
+  query->fetch_size = rows;
+  return 0;
+}
+
+int gs_query_get_rows(gs_query* query)
+{
+  int retval;
+
+  QUERY_RETURN_VAL_IF_INVALID(query, -1);
+  CONN_LOCK(query->conn);
+  if (query->cache_rows)
+    retval = query->cache_rows->n_rows;
+  else
+    retval = QUERY_DRIVER(query)->query_get_rows(query);
+  CONN_UNLOCK(query->conn);
+
+  return retval;
+}
+
+int gs_query_get_last_id(gs_query* query, const char* seq_name)
+{
+  return (int)gs_query_get_last_id64(query, seq_name);
+}
+
+gint64 gs_query_get_last_id64(gs_query* query, const char* seq_name)
+{
+  gint64 retval;
+
+  QUERY_RETURN_VAL_IF_INVALID(query, -1);
+  // last ID is per connection, of shared connection it is only meaningful
+  // inside transaction
+  CONN_LOCK(query->conn);
+  retval = QUERY_DRIVER(query)->query_get_last_id(query, seq_name);
+  CONN_UNLOCK(query->conn);
+
+  return retval;
+}
+
+/* timestamps */
+
+#define USEC_PER_DAY G_GINT64_CONSTANT(86400000000)
+
+/* Days since 1970-01-01 of the proleptic Gregorian date. */
+static gint64 _days_from_civil(int year, int month, int day)
+{
+  gint64 era, yoe, doy, doe;
+
+  year -= month <= 2;
+  era = (year >= 0 ? year : year - 399) / 400;
+  yoe = year - era * 400;
+  doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+void gs_time_split(gint64 usec, gs_time* tm)
+{
+  gint64 days = usec / USEC_PER_DAY;
+  gint64 rem = usec % USEC_PER_DAY;
+  gint64 era, doe, yoe, doy, mp;
+
+  if (rem < 0)
+  {
+    rem += USEC_PER_DAY;
+    days--;
+  }
+
+  days += 719468;
+  era = (days >= 0 ? days : days - 146096) / 146097;
+  doe = days - era * 146097;
+  yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  mp = (5 * doy + 2) / 153;
+  tm->day = doy - (153 * mp + 2) / 5 + 1;
+  tm->month = mp < 10 ? mp + 3 : mp - 9;
+  tm->year = yoe + era * 400 + (tm->month <= 2);
+
+  tm->usec = rem % G_USEC_PER_SEC;
+  rem /= G_USEC_PER_SEC;
+  tm->second = rem % 60;
+  tm->minute = rem / 60 % 60;
+  tm->hour = rem / 3600;
+}
+
+gint64 gs_time_join(const gs_time* tm)
+{
+  return _days_from_civil(tm->year, tm->month, tm->day) * USEC_PER_DAY +
+         ((tm->hour * 60 + tm->minute) * (gint64)60 + tm->second) * G_USEC_PER_SEC + tm->usec;
+}
+
+/* Parse exactly n digits. */
+static int _time_digits(const char** str, int n, int* value)
+{
+  *value = 0;
+  for (; n > 0; n--, (*str)++)
+  {
+    if (!g_ascii_isdigit(**str))
+      return -1;
+    *value = *value * 10 + (**str - '0');
+  }
+  return 0;
+}
+
+/* Parse "YYYY-MM-DD[ HH:MM[:SS[.ffffff]]][Z|+HH[:MM]]" as produced by
+ * databases in ISO style. Time without zone is taken as UTC.
+ */
+int gs_time_parse(const char* str, gint64* usec)
+{
+  gs_time tm = { 0 };
+  int zone = 0, tz_hour, tz_minute = 0;
+
+  if (_time_digits(&str, 4, &tm.year) < 0 || *str++ != '-' ||
+      _time_digits(&str, 2, &tm.month) < 0 || *str++ != '-' ||
+      _time_digits(&str, 2, &tm.day) < 0)
+    return -1;
+
+  if (*str == ' ' || *str == 'T')
+  {
+    str++;
+    if (_time_digits(&str, 2, &tm.hour) < 0 || *str++ != ':' ||
+        _time_digits(&str, 2, &tm.minute) < 0)
+      return -1;
+    if (*str == ':')
+    {
+      str++;
+      if (_time_digits(&str, 2, &tm.second) < 0)
+        return -1;
+      if (*str == '.')
+      {
+        int scale = 100000;
+
+        for (str++; g_ascii_isdigit(*str); str++, scale /= 10)
+          tm.usec += (*str - '0') * scale;
+      }
+    }
+  }
+
+  if (*str == 'Z')
+    str++;
+  else if (*str == '+' || *str == '-')
+  {
+    int sign = *str++ == '-' ? -1 : 1;
+
+    if (_time_digits(&str, 2, &tz_hour) < 0)
+      return -1;
+    if (*str == ':')
+      str++;
+    if (g_ascii_isdigit(*str) && _time_digits(&str, 2, &tz_minute) < 0)
+      return -1;
+    zone = sign * (tz_hour * 60 + tz_minute);
+  }
+
+  if (*str != '\0' || tm.month < 1 || tm.month > 12 || tm.day < 1 || tm.day > 31 ||
+      tm.hour > 24 || tm.minute > 59 || tm.second > 60)
+    return -1;
+
+  *usec = gs_time_join(&tm) - zone * 60 * (gint64)G_USEC_PER_SEC;
+  return 0;
+}
+
+/* Format as "YYYY-MM-DD HH:MM:SS.ffffff+00", buf must have room for
+ * GS_TIME_BUF bytes.
+ */
+void gs_time_format(gint64 usec, char* buf)
+{
+  gs_time tm;
+
+  gs_time_split(usec, &tm);
+  g_snprintf(buf, GS_TIME_BUF, "%04d-%02d-%02d %02d:%02d:%02d.%06d+00",
+             tm.year, tm.month, tm.day, tm.hour, tm.minute, tm.second, tm.usec);
+}
+
+/* helper functions */
+
+int gs_exec(gs_conn* conn, const char* sql_string, const char* fmt, ...)
+{
+  int retval;
+  va_list ap;
+  gs_query* query;
+
+  query = gs_query_new(conn, sql_string);
+  if (!query)
+    return -1;
+
+  va_start(ap, fmt);
+  retval = gs_query_putv(query, fmt, ap);
+  va_end(ap);
+
+  gs_query_free(query);
+
+  return retval;
+}
+
+/* Like transaction, batch keeps the connection locked until gs_batch_flush(). */
+int gs_batch_begin(gs_conn* conn)
+{
+  CONN_RETURN_VAL_IF_INVALID(conn, -1);
+  CONN_LOCK(conn);
+  if (conn->batch_active)
+  {
+    gs_set_error(conn, GS_ERR_OTHER, "Invalid API use, batch was already started.");
+    CONN_UNLOCK(conn);
+    return -1;
+  }
+
+  conn->batch_count = 0;
+  conn->batch_error_index = -1;
+  if (CONN_DRIVER(conn)->batch_begin && CONN_DRIVER(conn)->batch_begin(conn) < 0)
+  {
+    CONN_UNLOCK(conn);
+    return -1;
+  }
+  conn->batch_active = TRUE;
+  return 0;
+}
+
+int gs_batch_addv(gs_conn* conn, const char* sql_string, const char* fmt, va_list ap)
+{
+  gs_param* params = PARAMS_ALLOCA(fmt);
+  int retval;
+  int index, count;
+  gs_query* query;
+
+  CONN_RETURN_VAL_IF_INVALID(conn, -1);
+  CONN_LOCK(conn);
+  if (!conn->batch_active)
+  {
+    gs_set_error(conn, GS_ERR_OTHER, "Invalid API use, call gs_batch_begin() before gs_batch_add().");
+    CONN_UNLOCK(conn);
+    return -1;
+  }
+
+  index = conn->batch_count++;
+  count = gs_params_collect(conn, fmt, ap, params);
+  if (count < 0)
+    retval = -1;
+  else if (CONN_DRIVER(conn)->batch_add_params)
+    retval = CONN_DRIVER(conn)->batch_add_params(conn, sql_string, params, count);
+  else
+  {
+    query = gs_query_new(conn, sql_string);
+    retval = query ? QUERY_DRIVER(query)->query_put_params(query, params, count) : -1;
+    gs_query_free(query);
+  }
+
+  if (retval < 0 && conn->batch_error_index < 0)
+    conn->batch_error_index = index;
+
+  if (conn->result_cache)
+  {
+    char** reads, ** writes;
+
+    gs_sql_tables(sql_string, &reads, &writes);
+    _conn_cache_written(conn, writes);
+    g_strfreev(reads);
+    g_strfreev(writes);
+  }
+  CONN_UNLOCK(conn);
+  return retval;
+}
+
+int gs_batch_add(gs_conn* conn, const char* sql_string, const char* fmt, ...)
+{
+  int retval;
+  va_list ap;
+
+  va_start(ap, fmt);
+  retval = gs_batch_addv(conn, sql_string, fmt, ap);
+  va_end(ap);
+
+  return retval;
+}
+
+int gs_batch_flush(gs_conn* conn)
+{
+  int retval = 0;
+
+  if (conn == NULL)
+    return -1;
+  CONN_LOCK(conn);
+  if (!conn->batch_active)
+  {
+    CONN_UNLOCK(conn);
+    return -1;
+  }
+
+  // driver must leave batch mode even if error was already set
+  if (CONN_DRIVER(conn)->batch_flush)
+    retval = CONN_DRIVER(conn)->batch_flush(conn);
+  conn->batch_active = FALSE;
+  CONN_UNLOCK(conn);
+  CONN_UNLOCK(conn);
+
+  if (gs_get_errcode(conn) != GS_ERR_NONE)
+    retval = -1;
+  return retval;
+}
+
+int gs_batch_get_error_index(gs_conn* conn)
+{
+  if (conn == NULL)
+    return -1;
+  return conn->batch_error_index;
+}
+
+/* bulk load */
+
+#define COPY_DRIVER(c) \
+  c->conn->driver
+
+static void _copy_abort(gs_copy* copy);
+
+static gs_copy* _copy_in_new_insert(gs_conn* conn, const char* table, const char* columns)
+{
+  GString* sql;
+  gs_copy* copy;
+  int i, n_columns = 1;
+
+  for (i = 0; columns[i]; i++)
+    if (columns[i] == ',')
+      n_columns++;
+
+  sql = g_string_new(NULL);
+  g_string_append_printf(sql, "INSERT INTO %s (%s) VALUES (", table, columns);
+  for (i = 1; i <= n_columns; i++)
+    g_string_append_printf(sql, i > 1 ? ", $%d" : "$%d", i);
+  g_string_append_c(sql, ')');
+
+  copy = g_new0(gs_copy, 1);
+  copy->conn = conn;
+  if (!conn->in_transaction)
+  {
+    if (gs_begin(conn) < 0)
+    {
+      g_string_free(sql, TRUE);
+      g_free(copy);
+      return NULL;
+    }
+    copy->own_transaction = TRUE;
+  }
+
+  copy->query = gs_query_new(conn, sql->str);
+  g_string_free(sql, TRUE);
+  if (copy->query == NULL)
+  {
+    _copy_abort(copy);
+    return NULL;
+  }
+
+  return copy;
+}
+
+/* COPY keeps the connection locked until it is finished or aborted. */
+gs_copy* gs_copy_in_new(gs_conn* conn, const char* table, const char* columns)
+{
+  gs_copy* copy;
+
+  CONN_RETURN_VAL_IF_INVALID(conn, NULL);
+  if (table == NULL || columns == NULL)
+  {
+    gs_set_error(conn, GS_ERR_OTHER, "Invalid API use, table and columns must be given.");
+    return NULL;
+  }
+
+  CONN_LOCK(conn);
+  if (CONN_DRIVER(conn)->copy_in_new)
+    copy = CONN_DRIVER(conn)->copy_in_new(conn, table, columns);
+  else
+    copy = _copy_in_new_insert(conn, table, columns);
+  if (copy == NULL)
+    CONN_UNLOCK(conn);
+  else if (conn->result_cache)
+    copy->table = g_strdup(table);
+
+  return copy;
+}
+
+int gs_copy_putv(gs_copy* copy, const char* fmt, va_list ap)
+{
+  gs_param* params = PARAMS_ALLOCA(fmt);
+  int count;
+
+  if (copy == NULL)
+    return -1;
+  CONN_RETURN_VAL_IF_INVALID(copy->conn, -1);
+
+  if (copy->query)
+    return gs_query_putv(copy->query, fmt, ap);
+
+  count = gs_params_collect(copy->conn, fmt, ap, params);
+  if (count < 0)
+    return -1;
+  return COPY_DRIVER(copy)->copy_put_params(copy, params, count);
+}
+
+int gs_copy_put(gs_copy* copy, const char* fmt, ...)
+{
+  int retval;
+  va_list ap;
+
+  va_start(ap, fmt);
+  retval = gs_copy_putv(copy, fmt, ap);
+  va_end(ap);
+
+  return retval;
+}
+
+int gs_copy_finish(gs_copy* copy)
+{
+  char* tables[2] = { NULL, NULL };
+  gs_conn* conn;
+  int retval;
+
+  if (copy == NULL)
+    return -1;
+
+  conn = copy->conn;
+  if (gs_get_errcode(conn) != GS_ERR_NONE)
+  {
+    gs_copy_abort(copy);
+    return -1;
+  }
+
+  // copy is freed by the driver
+  tables[0] = copy->table;
+  copy->table = NULL;
+  if (copy->query == NULL)
+    retval = COPY_DRIVER(copy)->copy_finish(copy);
+  else
+  {
+    gs_query_free(copy->query);
+    retval = copy->own_transaction ? gs_commit(conn) : 0;
+    g_free(copy);
+  }
+  _conn_cache_written(conn, tables);
+  g_free(tables[0]);
+
+  // taken by gs_copy_in_new() or gs_copy_out_new()
+  CONN_UNLOCK(conn);
+  return retval;
+}
+
+gs_copy* gs_copy_out_new(gs_conn* conn, const char* sql_string)
+{
+  gs_copy* copy;
+
+  CONN_RETURN_VAL_IF_INVALID(conn, NULL);
+
+  CONN_LOCK(conn);
+  if (CONN_DRIVER(conn)->copy_out_new)
+  {
+    copy = CONN_DRIVER(conn)->copy_out_new(conn, sql_string);
+    if (copy == NULL)
+      CONN_UNLOCK(conn);
+    return copy;
+  }
+
+  copy = g_new0(gs_copy, 1);
+  copy->conn = conn;
+  copy->query = gs_query_new(conn, sql_string);
+  if (copy->query == NULL || gs_query_put(copy->query, NULL) < 0)
+  {
+    _copy_abort(copy);
+    CONN_UNLOCK(conn);
+    return NULL;
+  }
+
+  return copy;
+}
+
+int gs_copy_getv(gs_copy* copy, const char* fmt, va_list ap)
+{
+  gs_plan* plan;
+  void** targets;
+
+  if (copy == NULL)
+    return -1;
+  CONN_RETURN_VAL_IF_INVALID(copy->conn, -1);
+
+  if (copy->query)
+    return gs_query_getv(copy->query, fmt, ap);
+
+  plan = g_alloca(GS_PLAN_SIZE(fmt != NULL ? strlen(fmt) : 0));
+  if (_plan_parse(fmt, plan) < 0)
+  {
+    gs_set_error(copy->conn, GS_ERR_OTHER, "Invalid format string.");
+    return -1;
+  }
+  TARGETS_COLLECT(targets, plan, ap);
+  return COPY_DRIVER(copy)->copy_get_plan(copy, plan, targets);
+}
+
+int gs_copy_get(gs_copy* copy, const char* fmt, ...)
+{
+  int retval;
+  va_list ap;
+
+  va_start(ap, fmt);
+  retval = gs_copy_getv(copy, fmt, ap);
+  va_end(ap);
+
+  return retval;
+}
+
+int gs_copy_out(gs_conn* conn, const char* sql_string, gs_copy_out_func func, gpointer user_data)
+{
+  int retval;
+
+  CONN_RETURN_VAL_IF_INVALID(conn, -1);
+
+  if (CONN_DRIVER(conn)->copy_out == NULL)
+  {
+    gs_set_error(conn, GS_ERR_OTHER, "COPY TO is not supported by this backend.");
+    return -1;
+  }
+
+  CONN_LOCK(conn);
+  retval = CONN_DRIVER(conn)->copy_out(conn, sql_string, func, user_data);
+  CONN_UNLOCK(conn);
+
+  return retval;
+}
+
+struct _copy_out_stream
+{
+  GOutputStream* stream;
+  GCancellable* cancellable;
+  GError* error;
+};
+
+static int _copy_out_stream_write(const char* data, int length, gpointer user_data)
+{
+  struct _copy_out_stream* out = user_data;
+
+  if (!g_output_stream_write_all(out->stream, data, length, NULL, out->cancellable, &out->error))
+    return -1;
+
+  return 0;
+}
+
+int gs_copy_out_stream(gs_conn* conn, const char* sql_string, GOutputStream* stream, GCancellable* cancellable)
+{
+  struct _copy_out_stream out = { stream, cancellable, NULL };
+  int retval;
+
+  CONN_RETURN_VAL_IF_INVALID(conn, -1);
+  g_return_val_if_fail(G_IS_OUTPUT_STREAM(stream), -1);
+
+  retval = gs_copy_out(conn, sql_string, _copy_out_stream_write, &out);
+  if (out.error)
+  {
+    gs_set_error(conn, GS_ERR_OTHER, out.error->message);
+    g_error_free(out.error);
+  }
+
+  return retval;
+}
+
+static void _copy_abort(gs_copy* copy)
+{
+  g_free(copy->table);
+  copy->table = NULL;
+  if (copy->query == NULL && COPY_DRIVER(copy)->copy_abort)
+  {
+    COPY_DRIVER(copy)->copy_abort(copy);
+    return;
+  }
+
+  gs_query_free(copy->query);
+  if (copy->own_transaction)
+    gs_rollback(copy->conn);
+  g_free(copy);
+}
+
+void gs_copy_abort(gs_copy* copy)
+{
+  gs_conn* conn;
+
+  if (copy == NULL)
+    return;
+
+  conn = copy->conn;
+  _copy_abort(copy);
+  CONN_UNLOCK(conn);
+}
+
+/* snapshots */
+
+#define SNAPSHOT_STEP_PAGES 256
+
+static int _snapshot_copy(gs_conn* conn, const char* path, gboolean save, GCancellable* cancellable)
+{
+  gs_snapshot* snapshot;
+  int rs = 0;
+
+  CONN_RETURN_VAL_IF_INVALID(conn, -1);
+  if (path == NULL)
+  {
+    gs_set_error(conn, GS_ERR_OTHER, "Invalid API use, snapshot path must be given.");
+    return -1;
+  }
+  if (CONN_DRIVER(conn)->snapshot_new == NULL)
+  {
+    gs_set_error(conn, GS_ERR_OTHER, "Snapshots are not supported by this backend.");
+    return -1;
+  }
+
+  CONN_LOCK(conn);
+  snapshot = CONN_DRIVER(conn)->snapshot_new(conn, path, save);
+  CONN_UNLOCK(conn);
+  if (snapshot == NULL)
+    return -1;
+
+  // connection is released between steps of save, loaded database must not
+  // be seen half copied
+  while (rs == 0)
+  {
+    if (g_cancellable_is_cancelled(cancellable))
+    {
+      gs_set_error(conn, GS_ERR_OTHER, "Snapshot was cancelled.");
+      rs = -1;
+      break;
+    }
+    CONN_LOCK(conn);
+    rs = CONN_DRIVER(conn)->snapshot_step(snapshot, save ? SNAPSHOT_STEP_PAGES : -1);
+    CONN_UNLOCK(conn);
+  }
+
+  CONN_LOCK(conn);
+  CONN_DRIVER(conn)->snapshot_free(snapshot);
+  CONN_UNLOCK(conn);
+
+  return rs < 0 ? -1 : 0;
+}
+
+int gs_snapshot_load(gs_conn* conn, const char* path)
+{
+  return _snapshot_copy(conn, path, FALSE, NULL);
+}
+
+int gs_snapshot_save(gs_conn* conn, const char* path)
+{
+  return _snapshot_copy(conn, path, TRUE, NULL);
+}
+
+struct _snapshot_async_data
+{
+  gs_conn* conn;
+  char* path;
+};
+
+static void _snapshot_async_data_free(gpointer data)
+{
+  struct _snapshot_async_data* d = data;
+
+  g_free(d->path);
+  g_free(d);
+}
+
+static void _snapshot_save_thread(GTask* task, gpointer source_object G_GNUC_UNUSED, gpointer task_data, GCancellable* cancellable)
+{
+  struct _snapshot_async_data* d = task_data;
+
+  if (_snapshot_copy(d->conn, d->path, TRUE, cancellable) == 0)
+  {
+    g_task_return_int(task, 0);
+    return;
+  }
+
+  // error of shared connection belongs to this thread, pass it to the caller
+  g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED, "%s", gs_get_errmsg(d->conn));
+  gs_clear_error(d->conn);
+}
+
+void gs_snapshot_save_async(gs_conn* conn, const char* path, GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data)
+{
+  struct _snapshot_async_data* d;
+  GTask* task;
+
+  task = g_task_new(NULL, cancellable, callback, user_data);
+  g_task_set_source_tag(task, gs_snapshot_save_async);
+
+  if (conn == NULL || gs_get_errcode(conn) != GS_ERR_NONE)
+  {
+    g_task_return_int(task, -1);
+    g_object_unref(task);
+    return;
+  }
+
+  d = g_new0(struct _snapshot_async_data, 1);
+  d->conn = conn;
+  d->path = g_strdup(path);
+  g_task_set_task_data(task, d, _snapshot_async_data_free);
+  g_task_run_in_thread(task, _snapshot_save_thread);
+  g_object_unref(task);
+}
+
+int gs_snapshot_save_finish(gs_conn* conn, GAsyncResult* result)
+{
+  GError* error = NULL;
+  gssize retval;
+
+  g_return_val_if_fail(g_task_is_valid(result, NULL), -1);
+
+  retval = g_task_propagate_int(G_TASK(result), &error);
+  if (error != NULL)
+  {
+    if (conn)
+      gs_set_error(conn, GS_ERR_OTHER, error->message);
+    g_error_free(error);
+    return -1;
+  }
+
+  return (int)retval;
 }
 
 int gs_finish(gs_conn* conn)
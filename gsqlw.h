@@ -22,6 +22,7 @@
 #define __GSW_H__
 
 #include <glib.h>
+#include <gio/gio.h>
 
 /** @file gsqlw.h Glib based SQL DB C interface wrapper.
  */
@@ -31,6 +32,20 @@
 
 typedef struct _gs_conn gs_conn;
 typedef struct _gs_query gs_query;
+typedef struct _gs_pool gs_pool;
+typedef struct _gs_copy gs_copy;
+typedef struct _gs_plan gs_plan;
+typedef struct _gs_array_column gs_array_column;
+typedef struct _gs_column_buffer gs_column_buffer;
+typedef struct _gs_stats gs_stats;
+typedef struct _gs_slow_query gs_slow_query;
+typedef struct _gs_result_cache gs_result_cache;
+
+/** Callback receiving chunks of COPY output, see gs_copy_out().
+ *
+ * @return 0 to continue, -1 to stop copying.
+ */
+typedef int (*gs_copy_out_func)(const char* data, int length, gpointer user_data);
 
 enum _gs_errors
 {
@@ -40,6 +55,86 @@ enum _gs_errors
   GS_ERR_NOT_NULL_VIOLATION
 };
 
+enum _gs_result_modes
+{
+  GS_RESULT_DEFAULT = 0,    // whole result is available after gs_query_put()
+  GS_RESULT_STREAMING,      // rows are fetched incrementally by gs_query_get()
+  GS_RESULT_BUFFERED        // whole result is copied to client memory by gs_query_put()
+};
+
+/** Column of parameter values for gs_query_put_array(). */
+struct _gs_array_column
+{
+  char type;                // 's' or 'i'
+  const void* values;       // const char** or const int* array with value for each row
+  const guint8* nulls;      // optional, bit (row % 8) of byte (row / 8) is set for NULL
+};
+
+/** Column of rows filled by gs_query_get_batch(). */
+struct _gs_column_buffer
+{
+  char type;                // 'i' or 's'
+  gint32* ints;             // 'i': value of each row, 0 for NULL
+  int* offsets;             // 's': position of each value in data
+  int* lengths;             // 's': length of each value, -1 for NULL
+  guint8* nulls;            // optional, bit (row % 8) of byte (row / 8) is set for NULL
+  const char* data;         // 's': set by gs_query_get_batch(), values are NUL terminated
+};
+
+/** Phases of statement execution measured by gs_get_stats(). */
+enum _gs_stats_phases
+{
+  GS_STATS_PREPARE = 0,     // gs_query_new() that prepared new statement
+  GS_STATS_EXECUTE,         // gs_query_put() and gs_query_put_array()
+  GS_STATS_FETCH,           // gs_query_get() and gs_query_get_batch()
+  GS_STATS_PHASES
+};
+
+/** Number of latency histogram buckets. Bucket 0 counts calls shorter than
+ * 1us, bucket i calls of 2^(i-1) to 2^i - 1 us, the last one also all longer
+ * calls. */
+#define GS_STATS_BUCKETS 32
+
+/** Number of error codes counted by gs_get_stats(), see enum _gs_errors. */
+#define GS_STATS_ERRORS 4
+
+/** Statistics of one statement, see gs_get_stats(). */
+struct _gs_stats
+{
+  char* sql;                // SQL text with literals replaced by '?'
+  guint64 calls;            // executions
+  guint64 rows;             // rows fetched
+  guint64 errors[GS_STATS_ERRORS]; // failed calls of any phase by error code
+  guint64 count[GS_STATS_PHASES]; // calls of each phase
+  guint64 total_usec[GS_STATS_PHASES];
+  guint64 max_usec[GS_STATS_PHASES];
+  guint64 histogram[GS_STATS_PHASES][GS_STATS_BUCKETS];
+};
+
+/** Returned by gs_query_get_rows() when number of rows is not known. */
+#define GS_ROWS_UNKNOWN -2
+
+/** Slow statement passed to gs_slow_query_func. */
+struct _gs_slow_query
+{
+  const char* sql;          // SQL text given to gs_query_new()
+  const char* const* params; // parameters of the last gs_query_put() as text, NULL for SQL NULL
+  int n_params;
+  gint64 elapsed_usec;      // duration of the slow call
+  int phase;                // GS_STATS_EXECUTE or GS_STATS_FETCH
+  int failed;               // the call returned error
+  int rows;                 // rows of the result after gs_query_put(), rows
+                            // read so far after gs_query_get(), or GS_ROWS_UNKNOWN
+  const char* plan;         // output of EXPLAIN, NULL if not captured
+};
+
+/** Callback reporting slow statements, see gs_set_slow_query_handler().
+ *
+ * Called with the connection locked in thread-safe mode, it must not use the
+ * query that was slow. Data of the report are valid only during the call.
+ */
+typedef void (*gs_slow_query_func)(gs_conn* conn, const gs_slow_query* slow, gpointer user_data);
+
 G_BEGIN_DECLS
 
 /** Create connection to the database.
@@ -48,8 +143,30 @@ G_BEGIN_DECLS
  * by a colon. First part specifies backend that should be used and second part
  * backend specific "connection" setup. Currently there are two supported backends:
  * @li sqlite:file_path
+ * @li sqlite:file_path?journal_mode=wal&synchronous=normal&cache_size=-65536
  * @li pgsql:dbname=test host=localhost user=postgres password=pass
  *
+ * sqlite options are journal_mode, synchronous, mmap_size, cache_size and
+ * temp_store (applied as PRAGMAs), busy_timeout in milliseconds (10000 by
+ * default) and mode (ro, rw or rwc, default is rwc).
+ *
+ * sqlite:file: URIs are passed to sqlite with their vfs, mode, cache, psow,
+ * nolock and immutable parameters, for example
+ * sqlite:file:lookup?mode=memory&cache=shared opens in-memory database shared
+ * by all connections of the process that use the same name, sqlite::memory:
+ * opens private one.
+ *
+ * With single_writer=on connections to the same file in the process share
+ * one writer in WAL mode and read through their own read-only handle.
+ * Statements that modify the database and whole transactions run on the
+ * writer, one connection at a time, other connections wait for it instead of
+ * retrying on a busy database. Read statements outside of transaction never
+ * wait for the writer and see committed data. Use gs_pool_new() with this DSN
+ * for one writer and a pool of readers. Writer is held by the connection, its
+ * transaction may be committed from other thread. Thread that holds the
+ * writer through one connection must release it before writing through
+ * another one, the second one fails instead of waiting for itself.
+ *
  * @return gs_conn object is always returned, user must check for connection
  * error using gs_get_errcode().
  */
@@ -115,6 +232,231 @@ void gs_set_error(gs_conn* conn, int code, const char* msg);
  */
 void gs_clear_error(gs_conn* conn);
 
+/** Set maximum number of prepared statements kept by the connection.
+ *
+ * Freed queries are not finalized immediately but kept in per-connection LRU
+ * cache keyed by their SQL text. gs_query_new() (and so gs_exec()) then reuses
+ * already prepared statement instead of preparing it again. Cache is enabled
+ * by default.
+ *
+ * @param conn DB connection object.
+ * @param size Maximum number of cached statements, 0 disables the cache.
+ */
+void gs_set_stmt_cache_size(gs_conn* conn, int size);
+
+/** Get prepared statement cache counters.
+ *
+ * @param conn DB connection object.
+ * @param hits Where to store number of gs_query_new() calls served from cache.
+ * @param misses Where to store number of gs_query_new() calls that had to
+ * prepare new statement.
+ */
+void gs_get_stmt_cache_stats(gs_conn* conn, guint64* hits, guint64* misses);
+
+/** Create cache of query results.
+ *
+ * Cache may be shared by connections to the same database (and by a pool of
+ * connections), see gs_set_result_cache(). Numbers and timestamps are
+ * decoded once when the result is stored. Result of a query that ran while
+ * its tables were written by other connection is not stored.
+ *
+ * @param max_bytes Memory budget, least recently used results are evicted
+ * when it is exceeded.
+ *
+ * @return gs_result_cache object.
+ */
+gs_result_cache* gs_result_cache_new(gsize max_bytes);
+
+/** Free result cache.
+ *
+ * Cache must not be used by any connection or pool.
+ *
+ * @param cache Result cache object.
+ */
+void gs_result_cache_free(gs_result_cache* cache);
+
+/** Drop all cached results.
+ *
+ * @param cache Result cache object.
+ */
+void gs_result_cache_clear(gs_result_cache* cache);
+
+/** Get result cache counters.
+ *
+ * @param cache Result cache object.
+ * @param hits Where to store number of executions served from cache.
+ * @param misses Where to store number of executions of cached queries that
+ * had to run on the server.
+ * @param size Where to store memory used by cached results.
+ */
+void gs_result_cache_get_stats(gs_result_cache* cache, guint64* hits, guint64* misses, gsize* size);
+
+/** Use result cache for queries of the connection.
+ *
+ * Results of queries with TTL set by gs_query_set_cache_ttl() are cached
+ * under their SQL text and parameter values. Cached result is dropped when
+ * INSERT, UPDATE, DELETE or another write statement executed through any
+ * connection using the cache modifies table the result was read from, and
+ * again when transaction with such statement is committed. Writes done
+ * outside of the cache users are only reflected after TTL expires. Inside
+ * transaction the cache is bypassed.
+ *
+ * @param conn DB connection object.
+ * @param cache Result cache object, NULL disables caching.
+ */
+void gs_set_result_cache(gs_conn* conn, gs_result_cache* cache);
+
+/** Cache results of the query.
+ *
+ * Must be called before gs_query_put(). Only GS_RESULT_DEFAULT queries are
+ * cached. Queries taken from the prepared statement cache start with caching
+ * disabled.
+ *
+ * @param query Query object.
+ * @param ttl_ms How long is the result valid in milliseconds, 0 disables
+ * caching (default).
+ *
+ * @return -1 on error, 0 on success.
+ */
+int gs_query_set_cache_ttl(gs_query* query, int ttl_ms);
+
+/** Load database from a file.
+ *
+ * Whole database of the connection is replaced by the content of the file,
+ * typically to pull a file into in-memory database (sqlite::memory: or
+ * shared sqlite:file:name?mode=memory&cache=shared) at startup. Only sqlite
+ * backend supports snapshots.
+ *
+ * @param conn DB connection object.
+ * @param path Database file.
+ *
+ * @return -1 on error, 0 on success.
+ */
+int gs_snapshot_load(gs_conn* conn, const char* path);
+
+/** Save database to a file.
+ *
+ * Database is copied by small steps, in thread-safe mode (see
+ * gs_set_thread_safe()) other threads may use the connection in between.
+ * Readers of the file see its previous content until the copy is complete.
+ * Copy starts over if the database is modified through another connection
+ * meanwhile.
+ *
+ * @param conn DB connection object.
+ * @param path Database file, created if it does not exist.
+ *
+ * @return -1 on error, 0 on success.
+ */
+int gs_snapshot_save(gs_conn* conn, const char* path);
+
+/** Save database to a file in a worker thread.
+ *
+ * Connection must be in thread-safe mode if it is used before the callback
+ * is invoked in the thread-default main context of the caller.
+ *
+ * @param conn DB connection object.
+ * @param path Database file.
+ * @param cancellable Optional GCancellable, cancelling it stops the copy.
+ * @param callback Called when the snapshot is saved.
+ * @param user_data Data passed to the callback.
+ */
+void gs_snapshot_save_async(gs_conn* conn, const char* path, GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data);
+
+/** Finish snapshot started by gs_snapshot_save_async().
+ *
+ * @param conn DB connection object.
+ * @param result GAsyncResult passed to the callback.
+ *
+ * @return -1 on error (including cancellation), 0 on success.
+ */
+int gs_snapshot_save_finish(gs_conn* conn, GAsyncResult* result);
+
+/** Report statements that run longer than given time.
+ *
+ * Callback is called after gs_query_put() (or gs_query_put_array()) or single
+ * gs_query_get() (or gs_query_get_batch()) call that took at least
+ * threshold_us microseconds. Parameters of each execution are copied while
+ * the handler is set.
+ *
+ * @param conn DB connection object.
+ * @param threshold_us Minimal reported duration in microseconds.
+ * @param func Callback, NULL disables reporting.
+ * @param user_data Data passed to callback.
+ */
+void gs_set_slow_query_handler(gs_conn* conn, gint64 threshold_us, gs_slow_query_func func, gpointer user_data);
+
+/** Capture query plan of reported slow statements.
+ *
+ * Successful SELECT, INSERT, UPDATE, DELETE and WITH statements are explained
+ * on the same connection with the same parameters (EXPLAIN on pgsql, EXPLAIN
+ * FORMAT=JSON on mysql, EXPLAIN QUERY PLAN on sqlite) before the handler is
+ * called. Inside transaction the EXPLAIN runs in a savepoint, so that its
+ * failure does not abort the transaction. Streaming queries and batches are
+ * not explained.
+ *
+ * @param conn DB connection object.
+ * @param enabled TRUE to capture plans (disabled by default).
+ */
+void gs_set_slow_query_explain(gs_conn* conn, gboolean enabled);
+
+/** Enable collection of per-statement statistics.
+ *
+ * Calls are counted by the calling thread without locking shared state, so
+ * statistics are cheap enough to be left enabled. Backends that prepare
+ * statements lazily (pgsql) report prepare time as part of execution.
+ *
+ * @param conn DB connection object, NULL sets default for connections
+ * created later.
+ * @param enabled TRUE to collect statistics (disabled by default).
+ */
+void gs_set_stats_enabled(gs_conn* conn, gboolean enabled);
+
+/** Get statistics of statements grouped by their SQL text.
+ *
+ * Statements that differ only in literal values are counted together.
+ * Counters of disconnected connections are kept in process-wide statistics.
+ *
+ * @param conn DB connection object, NULL for process-wide statistics.
+ * @param n_stats Where to store number of returned items.
+ *
+ * @return Array of statistics sorted by total time, free it using
+ * gs_stats_free().
+ */
+gs_stats* gs_get_stats(gs_conn* conn, int* n_stats);
+
+/** Reset statistics.
+ *
+ * @param conn DB connection object, NULL resets statistics of all
+ * connections.
+ */
+void gs_reset_stats(gs_conn* conn);
+
+/** Free array returned by gs_get_stats().
+ *
+ * @param stats Array of statistics.
+ * @param n_stats Number of items.
+ */
+void gs_stats_free(gs_stats* stats, int n_stats);
+
+/** Enable sharing of the connection by several threads.
+ *
+ * Must be called before the connection is passed to other threads. Driver
+ * calls are then serialized by per-connection lock and each thread sees only
+ * its own error state, so gs_get_errmsg() reports errors of the calling
+ * thread. Transaction started by gs_begin() is pinned to the calling thread,
+ * other threads wait until it is committed or rolled back. The same applies
+ * to batches and COPY. Query objects must not be shared, and
+ * GS_RESULT_STREAMING queries may only be executed inside a transaction.
+ *
+ * Sharing is meant for short autocommit queries of many threads, pool of
+ * connections (gs_pool_new()) is better for long running work.
+ *
+ * @param conn DB connection object.
+ *
+ * @return -1 on error, 0 on success.
+ */
+int gs_set_thread_safe(gs_conn* conn);
+
 /** Begin transaction on the given connection.
  *
  * @param conn DB connection object.
@@ -158,8 +500,15 @@ int gs_finish(gs_conn* conn);
  * as remaining parameters to exec.
  * @li s - const char*
  * @li i - int
+ * @li l - gint64
+ * @li d - double
+ * @li b - gboolean
+ * @li t - gint64, timestamp in microseconds since the Unix epoch (UTC)
  * @li ?i - int is_null, int val
  *
+ * Typed values are bound natively where backend allows it. sqlite stores 't'
+ * as integer, timestamps stored as text are recognized when reading.
+ *
  * @return -1 on error, 0 on success.
  *
  * Example:
@@ -191,6 +540,10 @@ void gs_query_free(gs_query* query);
  * @li s - const char**  - valid untill next gs_query_get call.
  * @li S - char**        - caller must free returned data using g_free
  * @li i - int*
+ * @li l - gint64*
+ * @li d - double*
+ * @li b - gboolean*
+ * @li t - gint64*       - timestamp in microseconds since the Unix epoch (UTC)
  * @li ?i - int* is_null, int* val
  *
  * @return -1 on error, 0 on success, 1 if no more rows avaliable.
@@ -202,21 +555,154 @@ int gs_query_get(gs_query* query, const char* fmt, ...);
  * @param query Query object.
  * @param fmt Format string that defines number and type of substitutions given
  * as remaining parameters to exec.
- * @li s - const char*
+ * @li s - const char*   - NULL is stored as SQL NULL
  * @li i - int
+ * @li l - gint64
+ * @li d - double
+ * @li b - gboolean
+ * @li t - gint64        - timestamp in microseconds since the Unix epoch (UTC)
  * @li ?i - int is_null, int val
  *
  * @return -1 on error, 0 on success.
  */
 int gs_query_put(gs_query* query, const char* fmt, ...);
 
+/** Get up to max_rows rows of the result into column arrays.
+ *
+ * Column N of the result is stored into columns[N]. Arrays of each column must
+ * have room for max_rows items, null bitmap for (max_rows + 7) / 8 bytes.
+ * String data is owned by the query and valid until next gs_query_get_batch()
+ * call. pgsql converts whole result columns at once, other backends read rows
+ * one by one.
+ *
+ * @param query Query object.
+ * @param columns Column buffers.
+ * @param n_columns Number of column buffers.
+ * @param max_rows Maximum number of rows to return, must be positive.
+ *
+ * @return -1 on error, number of rows stored, 0 if no more rows avaliable.
+ */
+int gs_query_get_batch(gs_query* query, gs_column_buffer* columns, int n_columns, int max_rows);
+
+/** Execute query once for each row of parameter arrays.
+ *
+ * Backends run rows in the cheapest way they have, pgsql sends all rows in
+ * one pipeline. A failed row does not stop execution of the following rows,
+ * though inside a transaction they will usually fail too.
+ *
+ * @param query Query object.
+ * @param columns Array of n_columns parameter columns, column N is used for
+ * substitution $N+1. NULL strings are passed as NULL.
+ * @param n_columns Number of columns.
+ * @param n_rows Number of rows.
+ * @param row_status Optional array of n_rows items that receives GS_ERR_NONE
+ * or error code of each row.
+ *
+ * @return -1 if any row failed (gs_get_errmsg() describes the first failure),
+ * 0 on success.
+ */
+int gs_query_put_array(gs_query* query, const gs_array_column* columns, int n_columns, int n_rows, int* row_status);
+
+/** Compile format string for gs_query_put_plan() and gs_query_get_plan().
+ *
+ * Format string is parsed only once and the plan may be used with any number
+ * of queries. gs_query_put() and gs_query_get() keep plan of the last format
+ * string used with each query, so explicit plans are useful mainly when one
+ * query is used with several format strings.
+ *
+ * @param fmt Format string as for gs_query_put() or gs_query_get().
+ *
+ * @return New plan or NULL if format string is invalid.
+ */
+gs_plan* gs_plan_new(const char* fmt);
+
+/** Free plan created by gs_plan_new().
+ *
+ * @param plan Plan object.
+ */
+void gs_plan_free(gs_plan* plan);
+
+/** Same as gs_query_put() with precompiled format string.
+ *
+ * @param query Query object.
+ * @param plan Plan of the format string.
+ *
+ * @return -1 on error, 0 on success.
+ */
+int gs_query_put_plan(gs_query* query, const gs_plan* plan, ...);
+
+/** Same as gs_query_get() with precompiled format string.
+ *
+ * @param query Query object.
+ * @param plan Plan of the format string.
+ *
+ * @return -1 on error, 0 on success, 1 if no more rows avaliable.
+ */
+int gs_query_get_plan(gs_query* query, const gs_plan* plan, ...);
+
+/** Start execution of the query without blocking the caller.
+ *
+ * Parameters are copied before the function returns. The query and its
+ * connection must not be used until the callback is invoked in the
+ * thread-default main context of the caller; then call gs_query_put_finish()
+ * and read rows as usual. Backends without native asynchronous interface run
+ * the query in a worker thread.
+ *
+ * @param query Query object.
+ * @param cancellable Optional GCancellable, cancelling it asks the server to
+ * abort the query.
+ * @param callback Called when the query completes.
+ * @param user_data Data passed to the callback.
+ * @param fmt Format string, same as for gs_query_put().
+ */
+void gs_query_put_async(gs_query* query, GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data, const char* fmt, ...);
+
+/** Finish execution started by gs_query_put_async().
+ *
+ * @param query Query object.
+ * @param result GAsyncResult passed to the callback.
+ *
+ * @return -1 on error (including cancellation), 0 on success.
+ */
+int gs_query_put_finish(gs_query* query, GAsyncResult* result);
+
+/** Set how query result is retrieved from the server.
+ *
+ * Must be called before gs_query_put(). In GS_RESULT_STREAMING mode rows are
+ * retrieved as gs_query_get() asks for them, so memory use does not depend on
+ * result size. Until all rows are read (or query is freed), no other command
+ * may be executed on the same connection. In GS_RESULT_BUFFERED mode the
+ * whole result is read during gs_query_put(), so gs_query_get_rows() is cheap
+ * and the statement does not hold server resources while rows are processed.
+ *
+ * @param query Query object.
+ * @param mode Result mode, see enum _gs_result_modes.
+ *
+ * @return -1 if backend does not support the mode, 0 on success.
+ */
+int gs_query_set_result_mode(gs_query* query, int mode);
+
+/** Set how many rows are fetched from the server at once in
+ * GS_RESULT_STREAMING mode.
+ *
+ * This is only a hint, backends that fetch streamed rows one by one ignore
+ * it. Must be called before gs_query_put().
+ *
+ * @param query Query object.
+ * @param rows Number of rows, 0 selects backend default.
+ *
+ * @return -1 on error, 0 on success.
+ */
+int gs_query_set_fetch_size(gs_query* query, int rows);
+
 /** Return number of rows that given query returns.
  *
  * May be only called after successfull gs_query_put.
  *
  * @param query Query object.
  *
- * @return -1 on error, number of rows on success.
+ * @return -1 on error, GS_ROWS_UNKNOWN in GS_RESULT_STREAMING mode, number of
+ * rows on success.
  */
 int gs_query_get_rows(gs_query* query);
 
@@ -231,10 +717,233 @@ int gs_query_get_rows(gs_query* query);
  */
 int gs_query_get_last_id(gs_query* query, const char* seq_name);
 
+/** Same as gs_query_get_last_id() for IDs that do not fit into int.
+ *
+ * @param query Query object.
+ * @param seq_name Postgresql backend requires sequence name.
+ *
+ * @return -1 on error, positive ID on success.
+ */
+gint64 gs_query_get_last_id64(gs_query* query, const char* seq_name);
+
+/** Create connection pool.
+ *
+ * Pool hands out ready to use connections to the same database and may be
+ * shared by many threads.
+ *
+ * @param dsn DSN passed to gs_connect() when pool needs new connection.
+ * @param min_size Number of connections opened immediately and never evicted
+ * for being idle.
+ * @param max_size Maximum number of connections (idle and checked out).
+ *
+ * @return NULL on invalid arguments, gs_pool object on success.
+ */
+gs_pool* gs_pool_new(const char* dsn, int min_size, int max_size);
+
+/** Free connection pool and disconnect all idle connections.
+ *
+ * All connections taken from the pool must be returned using gs_pool_put()
+ * before calling this function.
+ *
+ * @param pool Pool object.
+ */
+void gs_pool_free(gs_pool* pool);
+
+/** Set how long may connection stay unused in the pool before it is
+ * disconnected. Pool never shrinks below its min_size.
+ *
+ * @param pool Pool object.
+ * @param seconds Idle timeout, 0 disables eviction (default).
+ */
+void gs_pool_set_idle_timeout(gs_pool* pool, int seconds);
+
+/** Use result cache for all connections of the pool, see
+ * gs_set_result_cache(). It applies to connections taken by gs_pool_get()
+ * later.
+ *
+ * @param pool Pool object.
+ * @param cache Result cache object, NULL disables caching.
+ */
+void gs_pool_set_result_cache(gs_pool* pool, gs_result_cache* cache);
+
+/** Take connection from the pool.
+ *
+ * If no idle connection is available and pool is not full, new connection is
+ * created. Like with gs_connect(), user must check for connection error using
+ * gs_get_errcode() and return such connection back to the pool.
+ *
+ * @param pool Pool object.
+ * @param timeout_ms How long to wait for connection when pool is full, 0 means
+ * don't wait, -1 wait forever.
+ *
+ * @return NULL on timeout, gs_conn object otherwise.
+ */
+gs_conn* gs_pool_get(gs_pool* pool, int timeout_ms);
+
+/** Return connection to the pool.
+ *
+ * Unfinished transaction is rolled back and error state is cleared. Broken
+ * connections are disconnected.
+ *
+ * @param pool Pool object.
+ * @param conn DB connection object obtained from gs_pool_get(). All queries
+ * associated with this connection must be freed.
+ */
+void gs_pool_put(gs_pool* pool, gs_conn* conn);
+
+/** Start batch of statements.
+ *
+ * Statements added to the batch using gs_batch_add() may be sent to the server
+ * back to back without waiting for their results (pgsql pipeline mode). Until
+ * gs_batch_flush() is called, no other command may be executed on the
+ * connection. Backends without pipelining execute statements immediately.
+ *
+ * If batch is not enclosed in transaction, pgsql runs the whole batch in
+ * implicit transaction, so error rolls back all its statements.
+ *
+ * @param conn DB connection object.
+ *
+ * @return -1 on error, 0 on success.
+ */
+int gs_batch_begin(gs_conn* conn);
+
+/** Add statement to the batch.
+ *
+ * @param conn DB connection object.
+ * @param sql_string SQL command. This may contain $N substitutions.
+ * @param fmt Format string, same as for gs_exec().
+ *
+ * @return -1 on error, 0 on success. Errors of pipelined statements are
+ * reported by gs_batch_flush().
+ */
+int gs_batch_add(gs_conn* conn, const char* sql_string, const char* fmt, ...);
+
+/** Execute remaining statements of the batch and collect their results.
+ *
+ * @param conn DB connection object.
+ *
+ * @return -1 on error, 0 on success. On error gs_get_errcode() returns error
+ * code of the first failed statement and gs_batch_get_error_index() its
+ * position. Statements after the failed one are not executed.
+ */
+int gs_batch_flush(gs_conn* conn);
+
+/** Get position of the first failed statement in the last batch.
+ *
+ * @param conn DB connection object.
+ *
+ * @return Zero based index of the statement in order of gs_batch_add() calls,
+ * -1 if no statement failed.
+ */
+int gs_batch_get_error_index(gs_conn* conn);
+
+/** Start bulk load of rows into the table.
+ *
+ * pgsql uses COPY FROM STDIN protocol. Other backends insert rows using single
+ * prepared statement inside transaction (started by this function if the
+ * connection is not in transaction yet and finished by gs_copy_finish()).
+ *
+ * No other command may be executed on the connection until copy is finished
+ * or aborted.
+ *
+ * @param conn DB connection object.
+ * @param table Table name.
+ * @param columns Comma separated list of columns that gs_copy_put() provides.
+ *
+ * @return NULL on error, gs_copy object on success.
+ */
+gs_copy* gs_copy_in_new(gs_conn* conn, const char* table, const char* columns);
+
+/** Add row to the bulk load.
+ *
+ * Rows may be buffered and sent to the server in larger chunks.
+ *
+ * @param copy Copy object.
+ * @param fmt Format string, same as for gs_query_put(), one value for each
+ * column.
+ *
+ * @return -1 on error, 0 on success.
+ */
+int gs_copy_put(gs_copy* copy, const char* fmt, ...);
+
+/** Finish bulk load or export and free copy object.
+ *
+ * When loading, remaining rows are sent. If error was set, bulk load is
+ * aborted instead. Unread rows of export are discarded.
+ *
+ * @param copy Copy object.
+ *
+ * @return -1 on error, 0 on success.
+ */
+int gs_copy_finish(gs_copy* copy);
+
+/** Abort bulk load or export and free copy object. When loading, no rows are
+ * loaded.
+ *
+ * @param copy Copy object.
+ */
+void gs_copy_abort(gs_copy* copy);
+
+/** Export query result in PostgreSQL COPY text format.
+ *
+ * Data are passed to the callback in chunks, memory use does not depend on
+ * result size. Only pgsql backend supports this.
+ *
+ * @param conn DB connection object.
+ * @param sql_string SELECT query (without parameters).
+ * @param func Callback receiving chunks of data, each chunk ends at row
+ * boundary.
+ * @param user_data Data passed to callback.
+ *
+ * @return -1 on error or if callback stopped copying, 0 on success.
+ */
+int gs_copy_out(gs_conn* conn, const char* sql_string, gs_copy_out_func func, gpointer user_data);
+
+/** Export query result in PostgreSQL COPY text format to a stream.
+ *
+ * The same as gs_copy_out() with chunks written to the stream. Write error
+ * stops copying and its message is set as connection error.
+ *
+ * @param conn DB connection object.
+ * @param sql_string SELECT query (without parameters).
+ * @param stream Output stream, it is not closed.
+ * @param cancellable Optional GCancellable object, NULL to ignore.
+ *
+ * @return -1 on error, 0 on success.
+ */
+int gs_copy_out_stream(gs_conn* conn, const char* sql_string, GOutputStream* stream, GCancellable* cancellable);
+
+/** Start bulk export of query result read row by row using gs_copy_get().
+ *
+ * pgsql uses COPY TO STDOUT protocol, other backends execute the query. Copy
+ * object must be freed using gs_copy_finish() or gs_copy_abort().
+ *
+ * @param conn DB connection object.
+ * @param sql_string SELECT query (without parameters).
+ *
+ * @return NULL on error, gs_copy object on success.
+ */
+gs_copy* gs_copy_out_new(gs_conn* conn, const char* sql_string);
+
+/** Get next row of the bulk export.
+ *
+ * @param copy Copy object.
+ * @param fmt Format string, same as for gs_query_get(). With pgsql all values
+ * are received as text, 's' strings are valid until next gs_copy_get() call.
+ *
+ * @return -1 on error, 0 on success, 1 if no more rows avaliable.
+ */
+int gs_copy_get(gs_copy* copy, const char* fmt, ...);
+
 /* for advanced users :-) */
 
 int gs_query_putv(gs_query* query, const char* fmt, va_list ap);
 int gs_query_getv(gs_query* query, const char* fmt, va_list ap);
+int gs_query_put_planv(gs_query* query, const gs_plan* plan, va_list ap);
+int gs_query_get_planv(gs_query* query, const gs_plan* plan, va_list ap);
+int gs_batch_addv(gs_conn* conn, const char* sql_string, const char* fmt, va_list ap);
+int gs_copy_putv(gs_copy* copy, const char* fmt, va_list ap);
+int gs_copy_getv(gs_copy* copy, const char* fmt, va_list ap);
 
 G_END_DECLS
 